@@ -0,0 +1,267 @@
+
+#ifndef EC_BIT_PLANES_HPP
+#define EC_BIT_PLANES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <utility>
+
+namespace EC
+{
+    /*!
+        \brief A fixed number of bit vectors (planes) of equal length, used
+            by EC::Manager to index which Entities own each Component and Tag.
+
+        Bits are set and cleared atomically, so different threads may change
+        bits of different Entities at the same time even if they share a
+        word. Each plane keeps a version that changes whenever a bit of the
+        plane changes, which lets count() cache the number of set bits.
+    */
+    class BitPlanes
+    {
+    public:
+        explicit BitPlanes(std::size_t planeCount = 0) :
+        planeCount(planeCount),
+        versions(new std::atomic<std::size_t>[planeCount]),
+        counts(new std::atomic<std::size_t>[planeCount]),
+        countedVersions(new std::atomic<std::size_t>[planeCount])
+        {
+            for(std::size_t i = 0; i < planeCount; ++i)
+            {
+                versions[i].store(1, std::memory_order_relaxed);
+                counts[i].store(0, std::memory_order_relaxed);
+                countedVersions[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        BitPlanes(const BitPlanes& other) :
+        BitPlanes(other.planeCount)
+        {
+            *this = other;
+        }
+
+        BitPlanes(BitPlanes&& other) :
+        BitPlanes()
+        {
+            swap(other);
+        }
+
+        BitPlanes& operator=(BitPlanes&& other)
+        {
+            swap(other);
+            return *this;
+        }
+
+        BitPlanes& operator=(const BitPlanes& other)
+        {
+            if(this == &other)
+            {
+                return *this;
+            }
+            if(planeCount != other.planeCount)
+            {
+                BitPlanes planes(other.planeCount);
+                swap(planes);
+            }
+            words.reset(new std::atomic<std::uint64_t>[
+                planeCount * other.wordCount]);
+            wordCount = other.wordCount;
+            for(std::size_t i = 0; i < planeCount * wordCount; ++i)
+            {
+                words[i].store(other.words[i].load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+            }
+            for(std::size_t i = 0; i < planeCount; ++i)
+            {
+                markChanged(i);
+            }
+            return *this;
+        }
+
+        /*!
+            \brief Resizes each plane to hold at least the given number of
+                bits, keeping the existing bits. New bits are cleared.
+        */
+        void resize(std::size_t bitCount)
+        {
+            std::size_t newWordCount = (bitCount + 63) / 64;
+            if(newWordCount <= wordCount)
+            {
+                return;
+            }
+            std::unique_ptr<std::atomic<std::uint64_t>[]> newWords(
+                new std::atomic<std::uint64_t>[planeCount * newWordCount]);
+            for(std::size_t plane = 0; plane < planeCount; ++plane)
+            {
+                for(std::size_t i = 0; i < newWordCount; ++i)
+                {
+                    newWords[plane * newWordCount + i].store(
+                        i < wordCount ? getWord(plane, i) : 0,
+                        std::memory_order_relaxed);
+                }
+            }
+            words = std::move(newWords);
+            wordCount = newWordCount;
+        }
+
+        /*!
+            \brief Clears all bits of all planes.
+        */
+        void clear()
+        {
+            for(std::size_t i = 0; i < planeCount * wordCount; ++i)
+            {
+                words[i].store(0, std::memory_order_relaxed);
+            }
+            for(std::size_t i = 0; i < planeCount; ++i)
+            {
+                markChanged(i);
+            }
+        }
+
+        /*!
+            \brief Sets or clears a bit of a plane.
+        */
+        void set(std::size_t plane, std::size_t index, bool value)
+        {
+            std::atomic<std::uint64_t>& word =
+                words[plane * wordCount + index / 64];
+            std::uint64_t bit = std::uint64_t(1) << (index % 64);
+            std::uint64_t old = value
+                ? word.fetch_or(bit, std::memory_order_relaxed)
+                : word.fetch_and(~bit, std::memory_order_relaxed);
+            if(((old & bit) != 0) != value)
+            {
+                markChanged(plane);
+            }
+        }
+
+        /*!
+            \brief Clears the bits of mask in the given word (bits
+                [64 * index, 64 * index + 64)) of a plane.
+        */
+        void clearWord(std::size_t plane, std::size_t index,
+            std::uint64_t mask)
+        {
+            std::uint64_t old = words[plane * wordCount + index].fetch_and(
+                ~mask, std::memory_order_relaxed);
+            if((old & mask) != 0)
+            {
+                markChanged(plane);
+            }
+        }
+
+        /*!
+            \brief Returns the given word (bits [64 * index, 64 * index + 64))
+                of a plane.
+        */
+        std::uint64_t getWord(std::size_t plane, std::size_t index) const
+        {
+            return words[plane * wordCount + index].load(
+                std::memory_order_relaxed);
+        }
+
+        /*!
+            \brief Returns the number of words of each plane.
+        */
+        std::size_t getWordCount() const
+        {
+            return wordCount;
+        }
+
+        /*!
+            \brief Returns the number of set bits of a plane.
+
+            The count is cached and only recomputed if the plane changed
+            since the last call. If bits are changed while this function
+            runs, the result is only an estimate.
+
+            May be called from several threads at the same time.
+        */
+        std::size_t count(std::size_t plane) const
+        {
+            // The cache works as a sequence lock: a thread caching a count
+            // first sets countedVersions to cachingVersion, so a count is
+            // only used if countedVersions was the current version both
+            // before and after reading it.
+            std::size_t version = versions[plane].load(
+                std::memory_order_acquire);
+            std::size_t counted = countedVersions[plane].load(
+                std::memory_order_acquire);
+            if(counted == version)
+            {
+                std::size_t result = counts[plane].load(
+                    std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(countedVersions[plane].load(std::memory_order_relaxed)
+                    == counted)
+                {
+                    return result;
+                }
+            }
+            std::size_t result = 0;
+            for(std::size_t i = 0; i < wordCount; ++i)
+            {
+                result += popcount(getWord(plane, i));
+            }
+            // Another thread caching a count leaves this one uncached.
+            if(counted != cachingVersion
+                && countedVersions[plane].compare_exchange_strong(counted,
+                    cachingVersion, std::memory_order_relaxed))
+            {
+                std::atomic_thread_fence(std::memory_order_release);
+                counts[plane].store(result, std::memory_order_relaxed);
+                countedVersions[plane].store(version,
+                    std::memory_order_release);
+            }
+            return result;
+        }
+
+    private:
+        static std::size_t popcount(std::uint64_t word)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_popcountll(word);
+#else
+            std::size_t count = 0;
+            while(word != 0)
+            {
+                word &= word - 1;
+                ++count;
+            }
+            return count;
+#endif
+        }
+
+        // Releases the change of the plane's bits to a count() that sees
+        // the new version.
+        void markChanged(std::size_t plane)
+        {
+            versions[plane].fetch_add(1, std::memory_order_release);
+        }
+
+        void swap(BitPlanes& other)
+        {
+            std::swap(planeCount, other.planeCount);
+            std::swap(wordCount, other.wordCount);
+            std::swap(words, other.words);
+            std::swap(versions, other.versions);
+            std::swap(counts, other.counts);
+            std::swap(countedVersions, other.countedVersions);
+        }
+
+        // Never a version, nor 0 for planes never counted.
+        static constexpr std::size_t cachingVersion = ~std::size_t(0);
+
+        std::size_t planeCount = 0;
+        std::size_t wordCount = 0;
+        std::unique_ptr<std::atomic<std::uint64_t>[]> words;
+        std::unique_ptr<std::atomic<std::size_t>[]> versions;
+        mutable std::unique_ptr<std::atomic<std::size_t>[]> counts;
+        mutable std::unique_ptr<std::atomic<std::size_t>[]> countedVersions;
+    };
+}
+
+#endif
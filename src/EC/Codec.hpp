@@ -0,0 +1,724 @@
+
+#ifndef EC_CODEC_HPP
+#define EC_CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <type_traits>
+
+#include "Executor.hpp"
+
+#define EC_CODEC_BLOCK_SIZE 128
+
+namespace EC
+{
+    namespace Codec
+    {
+        using Buffer = std::vector<unsigned char>;
+
+        /*!
+            \brief The encodings available for a column of values.
+
+            Raw stores the bytes unchanged. Delta stores the zigzag encoded
+            difference to the previous value, bit packed in blocks of
+            EC_CODEC_BLOCK_SIZE values, which suits integers that change
+            slowly from one Entity to the next. Xor stores the bits that
+            differ from the previous value, which suits floating point values.
+            RunLength stores runs of equal values, which suits flags and
+            bitsets.
+        */
+        enum class ColumnEncoding : unsigned char
+        {
+            Raw = 0,
+            Delta = 1,
+            Xor = 2,
+            RunLength = 3
+        };
+
+        /*!
+            \brief Selects the encoding used for a column of type T.
+
+            Floating point types default to Xor and all other types default
+            to Delta. Non scalar types are split into 32 bit lanes (or byte
+            lanes if their size is not a multiple of 4) and each lane is
+            encoded separately. Specialize this for Components holding
+            floating point fields.
+
+            Example:
+            \code{.cpp}
+                template <>
+                struct EC::Codec::ColumnEncodingOf<Position>
+                {
+                    static constexpr EC::Codec::ColumnEncoding value =
+                        EC::Codec::ColumnEncoding::Xor;
+                };
+            \endcode
+        */
+        template <typename T>
+        struct ColumnEncodingOf
+        {
+            static constexpr ColumnEncoding value =
+                std::is_floating_point<T>::value
+                    ? ColumnEncoding::Xor : ColumnEncoding::Delta;
+        };
+
+        template <typename T>
+        constexpr ColumnEncoding ColumnEncodingOf<T>::value;
+
+        inline void writeVarint(Buffer& out, std::uint64_t value)
+        {
+            while(value >= 0x80)
+            {
+                out.push_back((unsigned char)(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back((unsigned char)value);
+        }
+
+        inline bool readVarint(const unsigned char* data, std::size_t size,
+            std::size_t& pos, std::uint64_t& value)
+        {
+            value = 0;
+            for(unsigned int shift = 0; shift < 64; shift += 7)
+            {
+                if(pos >= size)
+                {
+                    return false;
+                }
+                unsigned char byte = data[pos++];
+                value |= (std::uint64_t)(byte & 0x7F) << shift;
+                if((byte & 0x80) == 0)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        inline std::uint64_t zigzagEncode(std::int64_t value)
+        {
+            return ((std::uint64_t)value << 1)
+                ^ (std::uint64_t)(value >> 63);
+        }
+
+        inline std::int64_t zigzagDecode(std::uint64_t value)
+        {
+            return (std::int64_t)(value >> 1) ^ -(std::int64_t)(value & 1);
+        }
+
+        inline unsigned int countLeadingZeros(std::uint64_t value)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return value == 0 ? 64 : __builtin_clzll(value);
+#else
+            unsigned int count = 0;
+            for(std::uint64_t bit = std::uint64_t(1) << 63;
+                bit != 0 && (value & bit) == 0;
+                bit >>= 1)
+            {
+                ++count;
+            }
+            return count;
+#endif
+        }
+
+        inline unsigned int countTrailingZeros(std::uint64_t value)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return value == 0 ? 64 : __builtin_ctzll(value);
+#else
+            unsigned int count = 0;
+            while(count < 64 && ((value >> count) & 1) == 0)
+            {
+                ++count;
+            }
+            return count;
+#endif
+        }
+
+        inline std::uint64_t laneMask(unsigned int laneBits)
+        {
+            return laneBits >= 64
+                ? ~std::uint64_t(0) : (std::uint64_t(1) << laneBits) - 1;
+        }
+
+        /*
+            Appends bits to a buffer, least significant bit first.
+        */
+        class BitWriter
+        {
+        public:
+            explicit BitWriter(Buffer& out) :
+            out(out)
+            {}
+
+            void write(std::uint64_t value, unsigned int bitCount)
+            {
+                if(bitCount == 0)
+                {
+                    return;
+                }
+                value &= laneMask(bitCount);
+                accumulator |= value << used;
+                if(used + bitCount >= 64)
+                {
+                    for(unsigned int i = 0; i < 8; ++i)
+                    {
+                        out.push_back((unsigned char)(accumulator >> (8 * i)));
+                    }
+                    unsigned int consumed = 64 - used;
+                    accumulator = consumed == 64 ? 0 : value >> consumed;
+                    used = used + bitCount - 64;
+                }
+                else
+                {
+                    used += bitCount;
+                }
+            }
+
+            void flush()
+            {
+                for(unsigned int i = 0; i * 8 < used; ++i)
+                {
+                    out.push_back((unsigned char)(accumulator >> (8 * i)));
+                }
+                accumulator = 0;
+                used = 0;
+            }
+
+        private:
+            Buffer& out;
+            std::uint64_t accumulator = 0;
+            unsigned int used = 0;
+        };
+
+        /*
+            Reads bits written by BitWriter.
+        */
+        class BitReader
+        {
+        public:
+            BitReader(const unsigned char* data, std::size_t size,
+                std::size_t pos) :
+            data(data),
+            size(size),
+            pos(pos)
+            {}
+
+            bool read(std::uint64_t& value, unsigned int bitCount)
+            {
+                value = 0;
+                unsigned int read = 0;
+                while(read < bitCount)
+                {
+                    if(pos >= size)
+                    {
+                        return false;
+                    }
+                    unsigned int take = 8 - used;
+                    if(take > bitCount - read)
+                    {
+                        take = bitCount - read;
+                    }
+                    std::uint64_t bits = (data[pos] >> used) & laneMask(take);
+                    value |= bits << read;
+                    read += take;
+                    used += take;
+                    if(used == 8)
+                    {
+                        ++pos;
+                        used = 0;
+                    }
+                }
+                return true;
+            }
+
+            // Returns the position of the first byte after the read bits.
+            std::size_t end() const
+            {
+                return used == 0 ? pos : pos + 1;
+            }
+
+        private:
+            const unsigned char* data;
+            std::size_t size;
+            std::size_t pos;
+            unsigned int used = 0;
+        };
+
+        inline std::int64_t signExtend(std::uint64_t value,
+            unsigned int laneBits)
+        {
+            if(laneBits == 64)
+            {
+                return (std::int64_t)value;
+            }
+            std::uint64_t sign = std::uint64_t(1) << (laneBits - 1);
+            value &= laneMask(laneBits);
+            return (std::int64_t)((value ^ sign) - sign);
+        }
+
+        /*!
+            \brief Appends count values of laneBits bits using the Delta
+                encoding.
+
+            The first value is stored as a zigzag encoded varint so that it
+            does not widen the bit packing of the first block.
+        */
+        inline void encodeDelta(const std::uint64_t* values, std::size_t count,
+            unsigned int laneBits, Buffer& out)
+        {
+            if(count == 0)
+            {
+                return;
+            }
+            std::uint64_t previous = values[0];
+            writeVarint(out, zigzagEncode(signExtend(previous, laneBits)));
+
+            std::uint64_t block[EC_CODEC_BLOCK_SIZE];
+            for(std::size_t begin = 1; begin < count;
+                begin += EC_CODEC_BLOCK_SIZE)
+            {
+                std::size_t blockSize = count - begin < EC_CODEC_BLOCK_SIZE
+                    ? count - begin : EC_CODEC_BLOCK_SIZE;
+                std::uint64_t combined = 0;
+                for(std::size_t i = 0; i < blockSize; ++i)
+                {
+                    block[i] = zigzagEncode(signExtend(
+                        values[begin + i] - previous, laneBits));
+                    previous = values[begin + i];
+                    combined |= block[i];
+                }
+
+                unsigned int width = 64 - countLeadingZeros(combined);
+                out.push_back((unsigned char)width);
+                BitWriter writer(out);
+                for(std::size_t i = 0; i < blockSize; ++i)
+                {
+                    writer.write(block[i], width);
+                }
+                writer.flush();
+            }
+        }
+
+        inline bool decodeDelta(const unsigned char* data, std::size_t size,
+            std::size_t& pos, std::uint64_t* values, std::size_t count,
+            unsigned int laneBits)
+        {
+            if(count == 0)
+            {
+                return true;
+            }
+            std::uint64_t previous;
+            if(!readVarint(data, size, pos, previous))
+            {
+                return false;
+            }
+            previous = (std::uint64_t)zigzagDecode(previous)
+                & laneMask(laneBits);
+            values[0] = previous;
+
+            for(std::size_t begin = 1; begin < count;
+                begin += EC_CODEC_BLOCK_SIZE)
+            {
+                std::size_t blockSize = count - begin < EC_CODEC_BLOCK_SIZE
+                    ? count - begin : EC_CODEC_BLOCK_SIZE;
+                if(pos >= size || data[pos] > 64)
+                {
+                    return false;
+                }
+                unsigned int width = data[pos++];
+                BitReader reader(data, size, pos);
+                for(std::size_t i = 0; i < blockSize; ++i)
+                {
+                    std::uint64_t zigzag;
+                    if(!reader.read(zigzag, width))
+                    {
+                        return false;
+                    }
+                    previous = (previous + (std::uint64_t)zigzagDecode(zigzag))
+                        & laneMask(laneBits);
+                    values[begin + i] = previous;
+                }
+                pos = reader.end();
+            }
+            return true;
+        }
+
+        /*!
+            \brief Appends count values using the Xor encoding.
+
+            Each value is stored as a single 0 bit if it equals the previous
+            value, otherwise as a 1 bit followed by the position and the
+            bits of the meaningful part of its xor with the previous value.
+        */
+        inline void encodeXor(const std::uint64_t* values, std::size_t count,
+            Buffer& out)
+        {
+            std::uint64_t previous = 0;
+            BitWriter writer(out);
+            for(std::size_t i = 0; i < count; ++i)
+            {
+                std::uint64_t difference = values[i] ^ previous;
+                previous = values[i];
+                if(difference == 0)
+                {
+                    writer.write(0, 1);
+                    continue;
+                }
+                unsigned int leading = countLeadingZeros(difference);
+                unsigned int trailing = countTrailingZeros(difference);
+                unsigned int meaningful = 64 - leading - trailing;
+                writer.write(1, 1);
+                writer.write(trailing, 6);
+                writer.write(meaningful - 1, 6);
+                writer.write(difference >> trailing, meaningful);
+            }
+            writer.flush();
+        }
+
+        inline bool decodeXor(const unsigned char* data, std::size_t size,
+            std::size_t& pos, std::uint64_t* values, std::size_t count)
+        {
+            std::uint64_t previous = 0;
+            BitReader reader(data, size, pos);
+            for(std::size_t i = 0; i < count; ++i)
+            {
+                std::uint64_t changed, trailing, meaningful, bits;
+                if(!reader.read(changed, 1))
+                {
+                    return false;
+                }
+                if(changed)
+                {
+                    if(!reader.read(trailing, 6)
+                        || !reader.read(meaningful, 6)
+                        || trailing + meaningful + 1 > 64
+                        || !reader.read(bits, meaningful + 1))
+                    {
+                        return false;
+                    }
+                    previous ^= bits << trailing;
+                }
+                values[i] = previous;
+            }
+            pos = reader.end();
+            return true;
+        }
+
+        /*!
+            \brief Appends count values using the RunLength encoding.
+        */
+        inline void encodeRunLength(const std::uint64_t* values,
+            std::size_t count, Buffer& out)
+        {
+            std::size_t i = 0;
+            while(i < count)
+            {
+                std::size_t run = 1;
+                while(i + run < count && values[i + run] == values[i])
+                {
+                    ++run;
+                }
+                writeVarint(out, run);
+                writeVarint(out, values[i]);
+                i += run;
+            }
+        }
+
+        inline bool decodeRunLength(const unsigned char* data,
+            std::size_t size, std::size_t& pos, std::uint64_t* values,
+            std::size_t count)
+        {
+            std::size_t i = 0;
+            while(i < count)
+            {
+                std::uint64_t run, value;
+                if(!readVarint(data, size, pos, run)
+                    || !readVarint(data, size, pos, value)
+                    || run == 0 || run > count - i)
+                {
+                    return false;
+                }
+                for(std::uint64_t j = 0; j < run; ++j)
+                {
+                    values[i++] = value;
+                }
+            }
+            return true;
+        }
+
+        /*
+            Describes how values of type T are split into lanes. Scalars of
+            1, 2, 4 or 8 bytes are a single lane, other types are split into
+            32 bit lanes or byte lanes.
+        */
+        template <typename T>
+        struct LaneLayout
+        {
+            static constexpr bool scalar = std::is_arithmetic<T>::value
+                && (sizeof(T) == 1 || sizeof(T) == 2
+                    || sizeof(T) == 4 || sizeof(T) == 8);
+            static constexpr std::size_t laneBytes = scalar
+                ? sizeof(T) : (sizeof(T) % 4 == 0 ? 4 : 1);
+            static constexpr std::size_t laneCount = sizeof(T) / laneBytes;
+        };
+
+        template <typename T>
+        void encodeChunk(const T* data, std::size_t count,
+            ColumnEncoding encoding, Buffer& out)
+        {
+            using Layout = LaneLayout<T>;
+            if(encoding == ColumnEncoding::Raw)
+            {
+                const unsigned char* bytes = (const unsigned char*) data;
+                out.insert(out.end(), bytes, bytes + count * sizeof(T));
+                return;
+            }
+
+            std::vector<std::uint64_t> lane(count);
+            for(std::size_t l = 0; l < Layout::laneCount; ++l)
+            {
+                const unsigned char* bytes =
+                    (const unsigned char*) data + l * Layout::laneBytes;
+                for(std::size_t i = 0; i < count; ++i)
+                {
+                    std::uint64_t value = 0;
+                    std::memcpy(&value, bytes + i * sizeof(T),
+                        Layout::laneBytes);
+                    lane[i] = value;
+                }
+
+                switch(encoding)
+                {
+                case ColumnEncoding::Delta:
+                    encodeDelta(lane.data(), count, Layout::laneBytes * 8, out);
+                    break;
+                case ColumnEncoding::Xor:
+                    encodeXor(lane.data(), count, out);
+                    break;
+                default:
+                    encodeRunLength(lane.data(), count, out);
+                    break;
+                }
+            }
+        }
+
+        template <typename T>
+        bool decodeChunk(const unsigned char* data, std::size_t size,
+            T* out, std::size_t count, ColumnEncoding encoding)
+        {
+            using Layout = LaneLayout<T>;
+            std::size_t pos = 0;
+            if(encoding == ColumnEncoding::Raw)
+            {
+                if(size != count * sizeof(T))
+                {
+                    return false;
+                }
+                std::memcpy((void*) out, data, size);
+                return true;
+            }
+
+            std::vector<std::uint64_t> lane(count);
+            for(std::size_t l = 0; l < Layout::laneCount; ++l)
+            {
+                bool decoded;
+                switch(encoding)
+                {
+                case ColumnEncoding::Delta:
+                    decoded = decodeDelta(data, size, pos, lane.data(), count,
+                        Layout::laneBytes * 8);
+                    break;
+                case ColumnEncoding::Xor:
+                    decoded = decodeXor(data, size, pos, lane.data(), count);
+                    break;
+                case ColumnEncoding::RunLength:
+                    decoded = decodeRunLength(data, size, pos, lane.data(),
+                        count);
+                    break;
+                default:
+                    decoded = false;
+                    break;
+                }
+                if(!decoded)
+                {
+                    return false;
+                }
+
+                unsigned char* bytes =
+                    (unsigned char*) out + l * Layout::laneBytes;
+                for(std::size_t i = 0; i < count; ++i)
+                {
+                    std::memcpy(bytes + i * sizeof(T), &lane[i],
+                        Layout::laneBytes);
+                }
+            }
+            return pos == size;
+        }
+
+        /*
+            Calls function(chunk) for every chunk in [0, chunkCount), split
+            across up to threadCount tasks of executor, or of
+            EC::ThreadPool::getDefault() if executor is nullptr.
+        */
+        template <typename Function>
+        void forEachChunk(std::size_t chunkCount, std::size_t threadCount,
+            EC::Executor* executor, Function&& function)
+        {
+            if(threadCount > chunkCount)
+            {
+                threadCount = chunkCount;
+            }
+            if(threadCount <= 1)
+            {
+                for(std::size_t chunk = 0; chunk < chunkCount; ++chunk)
+                {
+                    function(chunk);
+                }
+                return;
+            }
+
+            (executor ? *executor : EC::ThreadPool::getDefault()).parallelFor(
+                threadCount,
+                [&function, chunkCount, threadCount] (std::size_t first) {
+                    for(std::size_t chunk = first; chunk < chunkCount;
+                        chunk += threadCount)
+                    {
+                        function(chunk);
+                    }
+                });
+        }
+
+        /*!
+            \brief Appends a column of count values to out.
+
+            The column is split into chunks of chunkSize values that are
+            encoded independently by up to threadCount threads, run by
+            executor (default EC::ThreadPool::getDefault()).
+
+            T must be trivially copyable.
+        */
+        template <typename T>
+        void encodeColumn(const T* data, std::size_t count,
+            ColumnEncoding encoding, Buffer& out,
+            std::size_t chunkSize, std::size_t threadCount = 1,
+            EC::Executor* executor = nullptr)
+        {
+            static_assert(std::is_trivially_copyable<T>::value,
+                "Columns must be trivially copyable to be encoded");
+
+            if(chunkSize == 0)
+            {
+                chunkSize = 1;
+            }
+            std::size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+            std::vector<Buffer> chunks(chunkCount);
+            forEachChunk(chunkCount, threadCount, executor,
+            [&] (std::size_t chunk) {
+                std::size_t begin = chunk * chunkSize;
+                std::size_t end = begin + chunkSize < count
+                    ? begin + chunkSize : count;
+                encodeChunk(data + begin, end - begin, encoding,
+                    chunks[chunk]);
+            });
+
+            out.push_back((unsigned char)encoding);
+            writeVarint(out, count);
+            writeVarint(out, chunkSize);
+            for(const auto& chunk : chunks)
+            {
+                writeVarint(out, chunk.size());
+            }
+            for(const auto& chunk : chunks)
+            {
+                out.insert(out.end(), chunk.begin(), chunk.end());
+            }
+        }
+
+        /*!
+            \brief Decodes a column written by encodeColumn() starting at pos
+                into count values at out.
+
+            On success pos is moved past the column.
+
+            \return False if the data is malformed or does not hold exactly
+                count values.
+        */
+        template <typename T>
+        bool decodeColumn(const unsigned char* data, std::size_t size,
+            std::size_t& pos, T* out, std::size_t count,
+            std::size_t threadCount = 1, EC::Executor* executor = nullptr)
+        {
+            static_assert(std::is_trivially_copyable<T>::value,
+                "Columns must be trivially copyable to be decoded");
+
+            std::uint64_t storedCount, chunkSize;
+            if(pos >= size || data[pos] > (unsigned char)ColumnEncoding::RunLength)
+            {
+                return false;
+            }
+            ColumnEncoding encoding = (ColumnEncoding)data[pos++];
+            if(!readVarint(data, size, pos, storedCount)
+                || !readVarint(data, size, pos, chunkSize)
+                || storedCount != count
+                || chunkSize == 0)
+            {
+                return false;
+            }
+
+            // Each chunk's size takes at least one byte.
+            std::size_t chunkCount = count / chunkSize
+                + (count % chunkSize != 0 ? 1 : 0);
+            if(chunkCount > size - pos)
+            {
+                return false;
+            }
+            std::vector<std::size_t> offsets(chunkCount + 1);
+            std::vector<std::size_t> sizes(chunkCount);
+            for(std::size_t chunk = 0; chunk < chunkCount; ++chunk)
+            {
+                std::uint64_t chunkBytes;
+                if(!readVarint(data, size, pos, chunkBytes))
+                {
+                    return false;
+                }
+                sizes[chunk] = chunkBytes;
+            }
+            offsets[0] = pos;
+            for(std::size_t chunk = 0; chunk < chunkCount; ++chunk)
+            {
+                if(sizes[chunk] > size - offsets[chunk])
+                {
+                    return false;
+                }
+                offsets[chunk + 1] = offsets[chunk] + sizes[chunk];
+            }
+
+            std::vector<char> decoded(chunkCount, 0);
+            forEachChunk(chunkCount, threadCount, executor,
+            [&] (std::size_t chunk) {
+                std::size_t begin = chunk * chunkSize;
+                std::size_t end = begin + chunkSize < count
+                    ? begin + chunkSize : count;
+                decoded[chunk] = decodeChunk(data + offsets[chunk],
+                    sizes[chunk], out + begin, end - begin, encoding);
+            });
+            for(char chunkDecoded : decoded)
+            {
+                if(!chunkDecoded)
+                {
+                    return false;
+                }
+            }
+
+            pos = offsets[chunkCount];
+            return true;
+        }
+    }
+}
+
+#endif
+
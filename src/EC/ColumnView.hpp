@@ -0,0 +1,70 @@
+
+#ifndef EC_COLUMN_VIEW_HPP
+#define EC_COLUMN_VIEW_HPP
+
+#include <cstddef>
+#include <type_traits>
+
+namespace EC
+{
+    /*!
+        \brief A pointer and length view of a column of data held by an
+            EC::Manager.
+
+        The view covers the ids [0, size) of the Manager at the time the view
+        was taken, including ids of deleted Entities. The data pointer remains
+        valid until the Manager reallocates its storage, which can be detected
+        by comparing version with EC::Manager::getStorageVersion().
+
+        Elements are Stride bytes apart, which is more than sizeof(T) for a
+        Component stored in a fusion group (see EC::Fused). begin() and end()
+        are only available if the column is contiguous.
+    */
+    template <typename T, std::size_t Stride = sizeof(T)>
+    struct ColumnView
+    {
+        static constexpr std::size_t stride = Stride;
+
+        T* data = nullptr;
+        std::size_t size = 0;
+        std::size_t version = 0;
+
+        static constexpr bool isContiguous()
+        {
+            return Stride == sizeof(T);
+        }
+
+        T* begin() const
+        {
+            static_assert(isContiguous(),
+                "A strided column cannot be iterated with pointers");
+            return data;
+        }
+
+        T* end() const
+        {
+            static_assert(isContiguous(),
+                "A strided column cannot be iterated with pointers");
+            return data + size;
+        }
+
+        T& operator[](std::size_t index) const
+        {
+            using Byte = std::conditional_t<std::is_const<T>::value,
+                const unsigned char, unsigned char>;
+            return *reinterpret_cast<T*>(
+                reinterpret_cast<Byte*>(data) + index * Stride);
+        }
+
+        bool empty() const
+        {
+            return size == 0;
+        }
+    };
+
+    template <typename T, std::size_t Stride>
+    constexpr std::size_t ColumnView<T, Stride>::stride;
+}
+
+#endif
+
@@ -0,0 +1,115 @@
+
+#ifndef EC_COST_ESTIMATE_HPP
+#define EC_COST_ESTIMATE_HPP
+
+// Time assumed to start and join one thread, in nanoseconds.
+#define EC_AUTO_THREAD_OVERHEAD_NS 20000
+// Time assumed per Entity before a query or stored function was measured,
+// in nanoseconds.
+#define EC_AUTO_ENTITY_NS 10
+// Weight of the newest measurement in the moving average of the time per
+// Entity.
+#define EC_AUTO_SAMPLE_WEIGHT 0.25
+
+#include <cstddef>
+#include <cmath>
+
+namespace EC
+{
+    /*!
+        \brief Passed as the threadCount of an EC::Manager's forMatching
+            functions to let the Manager choose the number of threads.
+
+        The Manager keeps an EC::CostEstimate per query Signature and per
+        stored function, and uses it with the number of matching Entities to
+        choose between running serially and running with as many threads as
+        pay for their overhead, up to Manager::setAutoThreadLimit().
+    */
+    constexpr std::size_t AutoThreadCount = static_cast<std::size_t>(-1);
+
+    /*!
+        \brief A moving average of the time a function takes per Entity, used
+            to choose the number of threads to call it with.
+
+        With w the estimated total work of count Entities and o the overhead
+        of a thread (EC_AUTO_THREAD_OVERHEAD_NS), n threads take about
+        w / n + n * o, which is smallest for n = sqrt(w / o). Fewer than two
+        threads, or no expected gain over w, means running serially.
+    */
+    class CostEstimate
+    {
+    public:
+        /*!
+            \brief Returns the number of threads, between 1 and maxThreads,
+                expected to process count Entities the fastest.
+        */
+        std::size_t chooseThreadCount(std::size_t count,
+            std::size_t maxThreads) const
+        {
+            double work = entitySeconds * count;
+            double overhead = EC_AUTO_THREAD_OVERHEAD_NS * 1e-9;
+            double best = std::sqrt(work / overhead);
+            if(best < 2.0 || maxThreads < 2)
+            {
+                return 1;
+            }
+            std::size_t threadCount = best < double(maxThreads)
+                ? std::size_t(best) : maxThreads;
+            if(work / threadCount + threadCount * overhead >= work)
+            {
+                return 1;
+            }
+            return threadCount;
+        }
+
+        /*!
+            \brief Adds a measurement of count Entities processed by
+                threadCount threads in the given number of seconds.
+
+            The thread overhead is subtracted from parallel measurements, and
+            the rest is assumed to have been split evenly between threads.
+        */
+        void record(std::size_t count, std::size_t threadCount,
+            double seconds)
+        {
+            if(count == 0)
+            {
+                return;
+            }
+            if(threadCount > 1)
+            {
+                seconds -= threadCount * EC_AUTO_THREAD_OVERHEAD_NS * 1e-9;
+            }
+            double sample = seconds > 0.0
+                ? seconds * (threadCount > 1 ? threadCount : 1) / count
+                : 0.0;
+            entitySeconds = measured
+                ? entitySeconds
+                    + (sample - entitySeconds) * EC_AUTO_SAMPLE_WEIGHT
+                : sample;
+            measured = true;
+        }
+
+        /*!
+            \brief Returns the estimated time per Entity, in seconds.
+        */
+        double getEntitySeconds() const
+        {
+            return entitySeconds;
+        }
+
+        /*!
+            \brief Returns true if record() was called with Entities.
+        */
+        bool isMeasured() const
+        {
+            return measured;
+        }
+
+    private:
+        double entitySeconds = EC_AUTO_ENTITY_NS * 1e-9;
+        bool measured = false;
+    };
+}
+
+#endif
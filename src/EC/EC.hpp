@@ -5,5 +5,15 @@
 
 
 #include "Bitset.hpp"
+#include "ColumnView.hpp"
+#include "CostEstimate.hpp"
+#include "EntityRef.hpp"
+#include "Executor.hpp"
+#include "Expression.hpp"
+#include "Fused.hpp"
+#include "Inbox.hpp"
+#include "Journal.hpp"
 #include "Manager.hpp"
+#include "RegionLoader.hpp"
+#include "TimingWheel.hpp"
 
@@ -0,0 +1,52 @@
+
+#ifndef EC_ENTITY_REF_HPP
+#define EC_ENTITY_REF_HPP
+
+#include <cstddef>
+
+namespace EC
+{
+    /*!
+        \brief A reference from one Entity to another Entity.
+
+        Components that refer to another Entity (a target, an owner, a
+        parent) should derive from BasicEntityRef so that the reference can be
+        followed by EC::Manager::forMatchingRelation(). IndexType must match
+        the IndexType of the EC::Manager. EC::EntityRef is the reference for
+        the default IndexType std::size_t.
+
+        Example:
+        \code{.cpp}
+            struct Target : EC::EntityRef
+            {
+                using EC::EntityRef::EntityRef;
+            };
+
+            manager.addComponent<Target>(sourceID, targetID);
+        \endcode
+    */
+    template <typename IndexType>
+    struct BasicEntityRef
+    {
+        static constexpr IndexType invalid = static_cast<IndexType>(-1);
+
+        BasicEntityRef(IndexType id = invalid) :
+        id(id)
+        {}
+
+        bool isValid() const
+        {
+            return id != invalid;
+        }
+
+        IndexType id;
+    };
+
+    template <typename IndexType>
+    constexpr IndexType BasicEntityRef<IndexType>::invalid;
+
+    using EntityRef = BasicEntityRef<std::size_t>;
+}
+
+#endif
+
@@ -0,0 +1,528 @@
+
+#ifndef EC_EXECUTOR_HPP
+#define EC_EXECUTOR_HPP
+
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace EC
+{
+    /*!
+        \brief Runs the parallel work of an EC::Manager.
+
+        The Manager splits each parallel call into threadCount tasks, for
+        example ranges of Entity ids, and hands them to its executor with
+        parallelFor(). Work that outlives the call, such as the encoding of
+        Manager::saveSnapshotAsync(), is handed over with runInBackground().
+        Implement this interface to run them on an existing job system (see
+        EC::SubmitExecutor), or use EC::ThreadPool.
+    */
+    class Executor
+    {
+    public:
+        virtual ~Executor() = default;
+
+        /*!
+            \brief Calls task(i) for each i in [0, taskCount), possibly in
+                parallel, and returns when all calls have returned.
+
+            Tasks may call parallelFor() again, so an implementation must not
+            wait for tasks that can only run on the waiting thread.
+        */
+        virtual void parallelFor(std::size_t taskCount,
+            const std::function<void(std::size_t)>& task) = 0;
+
+        /*!
+            \brief Calls task once, possibly on another thread, and returns
+                without waiting for it.
+
+            The default implementation calls task on the calling thread
+            before returning.
+        */
+        virtual void runInBackground(std::function<void()> task)
+        {
+            task();
+        }
+    };
+
+    /*!
+        \brief An EC::Executor with persistent worker threads.
+
+        The thread calling parallelFor() runs tasks too, and the pool adds
+        workers as needed, up to the worker count given to the constructor
+        or, by default, one less than the number of hardware threads. Tasks
+        beyond that are claimed by the workers as they become free, so that
+        calls with more tasks than CPUs do not oversubscribe them. Tasks of
+        concurrent calls and tasks run in the background share the workers.
+
+        Workers can be given CPU affinities, names and a scheduling
+        priority with WorkerSettings. Settings are applied on Linux, and
+        elsewhere counted by getSettingFailureCount().
+
+        getDefault() returns the pool used by Managers without an executor.
+    */
+    class ThreadPool : public Executor
+    {
+    public:
+        /*!
+            \brief Settings applied by each worker thread when it starts.
+        */
+        struct WorkerSettings
+        {
+            /*!
+                \brief The CPUs worker i may run on are
+                    affinity[i % affinity.size()]. Empty to leave the
+                    affinity unchanged.
+            */
+            std::vector<std::vector<std::size_t> > affinity;
+
+            /*!
+                \brief Worker i is named name + i, truncated to 15
+                    characters. Empty to leave names unchanged.
+            */
+            std::string name;
+
+            /*!
+                \brief The nice value of the workers, from -20 (highest
+                    priority) to 19 (lowest). 0 leaves it unchanged.
+
+                Raising the priority usually requires privileges.
+            */
+            int niceness = 0;
+
+            /*!
+                \brief If true, task i of a parallelFor() call made outside
+                    the pool's workers always runs on worker i - 1.
+
+                Managers split each call into ranges of Entity ids in the
+                same way every tick, so each worker keeps processing the
+                same Entities, and finds them in its cache. Tasks wait for
+                their worker instead of running on an idle one, so this
+                only pays if the pool is not shared with other work.
+                Calls made from within tasks are balanced as usual.
+            */
+            bool stableAssignment = false;
+        };
+
+        /*!
+            \brief Starts workerCount workers, or if 0 starts workers as
+                needed, up to one less than the number of hardware threads.
+        */
+        explicit ThreadPool(std::size_t workerCount = 0) :
+        ThreadPool(workerCount, WorkerSettings())
+        {}
+
+        ThreadPool(std::size_t workerCount, WorkerSettings settings) :
+        maxWorkers(workerCount != 0 ? workerCount : getHardwareWorkerCount()),
+        settings(std::move(settings))
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            addWorkers(workerCount);
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                stopping = true;
+            }
+            workAvailable.notify_all();
+            for(auto& worker : workers)
+            {
+                worker.join();
+            }
+        }
+
+        void parallelFor(std::size_t taskCount,
+            const std::function<void(std::size_t)>& task) override
+        {
+            if(taskCount <= 1)
+            {
+                if(taskCount == 1)
+                {
+                    task(0);
+                }
+                return;
+            }
+
+            Job job(task, taskCount,
+                settings.stableAssignment && getCurrentPool() != this);
+            std::size_t workerCount;
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                addWorkers(std::min(taskCount - 1, maxWorkers));
+                workerCount = workers.size();
+                // Stable tasks without a worker run on the calling thread.
+                for(std::size_t i = workerCount + 1;
+                    job.stable && i < taskCount; ++i)
+                {
+                    job.taken[i] = true;
+                }
+                jobs.push_back(&job);
+            }
+            workAvailable.notify_all();
+            if(job.stable)
+            {
+                job.task(0);
+                for(std::size_t i = workerCount + 1; i < taskCount; ++i)
+                {
+                    job.task(i);
+                }
+                std::lock_guard<std::mutex> guard(mutex);
+                job.done += taskCount > workerCount
+                    ? taskCount - workerCount : 1;
+            }
+            else
+            {
+                runTasks(job);
+            }
+
+            // Wait for the tasks run by workers.
+            std::unique_lock<std::mutex> lock(mutex);
+            jobFinished.wait(lock, [&job] () {
+                return job.done == job.count && job.workers == 0;
+            });
+            jobs.erase(std::remove(jobs.begin(), jobs.end(), &job), jobs.end());
+        }
+
+        /*!
+            \brief Runs task on a worker, or on the calling thread if the
+                pool may not have workers.
+
+            Workers finish the tasks run in the background before the pool is
+            destroyed.
+        */
+        void runInBackground(std::function<void()> task) override
+        {
+            if(maxWorkers == 0)
+            {
+                task();
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                addWorkers(std::max(workers.size(), std::size_t(1)));
+                background.push_back(std::move(task));
+            }
+            workAvailable.notify_all();
+        }
+
+        /*!
+            \brief Returns the number of worker threads, not counting threads
+                calling parallelFor().
+        */
+        std::size_t getWorkerCount() const
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            return workers.size();
+        }
+
+        /*!
+            \brief Returns the number of settings that workers failed to
+                apply, for example for lack of privileges.
+        */
+        std::size_t getSettingFailureCount() const
+        {
+            return settingFailures;
+        }
+
+        /*!
+            \brief Returns the pool shared by all Managers without an
+                executor.
+        */
+        static ThreadPool& getDefault()
+        {
+            static ThreadPool pool;
+            return pool;
+        }
+
+    private:
+        struct Job
+        {
+            Job(const std::function<void(std::size_t)>& task,
+                std::size_t count, bool stable) :
+            task(task),
+            count(count),
+            stable(stable),
+            taken(stable ? count : 0, false)
+            {}
+
+            const std::function<void(std::size_t)>& task;
+            const std::size_t count;
+            // Task i is run by worker i - 1 rather than claimed with next.
+            const bool stable;
+            std::atomic<std::size_t> next{0};
+            // Guarded by the pool's mutex.
+            std::vector<bool> taken;
+            std::size_t done = 0;
+            std::size_t workers = 0;
+        };
+
+        static std::size_t getHardwareWorkerCount()
+        {
+            std::size_t threads = std::thread::hardware_concurrency();
+            return threads > 1 ? threads - 1 : 0;
+        }
+
+        // Must be called with the mutex locked.
+        void addWorkers(std::size_t workerCount)
+        {
+            while(workers.size() < workerCount)
+            {
+                std::size_t index = workers.size();
+                workers.emplace_back([this, index] () { work(index); });
+            }
+        }
+
+        // The pool whose worker is the calling thread, if any.
+        static ThreadPool*& getCurrentPool()
+        {
+            static thread_local ThreadPool* pool = nullptr;
+            return pool;
+        }
+
+        // Returns a job with a task for the given worker, and sets task to
+        // the task if the job is stable. Must be called with the mutex
+        // locked.
+        Job* findJob(std::size_t index, std::size_t& task)
+        {
+            for(Job* job : jobs)
+            {
+                if(job->stable)
+                {
+                    task = index + 1;
+                    if(task < job->count && !job->taken[task])
+                    {
+                        job->taken[task] = true;
+                        return job;
+                    }
+                }
+                else if(job->next.load() < job->count)
+                {
+                    return job;
+                }
+            }
+            return nullptr;
+        }
+
+        // Applies the settings to the calling worker thread.
+        void applySettings(std::size_t index)
+        {
+#if defined(__linux__)
+            if(!settings.affinity.empty())
+            {
+                const auto& cpus =
+                    settings.affinity[index % settings.affinity.size()];
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for(std::size_t cpu : cpus)
+                {
+                    CPU_SET(cpu, &set);
+                }
+                if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)
+                    != 0)
+                {
+                    ++settingFailures;
+                }
+            }
+            if(!settings.name.empty())
+            {
+                std::string name =
+                    (settings.name + std::to_string(index)).substr(0, 15);
+                if(pthread_setname_np(pthread_self(), name.c_str()) != 0)
+                {
+                    ++settingFailures;
+                }
+            }
+            if(settings.niceness != 0
+                && setpriority(PRIO_PROCESS, pid_t(syscall(SYS_gettid)),
+                    settings.niceness) != 0)
+            {
+                ++settingFailures;
+            }
+#else
+            settingFailures += !settings.affinity.empty()
+                + !settings.name.empty() + (settings.niceness != 0);
+#endif
+        }
+
+        // Claims and runs tasks of job until none are left, and returns the
+        // number of tasks it ran.
+        static std::size_t claimTasks(Job& job)
+        {
+            std::size_t ran = 0;
+            for(std::size_t i = job.next++; i < job.count; i = job.next++)
+            {
+                job.task(i);
+                ++ran;
+            }
+            return ran;
+        }
+
+        void runTasks(Job& job)
+        {
+            std::size_t ran = claimTasks(job);
+            std::lock_guard<std::mutex> guard(mutex);
+            job.done += ran;
+            if(job.done == job.count && job.workers == 0)
+            {
+                jobFinished.notify_all();
+            }
+        }
+
+        void work(std::size_t index)
+        {
+            getCurrentPool() = this;
+            applySettings(index);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            while(true)
+            {
+                Job* job = nullptr;
+                std::size_t task = 0;
+                workAvailable.wait(lock, [this, index, &job, &task] () {
+                    return stopping || (job = findJob(index, task)) != nullptr
+                        || !background.empty();
+                });
+                if(!job)
+                {
+                    if(background.empty())
+                    {
+                        return;
+                    }
+                    std::function<void()> backgroundTask =
+                        std::move(background.front());
+                    background.pop_front();
+                    lock.unlock();
+                    backgroundTask();
+                    lock.lock();
+                    continue;
+                }
+                // The caller of parallelFor() keeps job alive until workers
+                // drops back to 0.
+                ++job->workers;
+                lock.unlock();
+                std::size_t ran = 1;
+                if(job->stable)
+                {
+                    job->task(task);
+                }
+                else
+                {
+                    ran = claimTasks(*job);
+                }
+                lock.lock();
+                job->done += ran;
+                --job->workers;
+                if(job->done == job->count && job->workers == 0)
+                {
+                    jobFinished.notify_all();
+                }
+            }
+        }
+
+        mutable std::mutex mutex;
+        std::condition_variable workAvailable;
+        std::condition_variable jobFinished;
+        std::deque<Job*> jobs;
+        std::deque<std::function<void()> > background;
+        std::vector<std::thread> workers;
+        bool stopping = false;
+        const std::size_t maxWorkers;
+        const WorkerSettings settings;
+        std::atomic<std::size_t> settingFailures{0};
+    };
+
+    /*!
+        \brief Adapts a job system to EC::Executor.
+
+        submit is called with each task but the first, which runs on the
+        calling thread, and with each task run in the background, and must
+        arrange for it to be called once, on any thread. parallelFor() then
+        blocks until the submitted tasks have run, so the job system must be
+        able to run them while the caller waits.
+
+        Example:
+        \code{.cpp}
+            EC::SubmitExecutor executor(
+                [&jobs] (std::function<void()> task) {
+                    jobs.push(std::move(task));
+                });
+            manager.setExecutor(&executor);
+        \endcode
+    */
+    class SubmitExecutor : public Executor
+    {
+    public:
+        using Submit = std::function<void(std::function<void()>)>;
+
+        explicit SubmitExecutor(Submit submit) :
+        submit(std::move(submit))
+        {}
+
+        void parallelFor(std::size_t taskCount,
+            const std::function<void(std::size_t)>& task) override
+        {
+            if(taskCount == 0)
+            {
+                return;
+            }
+
+            struct State
+            {
+                std::mutex mutex;
+                std::condition_variable finished;
+                std::size_t remaining;
+            };
+            auto state = std::make_shared<State>();
+            state->remaining = taskCount - 1;
+            for(std::size_t i = 1; i < taskCount; ++i)
+            {
+                submit([state, &task, i] () {
+                    task(i);
+                    std::lock_guard<std::mutex> guard(state->mutex);
+                    if(--state->remaining == 0)
+                    {
+                        state->finished.notify_all();
+                    }
+                });
+            }
+            task(0);
+
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->finished.wait(lock, [&state] () {
+                return state->remaining == 0;
+            });
+        }
+
+        void runInBackground(std::function<void()> task) override
+        {
+            submit(std::move(task));
+        }
+
+    private:
+        Submit submit;
+    };
+}
+
+#endif
@@ -0,0 +1,618 @@
+
+#ifndef EC_EXPRESSION_HPP
+#define EC_EXPRESSION_HPP
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "Meta/Combine.hpp"
+#include "Meta/TypeList.hpp"
+
+// Tells the compiler that the iterations of a kernel loop are independent,
+// which holds as an expression only reads and writes the Components of the
+// Entity being evaluated.
+#if defined(__clang__)
+#define EC_EXPRESSION_VECTORIZE \
+    _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define EC_EXPRESSION_VECTORIZE _Pragma("GCC ivdep")
+#else
+#define EC_EXPRESSION_VECTORIZE
+#endif
+
+/*!
+    \brief Returns the given field of a Component as a column expression known
+        at compile time, so that an expression over several fields of a
+        Component loads and stores whole Components with vector instructions.
+
+    Example:
+    \code{.cpp}
+        auto x = EC_FIELD(&Position::x);
+        auto y = EC_FIELD(&Position::y);
+        auto vx = EC_FIELD(&Velocity::x);
+        auto vy = EC_FIELD(&Velocity::y);
+        manager.forMatchingExpression(EC::sequence(
+            x += vx * dt,
+            y += vy * dt));
+    \endcode
+*/
+#define EC_FIELD(member) EC::field<decltype(member), member>()
+
+namespace EC
+{
+    /*!
+        \brief Base of the nodes of a column expression.
+
+        Column expressions describe simple arithmetic systems over fields of
+        Components, which EC::Manager::forMatchingExpression() evaluates for
+        all matching Entities without calling a function per Entity. See
+        EC_FIELD() and EC::field().
+    */
+    struct Expression {};
+
+    template <typename T>
+    using IsExpression = std::is_base_of<Expression, std::decay_t<T> >;
+
+    namespace Internal
+    {
+        template <typename... Lists>
+        struct CombineAllHelper
+        {
+            using type = EC::Meta::TypeList<>;
+        };
+
+        template <typename List, typename... Lists>
+        struct CombineAllHelper<List, Lists...>
+        {
+            using type = EC::Meta::Combine<
+                List, typename CombineAllHelper<Lists...>::type>;
+        };
+
+        template <typename... Lists>
+        using CombineAll = typename CombineAllHelper<Lists...>::type;
+
+        struct Add
+        {
+            template <typename A, typename B>
+            static auto apply(const A& a, const B& b)
+            {
+                return a + b;
+            }
+
+            template <typename A, typename B>
+            static void assign(A& a, const B& b)
+            {
+                a += b;
+            }
+        };
+
+        struct Subtract
+        {
+            template <typename A, typename B>
+            static auto apply(const A& a, const B& b)
+            {
+                return a - b;
+            }
+
+            template <typename A, typename B>
+            static void assign(A& a, const B& b)
+            {
+                a -= b;
+            }
+        };
+
+        struct Multiply
+        {
+            template <typename A, typename B>
+            static auto apply(const A& a, const B& b)
+            {
+                return a * b;
+            }
+
+            template <typename A, typename B>
+            static void assign(A& a, const B& b)
+            {
+                a *= b;
+            }
+        };
+
+        struct Divide
+        {
+            template <typename A, typename B>
+            static auto apply(const A& a, const B& b)
+            {
+                return a / b;
+            }
+
+            template <typename A, typename B>
+            static void assign(A& a, const B& b)
+            {
+                a /= b;
+            }
+        };
+
+        // Written as a select rather than with std::min and std::max so that
+        // compilers emit the vector min and max instructions.
+        struct Min
+        {
+            template <typename A, typename B>
+            static auto apply(const A& a, const B& b)
+            {
+                return b < a ? b : a;
+            }
+        };
+
+        struct Max
+        {
+            template <typename A, typename B>
+            static auto apply(const A& a, const B& b)
+            {
+                return a < b ? b : a;
+            }
+        };
+
+        struct Set
+        {
+            template <typename A, typename B>
+            static void assign(A& a, const B& b)
+            {
+                a = b;
+            }
+        };
+    }
+
+    /*!
+        \brief A constant of a column expression, for example a time step.
+
+        Numbers used in an expression are converted to ConstantExpression.
+    */
+    template <typename T>
+    struct ConstantExpression : Expression
+    {
+        using Components = EC::Meta::TypeList<>;
+
+        explicit ConstantExpression(const T& value) :
+        value(value)
+        {}
+
+        template <typename Columns>
+        T operator()(const Columns& /* columns */, std::size_t /* id */) const
+        {
+            return value;
+        }
+
+        T value;
+    };
+
+    template <typename T,
+        typename = std::enable_if_t<IsExpression<T>::value> >
+    const T& makeExpression(const T& expression)
+    {
+        return expression;
+    }
+
+    template <typename T,
+        typename = std::enable_if_t<!IsExpression<T>::value>, typename = void>
+    ConstantExpression<T> makeExpression(const T& value)
+    {
+        return ConstantExpression<T>(value);
+    }
+
+    template <typename T>
+    using ExpressionOf = std::decay_t<decltype(
+        makeExpression(std::declval<const T&>()))>;
+
+    /*!
+        \brief The first element of a Component column whose elements are
+            Stride bytes apart, as passed to expressions in a tuple holding
+            one ColumnPointer per Component.
+    */
+    template <typename Component, std::size_t Stride = sizeof(Component)>
+    struct ColumnPointer
+    {
+        using Type = Component;
+
+        Component& operator[](std::size_t id) const
+        {
+            return at(id, std::integral_constant<bool,
+                Stride == sizeof(Component)>{});
+        }
+
+        Component* data;
+
+    private:
+        Component& at(std::size_t id, std::true_type /* contiguous */) const
+        {
+            return data[id];
+        }
+
+        Component& at(std::size_t id, std::false_type /* contiguous */) const
+        {
+            return *reinterpret_cast<Component*>(
+                reinterpret_cast<unsigned char*>(data) + id * Stride);
+        }
+    };
+
+    namespace Internal
+    {
+        template <typename Component, typename Columns>
+        struct ColumnIndex;
+
+        template <typename Component, typename Column, typename... Columns>
+        struct ColumnIndex<Component, std::tuple<Column, Columns...> > :
+            std::integral_constant<std::size_t,
+                std::is_same<Component, typename Column::Type>::value ? 0
+                    : 1 + ColumnIndex<
+                        Component, std::tuple<Columns...> >::value>
+        {};
+
+        template <typename Component>
+        struct ColumnIndex<Component, std::tuple<> > :
+            std::integral_constant<std::size_t, 0>
+        {};
+
+        template <typename Component, typename Columns>
+        const auto& getColumnPointer(const Columns& columns)
+        {
+            return std::get<ColumnIndex<Component, Columns>::value>(columns);
+        }
+    }
+
+    /*!
+        \brief An expression applied by EC::Manager::forMatchingExpression() to
+            each matching Entity, which assigns the value of an expression to
+            a field. Created by the assignment operators of FieldExpression.
+    */
+    template <typename Op, typename Field, typename Value>
+    struct Assignment
+    {
+        using Components = EC::Meta::Combine<
+            typename Field::Components, typename Value::Components>;
+        // The Components whose columns are written.
+        using WrittenComponents = typename Field::Components;
+
+        Assignment(const Field& field, const Value& value) :
+        field(field),
+        value(value)
+        {}
+
+        template <typename Columns>
+        void operator()(const Columns& columns, std::size_t id) const
+        {
+            Op::assign(field(columns, id), value(columns, id));
+        }
+
+        Field field;
+        Value value;
+    };
+
+    /*!
+        \brief A field of a Component used in a column expression. Created by
+            EC::field() or EC_FIELD().
+
+        If Member is given, the field is known at compile time, otherwise
+        member is used.
+
+        Besides being used as a value, a field can be assigned with =, +=, -=,
+        *= and /=, which creates an Assignment.
+    */
+    template <typename Component, typename T,
+        T Component::* Member = nullptr>
+    struct FieldExpression : Expression
+    {
+        using Components = EC::Meta::TypeList<Component>;
+
+        explicit FieldExpression(T Component::* member = Member) :
+        member(member)
+        {}
+
+        FieldExpression(const FieldExpression&) = default;
+
+        template <typename Columns>
+        T& operator()(const Columns& columns, std::size_t id) const
+        {
+            return Internal::getColumnPointer<Component>(columns)[id].*(
+                Member != nullptr ? Member : member);
+        }
+
+        template <typename Value>
+        auto operator=(const Value& value) const
+        {
+            return Assignment<Internal::Set, FieldExpression,
+                ExpressionOf<Value> >(*this, makeExpression(value));
+        }
+
+        // Also an assignment expression rather than a copy, as with the
+        // other assignments of fields.
+        auto operator=(const FieldExpression& value) const
+        {
+            return Assignment<Internal::Set, FieldExpression, FieldExpression>(
+                *this, value);
+        }
+
+        template <typename Value>
+        auto operator+=(const Value& value) const
+        {
+            return Assignment<Internal::Add, FieldExpression,
+                ExpressionOf<Value> >(*this, makeExpression(value));
+        }
+
+        template <typename Value>
+        auto operator-=(const Value& value) const
+        {
+            return Assignment<Internal::Subtract, FieldExpression,
+                ExpressionOf<Value> >(*this, makeExpression(value));
+        }
+
+        template <typename Value>
+        auto operator*=(const Value& value) const
+        {
+            return Assignment<Internal::Multiply, FieldExpression,
+                ExpressionOf<Value> >(*this, makeExpression(value));
+        }
+
+        template <typename Value>
+        auto operator/=(const Value& value) const
+        {
+            return Assignment<Internal::Divide, FieldExpression,
+                ExpressionOf<Value> >(*this, makeExpression(value));
+        }
+
+        T Component::* member;
+    };
+
+    /*!
+        \brief Returns the given field of a Component as a column expression.
+
+        The field is only known at run time, which prevents the compiler from
+        loading neighbouring fields of a Component with one vector load. Use
+        EC_FIELD() for Components with several fields used by an expression.
+
+        Example:
+        \code{.cpp}
+            auto timer = EC::field(&Timer::remaining);
+            manager.forMatchingExpression(timer -= dt);
+        \endcode
+    */
+    template <typename Component, typename T>
+    FieldExpression<Component, T> field(T Component::* member)
+    {
+        return FieldExpression<Component, T>(member);
+    }
+
+    template <typename MemberPointer>
+    struct MemberPointerTraits;
+
+    template <typename Component, typename T>
+    struct MemberPointerTraits<T Component::*>
+    {
+        using ComponentType = Component;
+        using ValueType = T;
+    };
+
+    /*!
+        \brief Returns the given field of a Component as a column expression
+            known at compile time. See EC_FIELD().
+    */
+    template <typename MemberPointer, MemberPointer member>
+    auto field()
+    {
+        return FieldExpression<
+            typename MemberPointerTraits<MemberPointer>::ComponentType,
+            typename MemberPointerTraits<MemberPointer>::ValueType,
+            member>();
+    }
+
+    /*!
+        \brief An arithmetic operation of two expressions.
+    */
+    template <typename Op, typename A, typename B>
+    struct BinaryExpression : Expression
+    {
+        using Components = EC::Meta::Combine<
+            typename A::Components, typename B::Components>;
+
+        BinaryExpression(const A& a, const B& b) :
+        a(a),
+        b(b)
+        {}
+
+        template <typename Columns>
+        auto operator()(const Columns& columns, std::size_t id) const
+        {
+            return Op::apply(a(columns, id), b(columns, id));
+        }
+
+        A a;
+        B b;
+    };
+
+    /*!
+        \brief The negation of an expression.
+    */
+    template <typename A>
+    struct NegateExpression : Expression
+    {
+        using Components = typename A::Components;
+
+        explicit NegateExpression(const A& a) :
+        a(a)
+        {}
+
+        template <typename Columns>
+        auto operator()(const Columns& columns, std::size_t id) const
+        {
+            return -a(columns, id);
+        }
+
+        A a;
+    };
+
+    template <typename A, typename B>
+    using EnableIfExpression = std::enable_if_t<
+        IsExpression<A>::value || IsExpression<B>::value>;
+
+    template <typename A, typename B, typename = EnableIfExpression<A, B> >
+    auto operator+(const A& a, const B& b)
+    {
+        return BinaryExpression<Internal::Add,
+            ExpressionOf<A>, ExpressionOf<B> >(
+                makeExpression(a), makeExpression(b));
+    }
+
+    template <typename A, typename B, typename = EnableIfExpression<A, B> >
+    auto operator-(const A& a, const B& b)
+    {
+        return BinaryExpression<Internal::Subtract,
+            ExpressionOf<A>, ExpressionOf<B> >(
+                makeExpression(a), makeExpression(b));
+    }
+
+    template <typename A, typename B, typename = EnableIfExpression<A, B> >
+    auto operator*(const A& a, const B& b)
+    {
+        return BinaryExpression<Internal::Multiply,
+            ExpressionOf<A>, ExpressionOf<B> >(
+                makeExpression(a), makeExpression(b));
+    }
+
+    template <typename A, typename B, typename = EnableIfExpression<A, B> >
+    auto operator/(const A& a, const B& b)
+    {
+        return BinaryExpression<Internal::Divide,
+            ExpressionOf<A>, ExpressionOf<B> >(
+                makeExpression(a), makeExpression(b));
+    }
+
+    template <typename A,
+        typename = std::enable_if_t<IsExpression<A>::value> >
+    NegateExpression<A> operator-(const A& a)
+    {
+        return NegateExpression<A>(a);
+    }
+
+    /*!
+        \brief The smaller of two expressions.
+    */
+    template <typename A, typename B, typename = EnableIfExpression<A, B> >
+    auto min(const A& a, const B& b)
+    {
+        return BinaryExpression<Internal::Min,
+            ExpressionOf<A>, ExpressionOf<B> >(
+                makeExpression(a), makeExpression(b));
+    }
+
+    /*!
+        \brief The larger of two expressions.
+    */
+    template <typename A, typename B, typename = EnableIfExpression<A, B> >
+    auto max(const A& a, const B& b)
+    {
+        return BinaryExpression<Internal::Max,
+            ExpressionOf<A>, ExpressionOf<B> >(
+                makeExpression(a), makeExpression(b));
+    }
+
+    /*!
+        \brief An expression limited to [low, high].
+    */
+    template <typename A, typename Low, typename High>
+    auto clamp(const A& a, const Low& low, const High& high)
+    {
+        return EC::min(EC::max(a, low), high);
+    }
+
+    /*!
+        \brief Assignments applied one after the other to each matching
+            Entity, in one pass over the Entities. Created by EC::sequence().
+    */
+    template <typename... Assignments>
+    struct SequenceAssignment
+    {
+        using Components = Internal::CombineAll<
+            typename Assignments::Components...>;
+        using WrittenComponents = Internal::CombineAll<
+            typename Assignments::WrittenComponents...>;
+
+        explicit SequenceAssignment(const Assignments&... assignments) :
+        assignments(assignments...)
+        {}
+
+        template <typename Columns>
+        void operator()(const Columns& columns, std::size_t id) const
+        {
+            applyHelper(columns, id,
+                std::index_sequence_for<Assignments...>());
+        }
+
+        std::tuple<Assignments...> assignments;
+
+    private:
+        template <typename Columns, std::size_t... Indices>
+        void applyHelper(const Columns& columns, std::size_t id,
+            std::index_sequence<Indices...>) const
+        {
+            int expand[] = {0,
+                (std::get<Indices>(assignments)(columns, id), 0)...};
+            (void)expand;
+        }
+    };
+
+    /*!
+        \brief Applies an assignment to the ids [begin, end), which must all
+            match. This loop is the kernel that compilers vectorize.
+
+        The assignment and columns are copied so that the compiler sees that
+        all fields of a Component share the same column.
+    */
+    template <typename AssignmentType, typename Columns>
+    void applyRange(const AssignmentType& assignment, const Columns& columns,
+        std::size_t begin, std::size_t end)
+    {
+        const AssignmentType kernel = assignment;
+        const Columns kernelColumns = columns;
+        EC_EXPRESSION_VECTORIZE
+        for(std::size_t id = begin; id < end; ++id)
+        {
+            kernel(kernelColumns, id);
+        }
+    }
+
+    /*!
+        \brief Applies an assignment to the given ids, which must all match,
+            gathering and scattering the fields.
+    */
+    template <typename AssignmentType, typename Columns, typename IndexType>
+    void applyIndexed(const AssignmentType& assignment, const Columns& columns,
+        const IndexType* ids, std::size_t count)
+    {
+        const AssignmentType kernel = assignment;
+        const Columns kernelColumns = columns;
+        EC_EXPRESSION_VECTORIZE
+        for(std::size_t i = 0; i < count; ++i)
+        {
+            kernel(kernelColumns, ids[i]);
+        }
+    }
+
+    /*!
+        \brief Combines assignments into one, applied in the given order.
+
+        Example:
+        \code{.cpp}
+            manager.forMatchingExpression(EC::sequence(
+                x += vx * dt,
+                y += vy * dt));
+        \endcode
+    */
+    template <typename... Assignments>
+    SequenceAssignment<Assignments...> sequence(
+        const Assignments&... assignments)
+    {
+        return SequenceAssignment<Assignments...>(assignments...);
+    }
+}
+
+#endif
@@ -0,0 +1,190 @@
+
+#ifndef EC_FUSED_HPP
+#define EC_FUSED_HPP
+
+#include <type_traits>
+
+#include "Meta/Combine.hpp"
+#include "Meta/Contains.hpp"
+#include "Meta/TypeList.hpp"
+
+namespace EC
+{
+    namespace Internal
+    {
+        template <typename... Components>
+        struct FusedRow;
+
+        template <typename Component>
+        struct FusedRow<Component>
+        {
+            using First = Component;
+            Component component;
+        };
+
+        template <typename Component, typename... Rest>
+        struct FusedRow<Component, Rest...>
+        {
+            using First = Component;
+            Component component;
+            FusedRow<Rest...> rest;
+        };
+
+        template <typename Component, typename... Rest>
+        Component& getFused(FusedRow<Component, Rest...>& row,
+            std::true_type /* found */)
+        {
+            return row.component;
+        }
+
+        template <typename Component, typename First, typename... Rest>
+        Component& getFused(FusedRow<First, Rest...>& row,
+            std::false_type /* found */)
+        {
+            return getFused<Component>(row.rest, std::is_same<
+                Component, typename FusedRow<Rest...>::First>{});
+        }
+    }
+
+    /*!
+        \brief A fusion group of Components that are stored interleaved in
+            one column of an EC::Manager, declared by listing it in place of
+            its Components in the Manager's Components.
+
+        Systems that always access the same Components together read one
+        stream instead of one per Component. Fused Components are still
+        separate Components: they are added, removed, queried with
+        Signatures and accessed with getEntityData() individually. Each
+        Component may be in at most one group.
+
+        Use getColumn() with the Fused type to access the interleaved column
+        directly, and Fused::get() to access a Component of a row.
+
+        Example:
+        \code{.cpp}
+            using Motion = EC::Fused<Position, Velocity, Acceleration>;
+            using ManagerType = EC::Manager<
+                EC::Meta::TypeList<Motion, Health>,
+                EC::Meta::TypeList<Player>>;
+
+            // Position is still addressable on its own.
+            manager.addComponent<Position>(id, 1.0f, 2.0f);
+            Position* position = manager.getEntityData<Position>(id);
+        \endcode
+    */
+    template <typename... Components>
+    struct Fused
+    {
+        static_assert(sizeof...(Components) > 0,
+            "A fusion group must hold at least one Component");
+
+        template <typename Component>
+        Component& get()
+        {
+            static_assert(EC::Meta::Contains<
+                Component, EC::Meta::TypeList<Components...> >::value,
+                "Component is not in the fusion group");
+            return Internal::getFused<Component>(row,
+                std::is_same<Component, typename Internal::FusedRow<
+                    Components...>::First>{});
+        }
+
+        template <typename Component>
+        const Component& get() const
+        {
+            return const_cast<Fused*>(this)->template get<Component>();
+        }
+
+        Internal::FusedRow<Components...> row;
+    };
+
+    namespace Internal
+    {
+        // The Components of an entry of a Manager's Components list.
+        template <typename Unit>
+        struct UnitComponents
+        {
+            using type = EC::Meta::TypeList<Unit>;
+        };
+
+        template <typename... Components>
+        struct UnitComponents<Fused<Components...> >
+        {
+            using type = EC::Meta::TypeList<Components...>;
+        };
+
+        template <typename List>
+        struct FlattenFusedHelper
+        {
+            using type = EC::Meta::TypeList<>;
+        };
+
+        template <template <typename...> class TypeList,
+            typename Unit, typename... Units>
+        struct FlattenFusedHelper<TypeList<Unit, Units...> >
+        {
+            using type = EC::Meta::Combine<
+                typename UnitComponents<Unit>::type,
+                typename FlattenFusedHelper<
+                    EC::Meta::TypeList<Units...> >::type>;
+        };
+
+        template <typename Component, typename List>
+        struct UnitOfHelper
+        {
+            using type = char;
+        };
+
+        template <typename Component, template <typename...> class TypeList,
+            typename Unit, typename... Units>
+        struct UnitOfHelper<Component, TypeList<Unit, Units...> >
+        {
+            using type = std::conditional_t<
+                EC::Meta::Contains<
+                    Component, typename UnitComponents<Unit>::type>::value,
+                Unit,
+                typename UnitOfHelper<
+                    Component, EC::Meta::TypeList<Units...> >::type>;
+        };
+    }
+
+    /*!
+        \brief The Components of a Manager's Components list, with fusion
+            groups replaced by their Components.
+    */
+    template <typename ComponentsList>
+    using FlattenFused =
+        typename Internal::FlattenFusedHelper<ComponentsList>::type;
+
+    /*!
+        \brief The entry of a Manager's Components list that stores the given
+            Component: the Component itself, its fusion group, or char if the
+            Component is unknown.
+    */
+    template <typename Component, typename ComponentsList>
+    using FusedUnitOf =
+        typename Internal::UnitOfHelper<Component, ComponentsList>::type;
+
+    /*!
+        \brief Returns the given Component of an entry of a storage column.
+    */
+    template <typename Component, typename Unit>
+    Component* getUnitComponent(Unit& unit)
+    {
+        return (Component*) &unit;
+    }
+
+    template <typename Component, typename... Components>
+    Component* getUnitComponent(Fused<Components...>& unit)
+    {
+        return &unit.template get<Component>();
+    }
+
+    template <typename Component, typename... Components>
+    const Component* getUnitComponent(const Fused<Components...>& unit)
+    {
+        return &unit.template get<Component>();
+    }
+}
+
+#endif
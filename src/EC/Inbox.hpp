@@ -0,0 +1,195 @@
+
+#ifndef EC_INBOX_HPP
+#define EC_INBOX_HPP
+
+// Number of independent queues of an EC::Inbox, between which posting
+// threads are spread.
+#define EC_INBOX_SHARDS 16
+// Capacity of the first block of each queue. Each further block doubles the
+// capacity.
+#define EC_INBOX_BLOCK_SIZE 256
+
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace EC
+{
+    /*!
+        \brief Messages addressed to a Component of other Entities, posted
+            from parallel functions and delivered afterwards by
+            EC::Manager::deliverMessages().
+
+        Writing to another Entity's Components from a multi-threaded
+        forMatching function races with the thread that handles that Entity.
+        Posting a Message to an Inbox instead is safe from any number of
+        threads: post() only takes a slot of one of EC_INBOX_SHARDS queues
+        with an atomic increment, and threads are spread between queues to
+        avoid contending on the same counter. Queues grow by blocks that are
+        kept by clear(), so an Inbox reused every tick stops allocating.
+
+        Messages must only be posted while no delivery runs, and delivery
+        must happen after the posting threads were joined, which is the
+        case after a forMatching function returns.
+
+        Message must be default constructible and move assignable.
+
+        Example:
+        \code{.cpp}
+            EC::Inbox<Health, float> damage;
+            manager.forMatchingSignature<TypeList<Attack>>(
+                [&damage] (std::size_t id, void* context, Attack* attack) {
+                    damage.post(attack->target, attack->damage);
+                }, nullptr, 4);
+            manager.deliverMessages(damage,
+                [] (std::size_t id, Health* health, float& amount) {
+                    health->value -= amount;
+                });
+        \endcode
+    */
+    template <typename Component, typename Message = Component,
+        typename IndexType = std::size_t>
+    class Inbox
+    {
+    public:
+        struct Entry
+        {
+            IndexType target;
+            Message message;
+        };
+
+        Inbox() = default;
+
+        Inbox(const Inbox&) = delete;
+        Inbox& operator=(const Inbox&) = delete;
+
+        ~Inbox()
+        {
+            for(auto& shard : shards)
+            {
+                for(auto& block : shard.blocks)
+                {
+                    delete[] block.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /*!
+            \brief Posts a Message to the Component of the target Entity.
+
+            May be called concurrently from any number of threads.
+        */
+        void post(IndexType target, Message message)
+        {
+            Shard& shard = shards[std::hash<std::thread::id>()(
+                std::this_thread::get_id()) % EC_INBOX_SHARDS];
+            Entry& entry = shard.getEntry(
+                shard.count.fetch_add(1, std::memory_order_relaxed));
+            entry.target = target;
+            entry.message = std::move(message);
+        }
+
+        /*!
+            \brief Returns the number of posted Messages.
+        */
+        std::size_t size() const
+        {
+            std::size_t size = 0;
+            for(const auto& shard : shards)
+            {
+                size += shard.count.load(std::memory_order_relaxed);
+            }
+            return size;
+        }
+
+        /*!
+            \brief Removes all Messages, keeping the allocated blocks.
+        */
+        void clear()
+        {
+            for(auto& shard : shards)
+            {
+                shard.count.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        /*!
+            \brief Returns the posted Messages ordered by target.
+
+            Messages to the same target keep the order in which each thread
+            posted them.
+        */
+        std::vector<Entry*> getEntriesByTarget()
+        {
+            std::vector<Entry*> entries;
+            entries.reserve(size());
+            for(auto& shard : shards)
+            {
+                std::size_t count =
+                    shard.count.load(std::memory_order_relaxed);
+                for(std::size_t i = 0; i < count; ++i)
+                {
+                    entries.push_back(&shard.getEntry(i));
+                }
+            }
+            std::stable_sort(entries.begin(), entries.end(),
+                [] (const Entry* a, const Entry* b) {
+                    return a->target < b->target;
+                });
+            return entries;
+        }
+
+    private:
+        // Enough blocks for any index, as block k holds
+        // EC_INBOX_BLOCK_SIZE << k entries.
+        static constexpr std::size_t maxBlocks = sizeof(std::size_t) * 8;
+
+        // The block pointers keep the counters of different shards on
+        // different cache lines.
+        struct Shard
+        {
+            std::atomic<std::size_t> count{0};
+            std::atomic<Entry*> blocks[maxBlocks] = {};
+
+            Entry& getEntry(std::size_t index)
+            {
+                // Block k starts at index EC_INBOX_BLOCK_SIZE * (2^k - 1).
+                std::size_t position = index / EC_INBOX_BLOCK_SIZE + 1;
+                std::size_t block = 0;
+                while(position >> (block + 1) != 0)
+                {
+                    ++block;
+                }
+                std::size_t offset = index
+                    - EC_INBOX_BLOCK_SIZE * ((std::size_t(1) << block) - 1);
+
+                Entry* entries = blocks[block].load(std::memory_order_acquire);
+                if(!entries)
+                {
+                    // Threads that reach a new block at the same time each
+                    // allocate it, and all but one free theirs.
+                    Entry* allocated =
+                        new Entry[EC_INBOX_BLOCK_SIZE << block];
+                    if(blocks[block].compare_exchange_strong(entries,
+                        allocated, std::memory_order_acq_rel))
+                    {
+                        entries = allocated;
+                    }
+                    else
+                    {
+                        delete[] allocated;
+                    }
+                }
+                return entries[offset];
+            }
+        };
+
+        Shard shards[EC_INBOX_SHARDS];
+    };
+}
+
+#endif
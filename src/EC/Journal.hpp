@@ -0,0 +1,328 @@
+
+#ifndef EC_JOURNAL_HPP
+#define EC_JOURNAL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define EC_JOURNAL_BATCH_SIZE 65536
+
+namespace EC
+{
+    /*!
+        \brief The operations recorded by a Journal.
+
+        Query records a call of a forMatching function or stored function,
+        with the number of matching Entities in place of the Entity id, the
+        thread count in place of the type index and the Signature's bits as
+        payload. Queries are only recorded if enabled with
+        Journal::setRecordQueries().
+    */
+    enum class JournalOp : unsigned char
+    {
+        AddEntity = 0,
+        DeleteEntity = 1,
+        AddComponent = 2,
+        RemoveComponent = 3,
+        AddTag = 4,
+        RemoveTag = 5,
+        Reset = 6,
+        Query = 7
+    };
+
+    /*!
+        \brief An append only log of the structural operations done on a
+            Manager, used for crash recovery and deterministic replay.
+
+        Attach a Journal to a Manager with Manager::setJournal(). Records are
+        appended to a buffer owned by the calling thread, and a buffer is
+        flushed as one batch once it cannot hold the next record within
+        EC_JOURNAL_BATCH_SIZE bytes (or the given batch size), or when flush()
+        is called. Batches are passed to the sink given to the constructor
+        (for example one that writes them to a file), or appended to the log
+        returned by getLog() if no sink was given.
+
+        Each record holds a sequence number, so batches flushed by different
+        threads may be concatenated in any order. Use
+        Manager::replayJournal() to rebuild a Manager from the log.
+
+        With setRecordQueries(true) the Journal also records the Signature,
+        thread count and number of matching Entities of each query, which
+        makes the log a trace of the workload that can be replayed with
+        EC::replayTrace().
+
+        Example:
+        \code{.cpp}
+            EC::Journal journal;
+            manager.setJournal(&journal);
+            // ... addEntity, addComponent, deleteEntity ...
+            journal.flush();
+
+            ManagerType recovered;
+            recovered.replayJournal(journal.getLog());
+        \endcode
+    */
+    class Journal
+    {
+    public:
+        using Sink = std::function<void(const unsigned char* data,
+            std::size_t size)>;
+
+        /*!
+            \brief Creates a Journal that appends batches to the log returned
+                by getLog().
+        */
+        explicit Journal(std::size_t batchSize = EC_JOURNAL_BATCH_SIZE) :
+        batchSize(batchSize),
+        journalID(nextJournalID()++)
+        {}
+
+        /*!
+            \brief Creates a Journal that passes batches to the given sink.
+
+            The sink is called with a lock held, so it is never called by two
+            threads at once.
+        */
+        explicit Journal(Sink sink,
+            std::size_t batchSize = EC_JOURNAL_BATCH_SIZE) :
+        sink(std::move(sink)),
+        batchSize(batchSize),
+        journalID(nextJournalID()++)
+        {}
+
+        Journal(const Journal&) = delete;
+        Journal& operator=(const Journal&) = delete;
+
+        ~Journal()
+        {
+            flush();
+        }
+
+        /*!
+            \brief Flushes the buffers of all threads.
+
+            Must not be called while other threads record operations.
+        */
+        void flush()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(auto& buffer : buffers)
+            {
+                flushBuffer(*buffer);
+            }
+        }
+
+        /*!
+            \brief Returns the batches flushed so far if no sink was given.
+        */
+        const std::vector<unsigned char>& getLog() const
+        {
+            return log;
+        }
+
+        /*!
+            \brief Clears the log, for example after taking a snapshot.
+        */
+        void clearLog()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            log.clear();
+        }
+
+        /*!
+            \brief Sets whether queries are recorded (false by default).
+
+            Recording a query that is not a stored function call takes an
+            extra pass over the Entities to count the matching ones. Must not
+            be called while other threads record operations.
+        */
+        void setRecordQueries(bool recordQueries)
+        {
+            this->recordQueries = recordQueries;
+        }
+
+        /*!
+            \brief Returns true if queries are recorded.
+        */
+        bool isRecordingQueries() const
+        {
+            return recordQueries;
+        }
+
+        /*!
+            \brief Appends a record to the calling thread's buffer.
+
+            Used by Manager; payload holds the bytes of an added Component or
+            the bits of a queried Signature.
+        */
+        void record(JournalOp op, std::uint64_t entityID,
+            std::uint64_t typeIndex = 0,
+            const void* payload = nullptr, std::size_t payloadSize = 0)
+        {
+            ThreadBuffer& buffer = getThreadBuffer();
+            // Sequence, op, id, type index and payload size, at most 10
+            // bytes per varint.
+            std::size_t maxSize = 41 + payloadSize;
+            if(buffer.size + maxSize > buffer.data.size())
+            {
+                if(buffer.size > 0)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    flushBuffer(buffer);
+                }
+                if(maxSize > buffer.data.size())
+                {
+                    buffer.data.resize(maxSize);
+                }
+            }
+
+            // Records of operations ordered by a happens before relation get
+            // increasing sequence numbers, and records of concurrent
+            // operations (which must not depend on each other) may get any
+            // order. Relaxed is enough, as all increments of one atomic are
+            // totally ordered.
+            std::uint64_t recordSequence =
+                sequence.fetch_add(1, std::memory_order_relaxed);
+
+            unsigned char* out = buffer.data.data() + buffer.size;
+            out = writeVarint(out, recordSequence);
+            *out++ = (unsigned char) op;
+            out = writeVarint(out, entityID);
+            if(hasTypeIndex(op))
+            {
+                out = writeVarint(out, typeIndex);
+            }
+            if(hasPayload(op))
+            {
+                out = writeVarint(out, payloadSize);
+                if(payloadSize > 0)
+                {
+                    std::memcpy(out, payload, payloadSize);
+                    out += payloadSize;
+                }
+            }
+            buffer.size = out - buffer.data.data();
+        }
+
+        /*!
+            \brief Returns true if records of the given op hold a type index.
+        */
+        static bool hasTypeIndex(JournalOp op)
+        {
+            return op == JournalOp::AddComponent
+                || op == JournalOp::RemoveComponent
+                || op == JournalOp::AddTag
+                || op == JournalOp::RemoveTag
+                || op == JournalOp::Query;
+        }
+
+        /*!
+            \brief Returns true if records of the given op hold a payload.
+        */
+        static bool hasPayload(JournalOp op)
+        {
+            return op == JournalOp::AddComponent || op == JournalOp::Query;
+        }
+
+    private:
+        struct ThreadBuffer
+        {
+            std::thread::id thread;
+            // Holds one batch, of which the first size bytes are used.
+            std::vector<unsigned char> data;
+            std::size_t size = 0;
+        };
+
+        static unsigned char* writeVarint(unsigned char* out,
+            std::uint64_t value)
+        {
+            while(value >= 0x80)
+            {
+                *out++ = (unsigned char)(value | 0x80);
+                value >>= 7;
+            }
+            *out++ = (unsigned char)value;
+            return out;
+        }
+
+        static std::atomic<std::uint64_t>& nextJournalID()
+        {
+            static std::atomic<std::uint64_t> id{1};
+            return id;
+        }
+
+        ThreadBuffer& getThreadBuffer()
+        {
+            // Most recently used buffer of this thread.
+            thread_local std::uint64_t cachedJournal = 0;
+            thread_local ThreadBuffer* cachedBuffer = nullptr;
+            if(cachedJournal == journalID)
+            {
+                return *cachedBuffer;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            std::thread::id thread = std::this_thread::get_id();
+            ThreadBuffer* found = nullptr;
+            for(auto& buffer : buffers)
+            {
+                if(buffer->thread == thread)
+                {
+                    found = buffer.get();
+                    break;
+                }
+            }
+            if(!found)
+            {
+                buffers.push_back(std::make_unique<ThreadBuffer>());
+                found = buffers.back().get();
+                found->thread = thread;
+                found->data.resize(batchSize);
+            }
+            cachedJournal = journalID;
+            cachedBuffer = found;
+            return *found;
+        }
+
+        // A batch is its size in bytes followed by its records.
+        void flushBuffer(ThreadBuffer& buffer)
+        {
+            if(buffer.size == 0)
+            {
+                return;
+            }
+            unsigned char header[10];
+            std::size_t headerSize = writeVarint(header, buffer.size) - header;
+            if(sink)
+            {
+                sink(header, headerSize);
+                sink(buffer.data.data(), buffer.size);
+            }
+            else
+            {
+                log.insert(log.end(), header, header + headerSize);
+                log.insert(log.end(), buffer.data.data(),
+                    buffer.data.data() + buffer.size);
+            }
+            buffer.size = 0;
+        }
+
+        Sink sink;
+        std::size_t batchSize;
+        bool recordQueries = false;
+        std::uint64_t journalID;
+        std::atomic<std::uint64_t> sequence{0};
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadBuffer> > buffers;
+        std::vector<unsigned char> log;
+    };
+}
+
+#endif
@@ -9,8 +9,25 @@
 
 #define EC_INIT_ENTITIES_SIZE 256
 #define EC_GROW_SIZE_AMOUNT 256
+#define EC_RELATION_PREFETCH_DISTANCE 8
+#define EC_SNAPSHOT_CHUNK_SIZE 65536
+// Queries whose rarest Component or Tag is owned by more than this percentage
+// of Entities scan all Entities instead of using the bit planes.
+#define EC_QUERY_SCAN_PERCENT 50
+// Runs of at least this many consecutive matching Entities are evaluated by
+// forMatchingExpression() with the contiguous kernel, and shorter runs are
+// gathered in blocks of EC_EXPRESSION_BLOCK_SIZE ids.
+#define EC_EXPRESSION_MIN_RUN 8
+#define EC_EXPRESSION_BLOCK_SIZE 256
+// Default minimum number of Entities per thread of a parallel call, about the
+// number of Entities processed in the time it takes to start a thread.
+// Smaller calls use fewer threads, down to running on the calling thread.
+#define EC_DEFAULT_GRAIN_SIZE 1024
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <array>
 #include <vector>
 #include <tuple>
 #include <utility>
@@ -20,8 +37,14 @@
 #include <set>
 #include <unordered_set>
 #include <algorithm>
+#include <limits>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <chrono>
+#include <stdexcept>
 #include <type_traits>
 
 #ifndef NDEBUG
@@ -33,7 +56,19 @@
 #include "Meta/ForEachWithIndex.hpp"
 #include "Meta/ForEachDoubleTuple.hpp"
 #include "Meta/IndexOf.hpp"
+#include "Meta/ContainsAll.hpp"
 #include "Bitset.hpp"
+#include "BitPlanes.hpp"
+#include "ColumnView.hpp"
+#include "EntityRef.hpp"
+#include "Codec.hpp"
+#include "CostEstimate.hpp"
+#include "Executor.hpp"
+#include "Expression.hpp"
+#include "Fused.hpp"
+#include "Inbox.hpp"
+#include "Journal.hpp"
+#include "TimingWheel.hpp"
 
 namespace EC
 {
@@ -45,19 +80,46 @@ namespace EC
 
         Note that all components must have a default constructor.
 
+        The optional third template parameter is the unsigned integer type
+        used for Entity ids (default std::size_t). A narrower type such as
+        std::uint32_t reduces the memory used by lists of matching Entities,
+        the list of deleted Entities and Entity references, but limits the
+        number of Entities to the maximum value of that type, which is
+        reserved as the id of invalid Entity references. Adding Entities
+        beyond that limit throws std::length_error.
+
+        Components that are always accessed together can be declared as a
+        fusion group with EC::Fused in the list of Components, which stores
+        them interleaved in one column. Components is the list of Components
+        with fusion groups replaced by their Components.
+
         Example:
         \code{.cpp}
             EC::Manager<TypeList<C0, C1, C2>, TypeList<T0, T1>> manager;
+
+            EC::Manager<TypeList<C0, C1>, TypeList<T0>, std::uint32_t>
+                manager32;
+
+            EC::Manager<TypeList<EC::Fused<C0, C1>, C2>, TypeList<T0>>
+                fusedManager;
         \endcode
     */
-    template <typename ComponentsList, typename TagsList>
+    template <typename DeclaredComponents, typename TagsList,
+        typename IndexType = std::size_t>
     struct Manager
     {
     public:
+        using ComponentsList = EC::FlattenFused<DeclaredComponents>;
         using Components = ComponentsList;
         using Tags = TagsList;
         using Combined = EC::Meta::Combine<ComponentsList, TagsList>;
         using BitsetType = EC::Bitset<ComponentsList, TagsList>;
+        using Index = IndexType;
+        using EntityRef = EC::BasicEntityRef<IndexType>;
+
+        static_assert(std::is_integral<IndexType>::value
+                && std::is_unsigned<IndexType>::value,
+            "IndexType must be an unsigned integer type");
 
     private:
         using ComponentsTuple = EC::Meta::Morph<ComponentsList, std::tuple<> >;
@@ -69,8 +131,55 @@ namespace EC
         {
             using type = std::tuple<std::vector<Types>..., std::vector<char> >;
         };
+        // One column per entry of DeclaredComponents, so the Components of a
+        // fusion group share a column.
         using ComponentsStorage =
-            typename EC::Meta::Morph<ComponentsList, Storage<> >::type;
+            typename EC::Meta::Morph<DeclaredComponents, Storage<> >::type;
+
+        // The entry of DeclaredComponents storing a Component, char if the
+        // Component is unknown.
+        template <typename Component>
+        using StorageUnit = EC::FusedUnitOf<Component, DeclaredComponents>;
+
+        // The index in ComponentsStorage of the column storing a Component,
+        // which is the index of the vector<char> if the Component is
+        // unknown.
+        template <typename Component>
+        using StorageIndex = EC::Meta::IndexOf<
+            StorageUnit<Component>, DeclaredComponents>;
+
+        // The distance in bytes between a Component of neighbouring
+        // Entities.
+        template <typename Component>
+        using ColumnStride = std::integral_constant<std::size_t,
+            EC::Meta::Contains<Component, ComponentsList>::value
+                ? sizeof(StorageUnit<Component>) : sizeof(Component)>;
+
+        // The columns passed to expressions by forMatchingExpression().
+        template <typename... Types>
+        struct ExpressionColumnsHelper
+        {
+            using type = std::tuple<
+                EC::ColumnPointer<Types, ColumnStride<Types>::value>...>;
+        };
+        using ExpressionColumns = typename EC::Meta::Morph<
+            ComponentsList, ExpressionColumnsHelper<> >::type;
+
+        template <typename Component>
+        static Component* getStoredComponent(ComponentsStorage& storage,
+            std::size_t index)
+        {
+            return EC::getUnitComponent<Component>(
+                std::get<StorageIndex<Component>::value>(storage)[index]);
+        }
+
+        template <typename Component>
+        static const Component* getStoredComponent(
+            const ComponentsStorage& storage, std::size_t index)
+        {
+            return EC::getUnitComponent<Component>(
+                std::get<StorageIndex<Component>::value>(storage)[index]);
+        }
 
         // Entity: isAlive, ComponentsTags Info
         using EntitiesTupleType = std::tuple<bool, BitsetType>;
@@ -80,9 +189,391 @@ namespace EC
         ComponentsStorage componentsStorage;
         std::size_t currentCapacity = 0;
         std::size_t currentSize = 0;
-        std::unordered_set<std::size_t> deletedSet;
+        // Incremented whenever storage is reallocated.
+        std::size_t storageVersion = 0;
+
+        /*
+            An epoch counter that may be set from multiple threads at once.
+            Copying a Manager copies the current value.
+        */
+        struct ColumnEpoch
+        {
+            std::atomic<std::size_t> value{1};
+
+            ColumnEpoch() = default;
+
+            ColumnEpoch(const ColumnEpoch& other) :
+            value(other.get())
+            {}
+
+            ColumnEpoch& operator=(const ColumnEpoch& other)
+            {
+                value.store(other.get(), std::memory_order_relaxed);
+                return *this;
+            }
+
+            std::size_t get() const
+            {
+                return value.load(std::memory_order_relaxed);
+            }
+
+            void set(std::size_t epoch)
+            {
+                value.store(epoch, std::memory_order_relaxed);
+            }
+        };
+
+        // A mutex member that does not prevent copying a Manager. Copies get
+        // a new mutex.
+        struct CopyableMutex
+        {
+            std::mutex mutex;
+
+            CopyableMutex() = default;
+
+            CopyableMutex(const CopyableMutex& /* other */)
+            {}
+
+            CopyableMutex& operator=(const CopyableMutex& /* other */)
+            {
+                return *this;
+            }
+        };
+
+        // The last snapshot epoch in which each Component column (and,
+        // at index Components::size, the Entity info) may have been modified.
+        ColumnEpoch columnEpochs[Components::size + 1];
+        std::size_t snapshotEpoch = 1;
+
+        template <typename Component>
+        void markColumnModified()
+        {
+            constexpr auto componentIndex =
+                EC::Meta::IndexOf<Component, Components>::value;
+            if(componentIndex < Components::size
+                && columnEpochs[componentIndex].get() != snapshotEpoch)
+            {
+                columnEpochs[componentIndex].set(snapshotEpoch);
+            }
+        }
+
+        template <typename ComponentTypeList>
+        void markColumnsModified()
+        {
+            EC::Meta::forEach<ComponentTypeList>([this] (auto t) {
+                this->template markColumnModified<decltype(t)>();
+            });
+        }
+
+        // Read-only queries leave the columns unmodified.
+        template <typename ComponentTypeList>
+        void markColumnsModified() const
+        {
+        }
+
+        void markEntitiesModified()
+        {
+            if(columnEpochs[Components::size].get() != snapshotEpoch)
+            {
+                columnEpochs[Components::size].set(snapshotEpoch);
+            }
+        }
+
+        void markAllModified()
+        {
+            for(auto& epoch : columnEpochs)
+            {
+                epoch.set(snapshotEpoch);
+            }
+        }
+
+        /*
+            Returns a pointer to a Component without bounds checking or
+            marking its column as modified. Used by the forMatching functions,
+            which mark the columns of their Signature once per call.
+        */
+        template <typename Component>
+        Component* getComponentData(const IndexType& index)
+        {
+            return getStoredComponent<Component>(componentsStorage, index);
+        }
+
+        template <typename Component>
+        const Component* getComponentData(const IndexType& index) const
+        {
+            return getStoredComponent<Component>(componentsStorage, index);
+        }
+        // One bit per id below currentSize, set if that id is deleted.
+        std::vector<std::uint64_t> deletedBits;
+        std::size_t deletedCount = 0;
+        // No word of deletedBits below this index has a set bit.
+        std::size_t deletedLowestWord = 0;
+        // Ids passed to markForDeletion() since the last flushDeletions().
+        std::vector<IndexType> pendingDeletions;
+        mutable CopyableMutex pendingDeletionsMutex;
+
+        EC::Journal* journal = nullptr;
+
+        // One plane per Component and Tag, with a bit set for each Entity
+        // owning it. Used to plan which Entities a query visits.
+        EC::BitPlanes bitPlanes{Combined::size};
+
+        // Sets a bit of an Entity's bitset and of the matching bit plane.
+        void setEntityBit(std::size_t entityID, std::size_t bit, bool value)
+        {
+            std::get<BitsetType>(entities[entityID])[bit] = value;
+            bitPlanes.set(bit, entityID, value);
+        }
+
+        void setEntityBitset(std::size_t entityID, const BitsetType& bitset)
+        {
+            BitsetType& current = std::get<BitsetType>(entities[entityID]);
+            for(std::size_t bit = 0; bit < Combined::size; ++bit)
+            {
+                if(current[bit] != bitset[bit])
+                {
+                    bitPlanes.set(bit, entityID, bitset[bit]);
+                }
+            }
+            current = bitset;
+        }
+
+        template <typename Component>
+        void journalComponent(const IndexType& entityID,
+            const Component& component, std::true_type /* trivial */)
+        {
+            journal->record(EC::JournalOp::AddComponent, entityID,
+                EC::Meta::IndexOf<Component, Components>::value,
+                &component, sizeof(Component));
+        }
+
+        // Components that are not trivially copyable are recorded without
+        // their contents and replayed as default constructed.
+        template <typename Component>
+        void journalComponent(const IndexType& entityID,
+            const Component& /* component */, std::false_type /* trivial */)
+        {
+            journal->record(EC::JournalOp::AddComponent, entityID,
+                EC::Meta::IndexOf<Component, Components>::value);
+        }
+
+        // Records the Components and Tags of an Entity added without
+        // addComponent() and addTag().
+        void journalEntityContents(const IndexType& entityID)
+        {
+            const BitsetType& bitset = std::get<BitsetType>(entities[entityID]);
+            EC::Meta::forEach<ComponentsList>(
+            [this, &entityID, &bitset] (auto t) {
+                using Component = decltype(t);
+                constexpr auto index =
+                    EC::Meta::IndexOf<Component, Components>::value;
+                if(bitset[index])
+                {
+                    this->journalComponent(entityID,
+                        *getStoredComponent<Component>(
+                            this->componentsStorage, entityID),
+                        std::is_trivially_copyable<Component>{});
+                }
+            });
+            EC::Meta::forEachWithIndex<TagsList>(
+            [this, &entityID, &bitset] (auto /* tag */, auto index) {
+                if(bitset[Components::size + index])
+                {
+                    this->journal->record(
+                        EC::JournalOp::AddTag, entityID, index);
+                }
+            });
+        }
+
+        // How forEachMatchingEntity() visits the Entities matching a
+        // signature.
+        struct QueryPlan
+        {
+            enum Method
+            {
+                // No Entity can match.
+                Nothing,
+                // Test each Entity.
+                Scan,
+                // Intersect the bit planes.
+                Planes
+            };
+
+            Method method = Nothing;
+            // The planes of the signature's bits, rarest first.
+            std::array<std::size_t, Combined::size + 1> planes;
+            std::size_t planeCount = 0;
+            // Estimated number of Entities tested or plane words read.
+            std::size_t cost = 0;
+            // At most this many Entities match.
+            std::size_t matches = 0;
+        };
+
+        /*
+            This is the query planner. The planes of the signature's bits are
+            ordered by their number of set bits. If the rarest plane is empty
+            nothing is visited. If it is sparse, the planes are intersected
+            word by word, so that the rarest plane drives the iteration and
+            the other planes are only probed for words where it has bits,
+            reading at most one word per 64 Entities per plane. If it holds
+            more than EC_QUERY_SCAN_PERCENT percent of the Entities, or the
+            signature has no bits, visiting each match costs more than
+            testing each Entity, so all Entities are scanned instead.
+        */
+        QueryPlan planQuery(const BitsetType& signature) const
+        {
+            QueryPlan plan;
+            for(std::size_t bit = 0; bit < Combined::size; ++bit)
+            {
+                if(signature[bit])
+                {
+                    plan.planes[plan.planeCount++] = bit;
+                }
+            }
+
+            std::array<std::size_t, Combined::size + 1> counts;
+            for(std::size_t i = 0; i < plan.planeCount; ++i)
+            {
+                counts[plan.planes[i]] = bitPlanes.count(plan.planes[i]);
+                if(counts[plan.planes[i]] == 0)
+                {
+                    return plan;
+                }
+            }
+            // Insertion sort, as signatures have few bits, and std::sort on a
+            // prefix of the array trips -Warray-bounds with GCC 12.
+            for(std::size_t i = 1; i < plan.planeCount; ++i)
+            {
+                std::size_t plane = plan.planes[i];
+                std::size_t j = i;
+                for(; j > 0 && counts[plane] < counts[plan.planes[j - 1]]; --j)
+                {
+                    plan.planes[j] = plan.planes[j - 1];
+                }
+                plan.planes[j] = plane;
+            }
+
+            plan.matches = plan.planeCount == 0
+                ? currentSize - deletedCount : counts[plan.planes[0]];
+            if(plan.planeCount == 0 || counts[plan.planes[0]] * 100
+                > (currentSize - deletedCount) * EC_QUERY_SCAN_PERCENT)
+            {
+                plan.method = QueryPlan::Scan;
+                plan.cost = currentSize;
+            }
+            else
+            {
+                plan.method = QueryPlan::Planes;
+                plan.cost = currentSize / 64 + counts[plan.planes[0]];
+            }
+            return plan;
+        }
+
+        /*
+            Calls function(id) for each alive Entity in [begin, end) that
+            matches signature, in ascending order of id, as planned by
+            planQuery().
+
+            Matches are checked again right before function is called, as
+            function may change the Entities that follow.
+        */
+        template <typename Function>
+        void forEachMatchingEntity(const QueryPlan& plan,
+            const BitsetType& signature,
+            std::size_t begin, std::size_t end, Function&& function) const
+        {
+            if(plan.method == QueryPlan::Nothing || begin >= end)
+            {
+                return;
+            }
+            else if(plan.method == QueryPlan::Scan)
+            {
+                for(std::size_t i = begin; i < end; ++i)
+                {
+                    if(std::get<bool>(entities[i])
+                        && (signature & std::get<BitsetType>(entities[i]))
+                            == signature)
+                    {
+                        function(i);
+                    }
+                }
+                return;
+            }
+
+            std::size_t firstWord = begin / 64;
+            std::size_t lastWord = (end - 1) / 64;
+            for(std::size_t word = firstWord; word <= lastWord; ++word)
+            {
+                std::uint64_t bits = bitPlanes.getWord(plan.planes[0], word);
+                for(std::size_t i = 1; i < plan.planeCount && bits != 0; ++i)
+                {
+                    bits &= bitPlanes.getWord(plan.planes[i], word);
+                }
+                if(word == firstWord)
+                {
+                    bits &= ~std::uint64_t(0) << (begin % 64);
+                }
+                if(word == lastWord && end % 64 != 0)
+                {
+                    bits &= (std::uint64_t(1) << (end % 64)) - 1;
+                }
+                while(bits != 0)
+                {
+                    std::size_t id = word * 64 + countTrailingZeros(bits);
+                    bits &= bits - 1;
+                    if(std::get<bool>(entities[id])
+                        && (signature & std::get<BitsetType>(entities[id]))
+                            == signature)
+                    {
+                        function(id);
+                    }
+                }
+            }
+        }
+
+        template <typename Function>
+        void forEachMatchingEntity(const BitsetType& signature,
+            std::size_t begin, std::size_t end, Function&& function) const
+        {
+            forEachMatchingEntity(planQuery(signature), signature, begin, end,
+                std::forward<Function>(function));
+        }
+
+        // Runs parallel calls, or EC::ThreadPool::getDefault() if nullptr.
+        EC::Executor* executor = nullptr;
 
     public:
+        /*!
+            \brief Splits [0, size) into at most rangeCount consecutive
+                ranges and calls function(range, begin, end) for each through
+                the executor, as the parallel calls do.
+
+            Ranges have at least grainSize items (the Manager's grain size if
+            0) and sizes differing by at most one. A single range runs on the
+            calling thread.
+        */
+        template <typename Function>
+        void forEachRange(std::size_t size, std::size_t rangeCount,
+            Function&& function, std::size_t grainSize = 0) const
+        {
+            std::size_t grain = std::max(
+                grainSize != 0 ? grainSize : this->grainSize, std::size_t(1));
+            rangeCount = std::min(rangeCount, size / grain);
+            if(rangeCount <= 1)
+            {
+                function(0, 0, size);
+                return;
+            }
+            std::size_t s = size / rangeCount;
+            std::size_t extra = size % rangeCount;
+            getExecutor().parallelFor(rangeCount,
+                [&function, s, extra] (std::size_t range) {
+                    std::size_t begin = s * range + std::min(range, extra);
+                    function(range, begin,
+                        begin + s + (range < extra ? 1 : 0));
+                });
+        }
+
         /*!
             \brief Initializes the manager with a default capacity.
 
@@ -102,7 +593,8 @@ namespace EC
                 return;
             }
 
-            EC::Meta::forEach<ComponentsList>([this, newCapacity] (auto t) {
+            EC::Meta::forEach<DeclaredComponents>(
+            [this, newCapacity] (auto t) {
                 std::get<std::vector<decltype(t)> >(
                     this->componentsStorage).resize(newCapacity);
             });
@@ -113,18 +605,80 @@ namespace EC
                 entities[i] = std::make_tuple(false, BitsetType{});
             }
 
+            deletedBits.resize((newCapacity + 63) / 64, 0);
+            bitPlanes.resize(newCapacity);
+
             currentCapacity = newCapacity;
+            ++storageVersion;
+        }
+
+        static std::size_t countTrailingZeros(std::uint64_t word)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_ctzll(word);
+#else
+            std::size_t count = 0;
+            while((word & 1) == 0)
+            {
+                word >>= 1;
+                ++count;
+            }
+            return count;
+#endif
+        }
+
+        static std::size_t popcount(std::uint64_t word)
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            return __builtin_popcountll(word);
+#else
+            std::size_t count = 0;
+            while(word != 0)
+            {
+                word &= word - 1;
+                ++count;
+            }
+            return count;
+#endif
+        }
+
+        bool isDeleted(std::size_t index) const
+        {
+            return (deletedBits[index / 64] >> (index % 64)) & 1;
+        }
+
+        // Ids are below the maximum of IndexType, which is
+        // EntityRef::invalid. Reused ids are below currentSize, so only ids
+        // past currentSize need checking.
+        void checkNewEntities(std::size_t count) const
+        {
+            if(count > std::size_t(std::numeric_limits<IndexType>::max())
+                - currentSize)
+            {
+                throw std::length_error(
+                    "EC::Manager: IndexType has no unused Entity id left");
+            }
         }
 
     public:
         /*!
             \brief Adds an entity to the system, returning the ID of the entity.
 
+            The lowest ID of a previously deleted Entity is reused if one is
+            available, which keeps the range of IDs to iterate over compact.
+            Throws std::length_error if there is none and IndexType has no
+            unused id left.
+
             Note: The ID of an entity is guaranteed to not change.
         */
-        std::size_t addEntity()
+        IndexType addEntity()
         {
-            if(deletedSet.empty())
+            if(deletedCount == 0)
+            {
+                checkNewEntities(1);
+            }
+            markEntitiesModified();
+            if(deletedCount == 0)
             {
                 if(currentSize == currentCapacity)
                 {
@@ -132,18 +686,33 @@ namespace EC
                 }
 
                 std::get<bool>(entities[currentSize]) = true;
+                cancelTimers(currentSize);
 
+                if(journal)
+                {
+                    journal->record(EC::JournalOp::AddEntity, currentSize);
+                }
                 return currentSize++;
             }
             else
             {
-                std::size_t id;
+                std::size_t word = deletedLowestWord;
+                while(deletedBits[word] == 0)
                 {
-                    auto iter = deletedSet.begin();
-                    id = *iter;
-                    deletedSet.erase(iter);
+                    ++word;
                 }
+                IndexType id = word * 64
+                    + countTrailingZeros(deletedBits[word]);
+                deletedBits[word] &= deletedBits[word] - 1;
+                --deletedCount;
+                deletedLowestWord = word;
+
                 std::get<bool>(entities[id]) = true;
+                cancelTimers(id);
+                if(journal)
+                {
+                    journal->record(EC::JournalOp::AddEntity, id);
+                }
                 return id;
             }
         }
@@ -154,78 +723,343 @@ namespace EC
             A deleted Entity's id is stored to be reclaimed later when
             addEntity is called. Thus calling addEntity may return an id of
             a previously deleted Entity.
+
+            If the deleted Entity has the highest id in the system, the
+            system shrinks past it and any deleted Entities directly below it,
+            so that they are no longer iterated over.
         */
-        void deleteEntity(const std::size_t& index)
+        void deleteEntity(const IndexType& index)
         {
-            if(hasEntity(index))
+            if(!isAlive(index))
             {
-                std::get<bool>(entities.at(index)) = false;
-                std::get<BitsetType>(entities.at(index)).reset();
-                deletedSet.insert(index);
+                return;
             }
-        }
-
 
-        /*!
-            \brief Checks if the Entity with the given ID is in the system.
+            markEntitiesModified();
+            if(journal)
+            {
+                journal->record(EC::JournalOp::DeleteEntity, index);
+            }
+            std::get<bool>(entities[index]) = false;
+            setEntityBitset(index, BitsetType{});
 
-            Note that deleted Entities are still considered in the system.
-            Consider using isAlive().
-        */
-        bool hasEntity(const std::size_t& index) const
-        {
-            return index < currentSize;
+            if(std::size_t(index) + 1 == currentSize)
+            {
+                --currentSize;
+                while(currentSize > 0 && isDeleted(currentSize - 1))
+                {
+                    --currentSize;
+                    deletedBits[currentSize / 64] &=
+                        ~(std::uint64_t(1) << (currentSize % 64));
+                    --deletedCount;
+                }
+            }
+            else
+            {
+                deletedBits[index / 64] |= std::uint64_t(1) << (index % 64);
+                ++deletedCount;
+                if(index / 64 < deletedLowestWord)
+                {
+                    deletedLowestWord = index / 64;
+                }
+            }
         }
 
-
         /*!
-            \brief Checks if the Entity is not marked as deleted.
-
-            Note that invalid Entities (Entities where calls to hasEntity()
-            returns false) will return false.
+            \brief Marks an Entity to be deleted by the next call to
+                flushDeletions().
+
+            Unlike deleteEntity(), the Entity stays alive and keeps matching
+            queries until then, so this may be called while iterating, also
+            from multiple threads at once. Marking an Entity more than once,
+            or deleting it before the flush, has no further effect. The id
+            must not be reused before the flush, so do not call
+            deleteEntity() and then addEntity() in between.
         */
-        bool isAlive(const std::size_t& index) const
+        void markForDeletion(const IndexType& index)
         {
-            return hasEntity(index) && std::get<bool>(entities.at(index));
+            std::lock_guard<std::mutex> guard(pendingDeletionsMutex.mutex);
+            pendingDeletions.push_back(index);
         }
 
         /*!
-            \brief Returns the current size or number of entities in the system.
-
-            Note this function will only count entities where isAlive() returns
-            true.
-        */
-        std::size_t getCurrentSize() const
-        {
-            return currentSize - deletedSet.size();
-        }
-
-        /*
-            \brief Returns the current capacity or number of entities the system
-                can hold.
+            \brief Returns the number of ids passed to markForDeletion()
+                since the last call to flushDeletions().
 
-            Note that when capacity is exceeded, the capacity is increased by
-            EC_GROW_SIZE_AMOUNT.
+            May be called while other threads call markForDeletion().
         */
-        std::size_t getCurrentCapacity() const
+        std::size_t getPendingDeletionCount() const
         {
-            return currentCapacity;
+            std::lock_guard<std::mutex> guard(pendingDeletionsMutex.mutex);
+            return pendingDeletions.size();
         }
 
         /*!
-            \brief Returns a const reference to an Entity's info.
+            \brief Deletes the Entities passed to markForDeletion().
 
-            An Entity's info is a std::tuple with a bool, and a
-            bitset.
+            Has the same effect as calling deleteEntity() on each, but sorts
+            the ids and clears the Component and Tag bits and marks the ids
+            free 64 Entities at a time, which is faster when many Entities
+            are deleted at once.
 
-            \n The bool determines if the Entity is alive.
-            \n The bitset shows what Components and Tags belong to the Entity.
+            Must not be called while iterating.
+
+            \return The number of deleted Entities.
         */
-        const EntitiesTupleType& getEntityInfo(const std::size_t& index) const
+        std::size_t flushDeletions()
+        {
+            std::sort(pendingDeletions.begin(), pendingDeletions.end());
+            std::size_t deleted = 0;
+            std::size_t i = 0;
+            while(i < pendingDeletions.size())
+            {
+                // Gather the ids of one word of deletedBits and bitPlanes.
+                std::size_t word = pendingDeletions[i] / 64;
+                std::uint64_t mask = 0;
+                for(; i < pendingDeletions.size()
+                    && pendingDeletions[i] / 64 == word; ++i)
+                {
+                    IndexType index = pendingDeletions[i];
+                    if(!isAlive(index))
+                    {
+                        continue;
+                    }
+                    if(journal)
+                    {
+                        journal->record(EC::JournalOp::DeleteEntity, index);
+                    }
+                    entities[index] = std::make_tuple(false, BitsetType{});
+                    mask |= std::uint64_t(1) << (index % 64);
+                }
+                if(mask == 0)
+                {
+                    continue;
+                }
+
+                for(std::size_t plane = 0; plane < Combined::size; ++plane)
+                {
+                    bitPlanes.clearWord(plane, word, mask);
+                }
+                deletedBits[word] |= mask;
+                deletedCount += popcount(mask);
+                deleted += popcount(mask);
+                if(word < deletedLowestWord)
+                {
+                    deletedLowestWord = word;
+                }
+            }
+            pendingDeletions.clear();
+
+            if(deleted > 0)
+            {
+                markEntitiesModified();
+                while(currentSize > 0 && isDeleted(currentSize - 1))
+                {
+                    --currentSize;
+                    deletedBits[currentSize / 64] &=
+                        ~(std::uint64_t(1) << (currentSize % 64));
+                    --deletedCount;
+                }
+            }
+            return deleted;
+        }
+
+        /*!
+            \brief Checks if the Entity with the given ID is in the system.
+
+            Note that deleted Entities are still considered in the system
+            unless no living Entity has a higher id. Consider using isAlive().
+        */
+        bool hasEntity(const IndexType& index) const
+        {
+            return index < currentSize;
+        }
+
+
+        /*!
+            \brief Checks if the Entity is not marked as deleted.
+
+            Note that invalid Entities (Entities where calls to hasEntity()
+            returns false) will return false.
+        */
+        bool isAlive(const IndexType& index) const
+        {
+            return hasEntity(index) && std::get<bool>(entities.at(index));
+        }
+
+        /*!
+            \brief Returns the current size or number of entities in the system.
+
+            Note this function will only count entities where isAlive() returns
+            true.
+        */
+        std::size_t getCurrentSize() const
+        {
+            return currentSize - deletedCount;
+        }
+
+        /*
+            \brief Returns the current capacity or number of entities the system
+                can hold.
+
+            Note that when capacity is exceeded, the capacity is increased by
+            EC_GROW_SIZE_AMOUNT.
+        */
+        std::size_t getCurrentCapacity() const
+        {
+            return currentCapacity;
+        }
+
+        /*!
+            \brief Returns a const reference to an Entity's info.
+
+            An Entity's info is a std::tuple with a bool, and a
+            bitset.
+
+            \n The bool determines if the Entity is alive.
+            \n The bitset shows what Components and Tags belong to the Entity.
+        */
+        const EntitiesTupleType& getEntityInfo(const IndexType& index) const
         {
             return entities.at(index);
         }
 
+        /*!
+            \brief Returns the current version of the Manager's storage.
+
+            The version changes whenever component and Entity storage is
+            reallocated, which invalidates any view previously returned by
+            getColumn() or getEntitiesColumn().
+        */
+        std::size_t getStorageVersion() const
+        {
+            return storageVersion;
+        }
+
+        /*!
+            \brief Returns a view of all Entities' info.
+
+            The view covers the ids [0, size) where size is the number of ids
+            currently iterated over. Each element is the same std::tuple
+            returned by getEntityInfo().
+        */
+        EC::ColumnView<const EntitiesTupleType> getEntitiesColumn() const
+        {
+            return EC::ColumnView<const EntitiesTupleType>{
+                entities.data(), currentSize, storageVersion};
+        }
+
+        /*!
+            \brief Returns a view of the column holding the given Component
+                for all Entities.
+
+            The element at an Entity's id is that Entity's Component, which is
+            only meaningful if the Entity owns the Component (see
+            hasComponent() and getEntitiesColumn()). This allows copying or
+            streaming a whole column at once instead of calling
+            getEntityData() per Entity.
+
+            The view is invalidated when the Manager grows its storage. Compare
+            the view's version with getStorageVersion() to check if a
+            previously taken view is still valid.
+
+            If the given Component is unknown to the Manager, then the
+            returned view is empty with a nullptr.
+
+            The view of a Component in a fusion group (see EC::Fused) is
+            strided, with elements ColumnView::stride bytes apart. Given the
+            EC::Fused type of a fusion group, the view covers the group's
+            interleaved column, which is contiguous.
+
+            Example:
+            \code{.cpp}
+                auto column = manager.getColumn<C0>();
+                std::memcpy(buffer, column.data, column.size * sizeof(C0));
+            \endcode
+        */
+        template <typename Component>
+        EC::ColumnView<Component, ColumnStride<Component>::value> getColumn()
+        {
+            using View = EC::ColumnView<Component,
+                ColumnStride<Component>::value>;
+            constexpr auto componentIndex = EC::Meta::IndexOf<
+                Component, Components>::value;
+            constexpr auto unitIndex = EC::Meta::IndexOf<
+                Component, DeclaredComponents>::value;
+            if(componentIndex < Components::size)
+            {
+                markColumnModified<Component>();
+                auto& column = std::get<StorageIndex<Component>::value>(
+                    componentsStorage);
+                return View{
+                    column.empty() ? nullptr
+                        : EC::getUnitComponent<Component>(column[0]),
+                    currentSize,
+                    storageVersion};
+            }
+            else if(unitIndex < DeclaredComponents::size)
+            {
+                // The column of a fusion group.
+                markColumnsModified<typename EC::Internal::UnitComponents<
+                    Component>::type>();
+                // Cast required due to compiler thinking that an invalid
+                // Component is needed even though the enclosing if statement
+                // prevents this from ever happening.
+                return View{
+                    (Component*) std::get<unitIndex>(
+                        componentsStorage).data(),
+                    currentSize,
+                    storageVersion};
+            }
+            else
+            {
+                return View{nullptr, 0, storageVersion};
+            }
+        }
+
+        /*!
+            \brief Returns a const view of the column holding the given
+                Component for all Entities.
+
+            See getColumn().
+        */
+        template <typename Component>
+        EC::ColumnView<const Component, ColumnStride<Component>::value>
+            getColumn() const
+        {
+            using View = EC::ColumnView<const Component,
+                ColumnStride<Component>::value>;
+            constexpr auto componentIndex = EC::Meta::IndexOf<
+                Component, Components>::value;
+            constexpr auto unitIndex = EC::Meta::IndexOf<
+                Component, DeclaredComponents>::value;
+            if(componentIndex < Components::size)
+            {
+                const auto& column = std::get<
+                    StorageIndex<Component>::value>(componentsStorage);
+                return View{
+                    column.empty() ? nullptr
+                        : EC::getUnitComponent<Component>(column[0]),
+                    currentSize,
+                    storageVersion};
+            }
+            else if(unitIndex < DeclaredComponents::size)
+            {
+                // Cast required due to compiler thinking that an invalid
+                // Component is needed even though the enclosing if statement
+                // prevents this from ever happening.
+                return View{
+                    (const Component*) std::get<unitIndex>(
+                        componentsStorage).data(),
+                    currentSize,
+                    storageVersion};
+            }
+            else
+            {
+                return View{nullptr, 0, storageVersion};
+            }
+        }
+
         /*!
             \brief Returns a pointer to a component belonging to the given
                 Entity.
@@ -240,17 +1074,16 @@ namespace EC
             will return a nullptr.
         */
         template <typename Component>
-        Component* getEntityData(const std::size_t& index)
+        Component* getEntityData(const IndexType& index)
         {
             constexpr auto componentIndex = EC::Meta::IndexOf<
                 Component, Components>::value;
             if(componentIndex < Components::size)
             {
-                // Cast required due to compiler thinking that an invalid
-                // Component is needed even though the enclosing if statement
-                // prevents this from ever happening.
-                return (Component*) &std::get<componentIndex>(
-                    componentsStorage).at(index);
+                markColumnModified<Component>();
+                return EC::getUnitComponent<Component>(
+                    std::get<StorageIndex<Component>::value>(
+                        componentsStorage).at(index));
             }
             else
             {
@@ -274,7 +1107,7 @@ namespace EC
             will return a nullptr.
         */
         template <typename Component>
-        Component* getEntityComponent(const std::size_t& index)
+        Component* getEntityComponent(const IndexType& index)
         {
             return getEntityData<Component>(index);
         }
@@ -293,17 +1126,15 @@ namespace EC
             will return a nullptr.
         */
         template <typename Component>
-        const Component* getEntityData(const std::size_t& index) const
+        const Component* getEntityData(const IndexType& index) const
         {
             constexpr auto componentIndex = EC::Meta::IndexOf<
                 Component, Components>::value;
             if(componentIndex < Components::size)
             {
-                // Cast required due to compiler thinking that an invalid
-                // Component is needed even though the enclosing if statement
-                // prevents this from ever happening.
-                return (Component*) &std::get<componentIndex>(
-                    componentsStorage).at(index);
+                return EC::getUnitComponent<Component>(
+                    std::get<StorageIndex<Component>::value>(
+                        componentsStorage).at(index));
             }
             else
             {
@@ -327,7 +1158,7 @@ namespace EC
             will return a nullptr.
         */
         template <typename Component>
-        const Component* getEntityComponent(const std::size_t& index) const
+        const Component* getEntityComponent(const IndexType& index) const
         {
             return getEntityData<Component>(index);
         }
@@ -342,7 +1173,7 @@ namespace EC
             \endcode
         */
         template <typename Component>
-        bool hasComponent(const std::size_t& index) const
+        bool hasComponent(const IndexType& index) const
         {
             return std::get<BitsetType>(
                 entities.at(index)).template getComponentBit<Component>();
@@ -357,7 +1188,7 @@ namespace EC
             \endcode
         */
         template <typename Tag>
-        bool hasTag(const std::size_t& index) const
+        bool hasTag(const IndexType& index) const
         {
             return std::get<BitsetType>(
                 entities.at(index)).template getTagBit<Tag>();
@@ -393,7 +1224,7 @@ namespace EC
             \endcode
         */
         template <typename Component, typename... Args>
-        void addComponent(const std::size_t& entityID, Args&&... args)
+        void addComponent(const IndexType& entityID, Args&&... args)
         {
             if(!EC::Meta::Contains<Component, Components>::value
                 || !isAlive(entityID))
@@ -403,19 +1234,19 @@ namespace EC
 
             Component component(std::forward<Args>(args)...);
 
-            std::get<BitsetType>(
-                entities[entityID]
-            ).template getComponentBit<Component>() = true;
+            markColumnModified<Component>();
+            markEntitiesModified();
+            if(journal)
+            {
+                journalComponent(entityID, component,
+                    std::is_trivially_copyable<Component>{});
+            }
 
-            constexpr auto index =
-                EC::Meta::IndexOf<Component, Components>::value;
+            setEntityBit(entityID,
+                EC::Meta::IndexOf<Component, Combined>::value, true);
 
-            // Cast required due to compiler thinking that vector<char> at
-            // index = Components::size is being used, even if the previous
-            // if statement will prevent this from ever happening.
-            (*((std::vector<Component>*)(&std::get<index>(
-                componentsStorage
-            ))))[entityID] = std::move(component);
+            *getStoredComponent<Component>(componentsStorage, entityID) =
+                std::move(component);
         }
 
         /*!
@@ -430,7 +1261,7 @@ namespace EC
             \endcode
         */
         template <typename Component>
-        void removeComponent(const std::size_t& entityID)
+        void removeComponent(const IndexType& entityID)
         {
             if(!EC::Meta::Contains<Component, Components>::value
                 || !isAlive(entityID))
@@ -438,9 +1269,14 @@ namespace EC
                 return;
             }
 
-            std::get<BitsetType>(
-                entities[entityID]
-            ).template getComponentBit<Component>() = false;
+            markEntitiesModified();
+            if(journal)
+            {
+                journal->record(EC::JournalOp::RemoveComponent, entityID,
+                    EC::Meta::IndexOf<Component, Components>::value);
+            }
+            setEntityBit(entityID,
+                EC::Meta::IndexOf<Component, Combined>::value, false);
         }
 
         /*!
@@ -452,7 +1288,7 @@ namespace EC
             \endcode
         */
         template <typename Tag>
-        void addTag(const std::size_t& entityID)
+        void addTag(const IndexType& entityID)
         {
             if(!EC::Meta::Contains<Tag, Tags>::value
                 || !isAlive(entityID))
@@ -460,9 +1296,14 @@ namespace EC
                 return;
             }
 
-            std::get<BitsetType>(
-                entities[entityID]
-            ).template getTagBit<Tag>() = true;
+            markEntitiesModified();
+            if(journal)
+            {
+                journal->record(EC::JournalOp::AddTag, entityID,
+                    EC::Meta::IndexOf<Tag, Tags>::value);
+            }
+            setEntityBit(entityID,
+                EC::Meta::IndexOf<Tag, Combined>::value, true);
         }
 
     /*!
@@ -476,7 +1317,7 @@ namespace EC
         \endcode
     */
         template <typename Tag>
-        void removeTag(const std::size_t& entityID)
+        void removeTag(const IndexType& entityID)
         {
             if(!EC::Meta::Contains<Tag, Tags>::value
                 || !isAlive(entityID))
@@ -484,9 +1325,14 @@ namespace EC
                 return;
             }
 
-            std::get<BitsetType>(
-                entities[entityID]
-            ).template getTagBit<Tag>() = false;
+            markEntitiesModified();
+            if(journal)
+            {
+                journal->record(EC::JournalOp::RemoveTag, entityID,
+                    EC::Meta::IndexOf<Tag, Tags>::value);
+            }
+            setEntityBit(entityID,
+                EC::Meta::IndexOf<Tag, Combined>::value, false);
         }
 
     private:
@@ -495,7 +1341,7 @@ namespace EC
         {
             template <typename CType, typename Function>
             static void call(
-                const std::size_t& entityID,
+                const IndexType& entityID,
                 CType& ctype,
                 Function&& function,
                 void* context = nullptr)
@@ -503,13 +1349,13 @@ namespace EC
                 function(
                     entityID,
                     context,
-                    ctype.template getEntityData<Types>(entityID)...
+                    ctype.template getComponentData<Types>(entityID)...
                 );
             }
 
             template <typename CType, typename Function>
             static void callPtr(
-                const std::size_t& entityID,
+                const IndexType& entityID,
                 CType& ctype,
                 Function* function,
                 void* context = nullptr)
@@ -517,13 +1363,13 @@ namespace EC
                 (*function)(
                     entityID,
                     context,
-                    ctype.template getEntityData<Types>(entityID)...
+                    ctype.template getComponentData<Types>(entityID)...
                 );
             }
 
             template <typename CType, typename Function>
             void callInstance(
-                const std::size_t& entityID,
+                const IndexType& entityID,
                 CType& ctype,
                 Function&& function,
                 void* context = nullptr) const
@@ -537,7 +1383,7 @@ namespace EC
 
             template <typename CType, typename Function>
             void callInstancePtr(
-                const std::size_t& entityID,
+                const IndexType& entityID,
                 CType& ctype,
                 Function* function,
                 void* context = nullptr) const
@@ -550,6 +1396,103 @@ namespace EC
             }
         };
 
+        /*
+            Implement forMatchingSignature() and forMatchingSignaturePtr(),
+            with Self the Manager for queries that may modify Components, or
+            the const Manager for read-only queries, which get const
+            Component pointers and leave the columns unmodified.
+        */
+        template <typename Signature, typename Self, typename Function>
+        void forMatchingSignatureImpl(Function&& function, void* context,
+            std::size_t threadCount, std::size_t grainSize) const
+        {
+            // Self is const for read-only queries.
+            Self& self = const_cast<Self&>(*this);
+            if(threadCount == EC::AutoThreadCount)
+            {
+                BitsetType signatureBitset =
+                    BitsetType::template generateBitset<Signature>();
+                callWithAutoThreadCount(
+                    getCost(queryCosts, signatureBitset),
+                    planQuery(signatureBitset).matches,
+                    [this, &function, context, grainSize]
+                    (std::size_t threadCount) {
+                        this->template forMatchingSignatureImpl<
+                            Signature, Self>(
+                            std::forward<Function>(function), context,
+                            threadCount, grainSize);
+                    });
+                return;
+            }
+
+            using SignatureComponents =
+                typename EC::Meta::Matching<Signature, ComponentsList>::type;
+            using Helper =
+                EC::Meta::Morph<
+                    SignatureComponents,
+                    ForMatchingSignatureHelper<> >;
+
+            self.template markColumnsModified<SignatureComponents>();
+
+            BitsetType signatureBitset =
+                BitsetType::template generateBitset<Signature>();
+            journalQuery(signatureBitset, threadCount);
+            forEachRange(currentSize, threadCount,
+                [this, &self, &function, &signatureBitset, &context]
+                (std::size_t /* range */, std::size_t begin, std::size_t end)
+                {
+                    forEachMatchingEntity(signatureBitset, begin, end,
+                        [&self, &function, &context] (std::size_t i) {
+                            Helper::call(i, self,
+                                std::forward<Function>(function), context);
+                        });
+                }, grainSize);
+        }
+
+        template <typename Signature, typename Self, typename Function>
+        void forMatchingSignaturePtrImpl(Function* function, void* context,
+            std::size_t threadCount, std::size_t grainSize) const
+        {
+            // Self is const for read-only queries.
+            Self& self = const_cast<Self&>(*this);
+            if(threadCount == EC::AutoThreadCount)
+            {
+                BitsetType signatureBitset =
+                    BitsetType::template generateBitset<Signature>();
+                callWithAutoThreadCount(
+                    getCost(queryCosts, signatureBitset),
+                    planQuery(signatureBitset).matches,
+                    [this, &function, context, grainSize]
+                    (std::size_t threadCount) {
+                        this->template forMatchingSignaturePtrImpl<
+                            Signature, Self>(
+                            function, context, threadCount, grainSize);
+                    });
+                return;
+            }
+
+            using SignatureComponents =
+                typename EC::Meta::Matching<Signature, ComponentsList>::type;
+            using Helper =
+                EC::Meta::Morph<
+                    SignatureComponents,
+                    ForMatchingSignatureHelper<> >;
+
+            self.template markColumnsModified<SignatureComponents>();
+
+            BitsetType signatureBitset =
+                BitsetType::template generateBitset<Signature>();
+            journalQuery(signatureBitset, threadCount);
+            forEachRange(currentSize, threadCount,
+                [this, &self, &function, &signatureBitset, &context]
+                (std::size_t /* range */, std::size_t begin, std::size_t end)
+                {
+                    forEachMatchingEntity(signatureBitset, begin, end,
+                        [&self, &function, &context] (std::size_t i) {
+                            Helper::callPtr(i, self, function, context);
+                        });
+                }, grainSize);
+        }
     public:
         /*!
             \brief Calls the given function on all Entities matching the given
@@ -570,7 +1513,14 @@ namespace EC
             based on splitting the task of calling the function across sections
             of entities. Thus if there are only a small amount of entities in
             the manager, then using multiple threads may not have as great of a
-            speed-up.
+            speed-up. If threadCount is EC::AutoThreadCount, the number of
+            threads is chosen from the number of Entities that may match and
+            the time previous calls with the same Signature took per Entity
+            (see setAutoThreadLimit()).
+
+            Each thread handles at least grainSize Entity ids (the Manager's
+            grain size if 0, see setGrainSize()), so calls over few Entities
+            use fewer threads or run on the calling thread.
 
             Example:
             \code{.cpp}
@@ -592,80 +1542,35 @@ namespace EC
         template <typename Signature, typename Function>
         void forMatchingSignature(Function&& function,
             void* context = nullptr,
-            std::size_t threadCount = 1)
+            std::size_t threadCount = 1,
+            std::size_t grainSize = 0)
         {
-            using SignatureComponents =
-                typename EC::Meta::Matching<Signature, ComponentsList>::type;
-            using Helper =
-                EC::Meta::Morph<
-                    SignatureComponents,
-                    ForMatchingSignatureHelper<> >;
-
-            BitsetType signatureBitset =
-                BitsetType::template generateBitset<Signature>();
-            if(threadCount <= 1)
-            {
-                for(std::size_t i = 0; i < currentSize; ++i)
-                {
-                    if(!std::get<bool>(entities[i]))
-                    {
-                        continue;
-                    }
+            forMatchingSignatureImpl<Signature, Manager>(
+                std::forward<Function>(function), context, threadCount,
+                grainSize);
+        }
 
-                    if((signatureBitset & std::get<BitsetType>(entities[i]))
-                        == signatureBitset)
-                    {
-                        Helper::call(i, *this,
-                            std::forward<Function>(function), context);
-                    }
-                }
-            }
-            else
-            {
-                std::vector<std::thread> threads(threadCount);
-                std::size_t s = currentSize / threadCount;
-                for(std::size_t i = 0; i < threadCount; ++i)
-                {
-                    std::size_t begin = s * i;
-                    std::size_t end;
-                    if(i == threadCount - 1)
-                    {
-                        end = currentSize;
-                    }
-                    else
-                    {
-                        end = s * (i + 1);
-                    }
-                    threads[i] = std::thread(
-                        [this, &function, &signatureBitset, &context]
-                            (std::size_t begin,
-                            std::size_t end) {
-                        for(std::size_t i = begin; i < end; ++i)
-                        {
-                            if(!std::get<bool>(this->entities[i]))
-                            {
-                                continue;
-                            }
+        /*!
+            \brief Calls the given function on all Entities matching the given
+                Signature, with pointers to const Components.
 
-                            if((signatureBitset
-                                    & std::get<BitsetType>(entities[i]))
-                                == signatureBitset)
-                            {
-                                Helper::call(i, *this,
-                                    std::forward<Function>(function), context);
-                            }
-                        }
-                    },
-                        begin,
-                        end);
-                }
-                for(std::size_t i = 0; i < threadCount; ++i)
-                {
-                    threads[i].join();
-                }
-            }
+            Read-only version of forMatchingSignature(), which does not mark
+            columns as modified. Read-only forMatching functions may be called
+            concurrently with each other from multiple threads, but not
+            concurrently with functions that modify the Manager.
+        */
+        template <typename Signature, typename Function>
+        void forMatchingSignature(Function&& function,
+            void* context = nullptr,
+            std::size_t threadCount = 1,
+            std::size_t grainSize = 0) const
+        {
+            forMatchingSignatureImpl<Signature, const Manager>(
+                std::forward<Function>(function), context, threadCount,
+                grainSize);
         }
 
+
         /*!
             \brief Calls the given function on all Entities matching the given
                 Signature.
@@ -685,7 +1590,8 @@ namespace EC
             on splitting the task of calling the function across sections of
             entities. Thus if there are only a small amount of entities in the
             manager, then using multiple threads may not have as great of a
-            speed-up.
+            speed-up. Each thread handles at least grainSize Entity ids (the
+            Manager's grain size if 0, see setGrainSize()).
 
             Example:
             \code{.cpp}
@@ -709,928 +1615,2966 @@ namespace EC
         template <typename Signature, typename Function>
         void forMatchingSignaturePtr(Function* function,
             void* context = nullptr,
-            std::size_t threadCount = 1)
+            std::size_t threadCount = 1,
+            std::size_t grainSize = 0)
         {
-            using SignatureComponents =
-                typename EC::Meta::Matching<Signature, ComponentsList>::type;
-            using Helper =
-                EC::Meta::Morph<
-                    SignatureComponents,
-                    ForMatchingSignatureHelper<> >;
+            forMatchingSignaturePtrImpl<Signature, Manager>(
+                function, context, threadCount, grainSize);
+        }
 
-            BitsetType signatureBitset =
-                BitsetType::template generateBitset<Signature>();
-            if(threadCount <= 1)
-            {
-                for(std::size_t i = 0; i < currentSize; ++i)
-                {
-                    if(!std::get<bool>(entities[i]))
-                    {
-                        continue;
-                    }
+        /*!
+            \brief Calls the given function on all Entities matching the given
+                Signature, with pointers to const Components.
 
-                    if((signatureBitset & std::get<BitsetType>(entities[i]))
-                        == signatureBitset)
-                    {
-                        Helper::callPtr(i, *this, function, context);
-                    }
-                }
-            }
-            else
+            Read-only version of forMatchingSignaturePtr(), which does not mark
+            columns as modified. Read-only forMatching functions may be called
+            concurrently with each other from multiple threads, but not
+            concurrently with functions that modify the Manager.
+        */
+        template <typename Signature, typename Function>
+        void forMatchingSignaturePtr(Function* function,
+            void* context = nullptr,
+            std::size_t threadCount = 1,
+            std::size_t grainSize = 0) const
+        {
+            forMatchingSignaturePtrImpl<Signature, const Manager>(
+                function, context, threadCount, grainSize);
+        }
+
+        /*!
+            \brief Calls function(id) for each Entity matching a signature
+                given as a bitset of Components and Tags.
+
+            For signatures only known at run time, such as the queries of a
+            trace replayed by EC::replayTrace(). Entities are found by the
+            query planner and split across threads as with
+            forMatchingSignature(), and the columns of the signature's
+            Components are marked as modified.
+
+            \return The number of matching Entities.
+        */
+        template <typename Function>
+        std::size_t forMatchingBitset(const BitsetType& signature,
+            Function&& function, std::size_t threadCount = 1,
+            std::size_t grainSize = 0)
+        {
+            QueryPlan plan = planQuery(signature);
+            if(threadCount == EC::AutoThreadCount)
             {
-                std::vector<std::thread> threads(threadCount);
-                std::size_t s = currentSize / threadCount;
-                for(std::size_t i = 0; i < threadCount; ++i)
-                {
-                    std::size_t begin = s * i;
-                    std::size_t end;
-                    if(i == threadCount - 1)
-                    {
-                        end = currentSize;
-                    }
-                    else
-                    {
-                        end = s * (i + 1);
-                    }
-                    threads[i] = std::thread(
-                        [this, &function, &signatureBitset, &context]
-                            (std::size_t begin,
-                            std::size_t end) {
-                        for(std::size_t i = begin; i < end; ++i)
-                        {
-                            if(!std::get<bool>(this->entities[i]))
-                            {
-                                continue;
-                            }
+                std::size_t matched = 0;
+                callWithAutoThreadCount(getCost(queryCosts, signature),
+                    plan.matches,
+                    [this, &signature, &function, &matched, grainSize]
+                    (std::size_t threadCount) {
+                        matched = forMatchingBitset(signature,
+                            std::forward<Function>(function), threadCount,
+                            grainSize);
+                    });
+                return matched;
+            }
 
-                            if((signatureBitset
-                                    & std::get<BitsetType>(entities[i]))
-                                == signatureBitset)
-                            {
-                                Helper::callPtr(i, *this, function, context);
-                            }
-                        }
-                    },
-                        begin,
-                        end);
-                }
-                for(std::size_t i = 0; i < threadCount; ++i)
+            for(std::size_t i = 0; i < Components::size; ++i)
+            {
+                if(signature[i] && columnEpochs[i].get() != snapshotEpoch)
                 {
-                    threads[i].join();
+                    columnEpochs[i].set(snapshotEpoch);
                 }
             }
-        }
-
+            journalQuery(signature, threadCount);
 
+            std::vector<std::size_t> rangeMatched(
+                threadCount > 1 ? threadCount : 1);
+            forEachRange(currentSize, threadCount,
+                [this, &plan, &signature, &function, &rangeMatched]
+                (std::size_t range, std::size_t begin, std::size_t end)
+                {
+                    forEachMatchingEntity(plan, signature, begin, end,
+                        [&function, &rangeMatched, range] (std::size_t id) {
+                            function(id);
+                            ++rangeMatched[range];
+                        });
+                }, grainSize);
+            std::size_t matched = 0;
+            for(std::size_t count : rangeMatched)
+            {
+                matched += count;
+            }
+            return matched;
+        }
 
-    private:
-        std::unordered_map<std::size_t, std::tuple<
-            BitsetType,
-            void*,
-            std::function<void(
-                std::size_t,
-                std::vector<std::size_t>,
-                void*)> > >
-            forMatchingFunctions;
-        std::size_t functionIndex = 0;
 
-    public:
         /*!
-            \brief Stores a function in the manager to be called later.
-
-            As an alternative to calling functions directly with
-            forMatchingSignature(), functions can be stored in the manager to
-            be called later with callForMatchingFunctions() and
-            callForMatchingFunction, and removed with
-            clearForMatchingFunctions() and removeForMatchingFunction().
-
-            The syntax for the Function is the same as with
+            \brief Evaluates a column expression for all Entities matching the
+                given Signature and the Components used by the expression.
+
+            Column expressions replace functions for simple arithmetic
+            systems, written over fields of Components (see EC_FIELD() and
+            EC::field()).
+            Instead of calling a function per Entity, matching Entities are
+            collected into runs of consecutive ids, and the expression is
+            evaluated over each run of at least EC_EXPRESSION_MIN_RUN Entities
+            by a loop that the compiler vectorizes. Entities in shorter runs
+            are evaluated in blocks through their ids, gathering and
+            scattering the fields. Use EC::sequence() to evaluate several
+            assignments in one call.
+
+            The Signature may hold further Components and Tags used as
+            filters. Only the columns of assigned Components are marked as
+            modified for snapshots. If threadCount is greater than 1, the
+            Entities are split across threadCount threads as with
             forMatchingSignature().
 
-            Note that functions will be called in the same order they are
-            inserted if called by callForMatchingFunctions() unless the
-            internal functionIndex counter has wrapped around (is a
-            std::size_t). Calling clearForMatchingFunctions() will reset this
-            counter to zero.
-
-            Note that the context pointer provided here (default nullptr) will
-            be provided to the stored function when called.
-
             Example:
             \code{.cpp}
-                manager.addForMatchingFunction<TypeList<C0, C1, T0>>([]
-                    (std::size_t ID,
-                    void* context,
-                    C0* component0, C1* component1)
-                {
-                    // Lambda function contents here
-                });
+                auto x = EC_FIELD(&Position::x);
+                auto vx = EC_FIELD(&Velocity::x);
+                auto health = EC_FIELD(&Health::value);
+                manager.forMatchingExpression(x += vx * dt);
+                manager.forMatchingExpression<TypeList<Player>>(
+                    health = EC::clamp(health, 0.0f, 100.0f));
+            \endcode
+        */
+        template <typename Signature = EC::Meta::TypeList<>,
+            typename Assignment>
+        void forMatchingExpression(const Assignment& assignment,
+            std::size_t threadCount = 1)
+        {
+            static_assert(EC::Meta::ContainsAll<
+                typename Assignment::Components, ComponentsList>::value,
+                "An expression uses a Component unknown to the Manager");
 
-                // call all stored functions
-                manager.callForMatchingFunctions();
+            using FullSignature = EC::Meta::Combine<
+                Signature, typename Assignment::Components>;
+            BitsetType signatureBitset =
+                BitsetType::template generateBitset<FullSignature>();
+            if(threadCount == EC::AutoThreadCount)
+            {
+                callWithAutoThreadCount(
+                    getCost(expressionCosts, signatureBitset),
+                    planQuery(signatureBitset).matches,
+                    [this, &assignment] (std::size_t threadCount) {
+                        this->template forMatchingExpression<Signature>(
+                            assignment, threadCount);
+                    });
+                return;
+            }
 
-                // remove all stored functions
-                manager.clearForMatchingFunctions();
-            \endcode
+            markColumnsModified<typename Assignment::WrittenComponents>();
+            journalQuery(signatureBitset, threadCount);
+            ExpressionColumns columns;
+            EC::Meta::forEach<ComponentsList>([this, &columns] (auto t) {
+                using Component = decltype(t);
+                // Not getColumn(), which marks the column as modified.
+                auto& column = std::get<StorageIndex<Component>::value>(
+                    this->componentsStorage);
+                std::get<EC::Meta::IndexOf<Component, Components>::value>(
+                    columns).data = column.empty() ? nullptr
+                        : EC::getUnitComponent<Component>(column[0]);
+            });
+            QueryPlan plan = planQuery(signatureBitset);
+            forEachRange(currentSize, threadCount,
+                [this, &assignment, &columns, &plan]
+                (std::size_t /* range */, std::size_t begin, std::size_t end)
+                {
+                    evaluateExpression(assignment, columns, plan, begin, end);
+                });
+        }
 
-            \return The index of the function, used for deletion with
-                deleteForMatchingFunction() or filtering with
-                keepSomeMatchingFunctions() or removeSomeMatchingFunctions(),
-                or calling with callForMatchingFunction().
+    private:
+        /*
+            Evaluates an expression for the matching Entities in
+            [begin, end). Matches are found by intersecting the bit planes
+            word by word, whatever the plan's method, as the planes of a
+            deleted Entity are cleared and runs of matches are found without
+            reading the Entities. Words holding a run of at least
+            EC_EXPRESSION_MIN_RUN matches are split into runs, which are
+            evaluated as ranges, and the matches of other words are collected
+            into blocks of ids.
         */
-        template <typename Signature, typename Function>
-        std::size_t addForMatchingFunction(
-            Function&& function,
-            void* context = nullptr)
+        template <typename Assignment>
+        void evaluateExpression(const Assignment& assignment,
+            const ExpressionColumns& columns,
+            const QueryPlan& plan, std::size_t begin, std::size_t end)
         {
-            while(forMatchingFunctions.find(functionIndex)
-                != forMatchingFunctions.end())
+            if(plan.method == QueryPlan::Nothing || begin >= end)
             {
-                ++functionIndex;
+                return;
             }
 
-            using SignatureComponents =
-                typename EC::Meta::Matching<Signature, ComponentsList>::type;
-            using Helper =
-                EC::Meta::Morph<
-                    SignatureComponents,
-                    ForMatchingSignatureHelper<> >;
+            IndexType sparse[EC_EXPRESSION_BLOCK_SIZE];
+            std::size_t sparseCount = 0;
+            // The run of matches not yet evaluated.
+            std::size_t runBegin = 0;
+            std::size_t runEnd = 0;
 
-            Helper helper;
-            BitsetType signatureBitset =
-                BitsetType::template generateBitset<Signature>();
+            std::size_t firstWord = begin / 64;
+            std::size_t lastWord = (end - 1) / 64;
+            for(std::size_t word = firstWord; word <= lastWord; ++word)
+            {
+                std::uint64_t bits = bitPlanes.getWord(plan.planes[0], word);
+                for(std::size_t i = 1; i < plan.planeCount && bits != 0; ++i)
+                {
+                    bits &= bitPlanes.getWord(plan.planes[i], word);
+                }
+                if(word == firstWord)
+                {
+                    bits &= ~std::uint64_t(0) << (begin % 64);
+                }
+                if(word == lastWord && end % 64 != 0)
+                {
+                    bits &= (std::uint64_t(1) << (end % 64)) - 1;
+                }
 
-            forMatchingFunctions.emplace(std::make_pair(
-                functionIndex,
-                std::make_tuple(
-                    signatureBitset,
-                    context,
-                    [function, helper, this] 
-                        (std::size_t threadCount,
-                        std::vector<std::size_t> matching,
-                        void* context)
+                // Bit i of runStarts is set if bits i to i +
+                // EC_EXPRESSION_MIN_RUN - 1 are set.
+                std::uint64_t runStarts = bits;
+                for(std::size_t i = 1;
+                    i < EC_EXPRESSION_MIN_RUN && runStarts != 0; ++i)
+                {
+                    runStarts &= bits >> i;
+                }
+                if(runStarts == 0)
                 {
-                    if(threadCount <= 1)
+                    if(bits != 0
+                        && sparseCount + 64 > EC_EXPRESSION_BLOCK_SIZE)
                     {
-                        for(auto eid : matching)
-                        {
-                            if(isAlive(eid))
-                            {
-                                helper.callInstancePtr(
-                                    eid, *this, &function, context);
-                            }
-                        }
+                        EC::applyIndexed(
+                            assignment, columns, sparse, sparseCount);
+                        sparseCount = 0;
                     }
-                    else
+                    while(bits != 0)
                     {
-                        std::vector<std::thread> threads(threadCount);
-                        std::size_t s = matching.size() / threadCount;
-                        for(std::size_t i = 0; i < threadCount; ++ i)
-                        {
-                            std::size_t begin = s * i;
-                            std::size_t end;
-                            if(i == threadCount - 1)
-                            {
-                                end = matching.size();
-                            }
-                            else
-                            {
-                                end = s * (i + 1);
-                            }
-                            threads[i] = std::thread(
-                                [this, &function, &helper, &context]
-                                    (std::size_t begin,
-                                    std::size_t end) {
-                                for(std::size_t i = begin; i < end; ++i)
-                                {
-                                    if(isAlive(i))
-                                    {
-                                        helper.callInstancePtr(
-                                            i, *this, &function, context);
-                                    }
-                                }
-                            },
-                            begin, end);
-                        }
-                        for(std::size_t i = 0; i < threadCount; ++i)
+                        sparse[sparseCount++] = static_cast<IndexType>(
+                            word * 64 + countTrailingZeros(bits));
+                        bits &= bits - 1;
+                    }
+                    continue;
+                }
+
+                while(bits != 0)
+                {
+                    std::size_t offset = countTrailingZeros(bits);
+                    std::uint64_t rest = ~(bits >> offset);
+                    std::size_t length = rest == 0
+                        ? 64 - offset : countTrailingZeros(rest);
+                    std::size_t id = word * 64 + offset;
+                    if(id != runEnd)
+                    {
+                        if(runEnd - runBegin > 0)
                         {
-                            threads[i].join();
+                            EC::applyRange(
+                                assignment, columns, runBegin, runEnd);
                         }
+                        runBegin = id;
                     }
-                })));
-
-            return functionIndex++;
+                    runEnd = id + length;
+                    bits = offset + length == 64
+                        ? 0 : bits & (~std::uint64_t(0) << (offset + length));
+                }
+            }
+            if(runEnd - runBegin > 0)
+            {
+                EC::applyRange(assignment, columns, runBegin, runEnd);
+            }
+            if(sparseCount > 0)
+            {
+                EC::applyIndexed(assignment, columns, sparse, sparseCount);
+            }
         }
 
-    private:
-        std::vector<std::vector<std::size_t> > getMatchingEntities(
-            std::vector<BitsetType*> bitsets, std::size_t threadCount = 1)
+        static void prefetch(const void* address)
         {
-            std::vector<std::vector<std::size_t> > matchingV(bitsets.size());
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(address);
+#else
+            (void)address;
+#endif
+        }
 
-            if(threadCount <= 1)
+        template <typename... TargetTypes>
+        struct ForMatchingRelationTargets
+        {
+            template <typename... Types>
+            struct Helper
             {
-                for(std::size_t i = 0; i < currentSize; ++i)
+                template <typename CType>
+                static void prefetchTarget(
+                    const IndexType& targetID,
+                    CType& ctype)
                 {
-                    if(!isAlive(i))
-                    {
-                        continue;
-                    }
-                    for(std::size_t j = 0; j < bitsets.size(); ++j)
+                    prefetch(&ctype.entities[targetID]);
+                    (void)std::initializer_list<int>{(prefetch(
+                        ctype.template getComponentData<TargetTypes>(targetID)),
+                        0)...};
+                }
+
+                template <typename CType, typename Function>
+                static void call(
+                    const IndexType& sourceID,
+                    const IndexType& targetID,
+                    CType& ctype,
+                    Function&& function,
+                    void* context = nullptr)
+                {
+                    function(
+                        sourceID,
+                        targetID,
+                        context,
+                        ctype.template getComponentData<Types>(sourceID)...,
+                        ctype.template getComponentData<TargetTypes>(targetID)...
+                    );
+                }
+            };
+        };
+
+        /*
+            Implements forMatchingRelation(), with Self the Manager or the
+            const Manager as with forMatchingSignatureImpl().
+        */
+        template <typename SourceSignature, typename Ref,
+            typename TargetSignature, typename Self, typename Function>
+        void forMatchingRelationImpl(Function&& function, void* context,
+            std::size_t threadCount, bool sortByTarget) const
+        {
+            Self& self = const_cast<Self&>(*this);
+            static_assert(std::is_base_of<EntityRef, Ref>::value,
+                "Ref must derive from EC::BasicEntityRef<IndexType>");
+            static_assert(EC::Meta::Contains<Ref, Components>::value,
+                "Ref must be a Component known to the Manager");
+
+            using SourceComponents =
+                typename EC::Meta::Matching<
+                    SourceSignature, ComponentsList>::type;
+            using TargetComponents =
+                typename EC::Meta::Matching<
+                    TargetSignature, ComponentsList>::type;
+            using Targets =
+                EC::Meta::Morph<
+                    TargetComponents,
+                    ForMatchingRelationTargets<> >;
+            using Helper =
+                EC::Meta::Morph<
+                    SourceComponents,
+                    typename Targets::template Helper<> >;
+
+            self.template markColumnsModified<SourceComponents>();
+            self.template markColumnsModified<TargetComponents>();
+
+            BitsetType sourceBitset =
+                BitsetType::template generateBitset<SourceSignature>();
+            sourceBitset.template getComponentBit<Ref>() = true;
+            BitsetType targetBitset =
+                BitsetType::template generateBitset<TargetSignature>();
+
+            std::vector<std::pair<IndexType, IndexType> > pairs;
+            forEachMatchingEntity(sourceBitset, 0, currentSize,
+                [this, &pairs, &targetBitset] (std::size_t i) {
+                    IndexType target = static_cast<const EntityRef*>(
+                        this->template getComponentData<Ref>(i))->id;
+                    if(this->isAlive(target)
+                        && (targetBitset
+                            & std::get<BitsetType>(this->entities[target]))
+                            == targetBitset)
                     {
-                        if(((*bitsets[j]) & std::get<BitsetType>(entities[i]))
-                            == (*bitsets[j]))
-                        {
-                            matchingV[j].push_back(i);
-                        }
+                        pairs.emplace_back(i, target);
                     }
-                }
+                });
+            // Only the calls are measured, as pairs are collected serially.
+            EC::CostEstimate* estimate = nullptr;
+            if(threadCount == EC::AutoThreadCount)
+            {
+                estimate = &getCost(relationCosts, sourceBitset);
+                threadCount = chooseThreadCount(*estimate, pairs.size());
             }
-            else
+            journalQuery(sourceBitset, threadCount, pairs.size());
+            auto start = std::chrono::steady_clock::now();
+
+            if(sortByTarget)
             {
-                std::vector<std::thread> threads(threadCount);
-                std::size_t s = currentSize / threadCount;
-                std::mutex mutex;
-                for(std::size_t i = 0; i < threadCount; ++i)
+                std::stable_sort(pairs.begin(), pairs.end(),
+                    [] (const std::pair<IndexType, IndexType>& a,
+                        const std::pair<IndexType, IndexType>& b) {
+                        return a.second < b.second;
+                    });
+            }
+
+            auto callRange = [&self, &pairs, &function, &context]
+                (std::size_t /* range */, std::size_t begin, std::size_t end)
+            {
+                for(std::size_t i = begin;
+                    i < end && i < begin + EC_RELATION_PREFETCH_DISTANCE;
+                    ++i)
                 {
-                    std::size_t begin = s * i;
-                    std::size_t end;
-                    if(i == threadCount - 1)
-                    {
-                        end = currentSize;
-                    }
-                    else
-                    {
-                        end = s * (i + 1);
-                    }
-                    threads[i] = std::thread(
-                    [this, &matchingV, &bitsets, &mutex]
-                    (std::size_t begin, std::size_t end)
-                    {
-                        for(std::size_t j = begin; j < end; ++j)
-                        {
-                            if(!isAlive(j))
-                            {
-                                continue;
-                            }
-                            for(std::size_t k = 0; k < bitsets.size(); ++k)
-                            {
-                                if(((*bitsets[k]) &
-                                    std::get<BitsetType>(entities[j]))
-                                    == (*bitsets[k]))
-                                {
-                                    std::lock_guard<std::mutex> guard(mutex);
-                                    matchingV[k].push_back(j);
-                                }
-                            }
-                        }
-                    }, begin, end);
+                    Helper::prefetchTarget(pairs[i].second, self);
                 }
-                for(std::size_t i = 0; i < threadCount; ++i)
+                for(std::size_t i = begin; i < end; ++i)
                 {
-                    threads[i].join();
+                    if(i + EC_RELATION_PREFETCH_DISTANCE < end)
+                    {
+                        Helper::prefetchTarget(
+                            pairs[i + EC_RELATION_PREFETCH_DISTANCE].second,
+                            self);
+                    }
+                    Helper::call(pairs[i].first, pairs[i].second, self,
+                        std::forward<Function>(function), context);
                 }
-            }
+            };
 
-            return matchingV;
+            forEachRange(pairs.size(), threadCount, callRange);
+            if(estimate)
+            {
+                recordCost(*estimate, pairs.size(), threadCount, start);
+            }
         }
-
     public:
-
         /*!
-            \brief Call all stored functions.
-
-            The first (and only) parameter can be optionally used to specify the
-            number of threads to use when calling the functions. Otherwise, this
-            function is by default not multi-threaded.
-            Note that multi-threading is based on splitting the task of calling
-            the functions across sections of entities. Thus if there are only
-            a small amount of entities in the manager, then using multiple
-            threads may not have as great of a speed-up.
+            \brief Calls the given function on all pairs of Entities where the
+                source matches SourceSignature and refers, through its Ref
+                Component, to a living target matching TargetSignature.
+
+            Ref must be a Component deriving from EC::BasicEntityRef with the
+            Manager's IndexType (EC::EntityRef for std::size_t). Sources
+            that do not have Ref, or whose reference is invalid or points to a
+            deleted Entity, are skipped.
+
+            The function must accept the source's id, the target's id and
+            void* (context) as its first three parameters, followed by
+            pointers to the source's Components in SourceSignature and then
+            pointers to the target's Components in TargetSignature.
+
+            Matching pairs are collected first, then the function is called
+            on them while the rows of upcoming targets are prefetched. If
+            sortByTarget is true, pairs are called in order of target id
+            instead of source id, which improves locality of target accesses
+            when many sources refer to the same or nearby targets.
+
+            The third parameter is default 1 (not multi-threaded). If it is set
+            to a value greater than 1, then the pairs are split across
+            threadCount threads. Note that multiple sources may refer to the
+            same target, so writes to target Components from multiple threads
+            must be synchronized by the function.
 
             Example:
             \code{.cpp}
-                manager.addForMatchingFunction<TypeList<C0, C1, T0>>([]
-                    (std::size_t ID,
+                manager.forMatchingRelation<
+                    TypeList<C0>, Target, TypeList<C1, T0>>([]
+                    (std::size_t sourceID,
+                    std::size_t targetID,
                     void* context,
-                    C0* component0, C1* component1) {
+                    C0* sourceC0,
+                    C1* targetC1)
+                {
                     // Lambda function contents here
                 });
-
-                // call all stored functions
-                manager.callForMatchingFunctions();
-
-                // call all stored functions with 4 threads
-                manager.callForMatchingFunctions(4);
-
-                // remove all stored functions
-                manager.clearForMatchingFunctions();
             \endcode
         */
-        void callForMatchingFunctions(std::size_t threadCount = 1)
+        template <typename SourceSignature, typename Ref,
+            typename TargetSignature, typename Function>
+        void forMatchingRelation(Function&& function,
+            void* context = nullptr,
+            std::size_t threadCount = 1,
+            bool sortByTarget = false)
         {
-            std::vector<BitsetType*> bitsets;
-            for(auto iter = forMatchingFunctions.begin();
-                iter != forMatchingFunctions.end();
-                ++iter)
-            {
-                bitsets.push_back(&std::get<BitsetType>(iter->second));
-            }
+            forMatchingRelationImpl<SourceSignature, Ref, TargetSignature,
+                Manager>(std::forward<Function>(function), context,
+                    threadCount, sortByTarget);
+        }
 
-            std::vector<std::vector<std::size_t> > matching =
-                getMatchingEntities(bitsets, threadCount);
+        /*!
+            \brief Read-only version of forMatchingRelation(), which gives
+                the function pointers to const Components.
 
-            std::size_t i = 0;
-            for(auto iter = forMatchingFunctions.begin();
-                iter != forMatchingFunctions.end();
-                ++iter)
-            {
-                std::get<2>(iter->second)(
-                    threadCount, matching[i++], std::get<1>(iter->second));
-            }
+            Read-only forMatching functions may be called concurrently with
+            each other from multiple threads, but not concurrently with
+            functions that modify the Manager.
+        */
+        template <typename SourceSignature, typename Ref,
+            typename TargetSignature, typename Function>
+        void forMatchingRelation(Function&& function,
+            void* context = nullptr,
+            std::size_t threadCount = 1,
+            bool sortByTarget = false) const
+        {
+            forMatchingRelationImpl<SourceSignature, Ref, TargetSignature,
+                const Manager>(std::forward<Function>(function), context,
+                    threadCount, sortByTarget);
         }
 
         /*!
-            \brief Call a specific stored function.
-
-            A second parameter can be optionally used to specify the number
-            of threads to use when calling the function. Otherwise, this
-            function is by default not multi-threaded.
-            Note that multi-threading is based on splitting the task of calling
-            the function across sections of entities. Thus if there are only
-            a small amount of entities in the manager, then using multiple
-            threads may not have as great of a speed-up.
+            \brief Delivers the Messages of an inbox to the Component of their
+                targets, and clears the inbox.
 
-            Example:
-            \code{.cpp}
-                std::size_t id =
-                    manager.addForMatchingFunction<TypeList<C0, C1, T0>>(
-                        [] (std::size_t ID, void* context, C0* c0, C1* c1) {
-                    // Lambda function contents here
-                });
+            The function must accept the target's id, a pointer to its
+            Component and a reference to the Message. Messages are delivered
+            in order of target id, so that the column is walked forward once.
+            Messages to targets that are deleted or lack the Component are
+            dropped.
 
-                // call the previously added function
-                manager.callForMatchingFunction(id);
+            If threadCount is greater than 1, the Messages are split across
+            threadCount threads without splitting the Messages of a target,
+            so that the function can write to the Component without
+            synchronization.
 
-                // call the previously added function with 4 threads
-                manager.callForMatchingFunction(id, 4);
-            \endcode
+            See EC::Inbox for an example.
 
-            \return False if a function with the given id does not exist.
+            \return The number of delivered Messages.
         */
-        bool callForMatchingFunction(std::size_t id,
+        template <typename Component, typename Message, typename Function>
+        std::size_t deliverMessages(
+            EC::Inbox<Component, Message, IndexType>& inbox,
+            Function&& function,
             std::size_t threadCount = 1)
         {
-            auto iter = forMatchingFunctions.find(id);
-            if(iter == forMatchingFunctions.end())
-            {
-                return false;
-            }
-            std::vector<std::vector<std::size_t> > matching =
-                getMatchingEntities(std::vector<BitsetType*>{
-                    &std::get<BitsetType>(iter->second)}, threadCount);
-            std::get<2>(iter->second)(
-                threadCount, matching[0], std::get<1>(iter->second));
-            return true;
-        }
-
-        /*!
-            \brief Remove all stored functions.
-
-            Also resets the index counter of stored functions to 0.
-
-            Example:
-            \code{.cpp}
-                manager.addForMatchingFunction<TypeList<C0, C1, T0>>([]
-                    (std::size_t ID,
-                    void* context,
-                    C0* component0, C1* component1)
+            markColumnModified<Component>();
+            auto entries = inbox.getEntriesByTarget();
+            std::atomic<std::size_t> delivered(0);
+            forEachRange(entries.size(), threadCount,
+                [this, &entries, &function, &delivered]
+                (std::size_t /* range */, std::size_t begin, std::size_t end)
                 {
-                    // Lambda function contents here
+                    // Ranges start and end between targets.
+                    while(begin > 0 && begin < end
+                        && entries[begin]->target == entries[begin - 1]->target)
+                    {
+                        ++begin;
+                    }
+                    while(end > begin && end < entries.size()
+                        && entries[end]->target == entries[end - 1]->target)
+                    {
+                        ++end;
+                    }
+                    std::size_t count = 0;
+                    for(std::size_t i = begin; i < end; ++i)
+                    {
+                        IndexType target = entries[i]->target;
+                        if(this->isAlive(target)
+                            && std::get<BitsetType>(this->entities[target])
+                                .template getComponentBit<Component>())
+                        {
+                            function(target,
+                                this->template getComponentData<Component>(
+                                    target),
+                                entries[i]->message);
+                            ++count;
+                        }
+                    }
+                    delivered += count;
                 });
+            inbox.clear();
+            return delivered;
+        }
 
-                // call all stored functions
-                manager.callForMatchingFunctions();
+        /*!
+            \brief Schedules a call to the function passed to advanceTimers()
+                with the Entity's id, after the given number of ticks.
 
-                // remove all stored functions
-                manager.clearForMatchingFunctions();
-            \endcode
+            Scheduling costs O(1), and advanceTimers() only visits the
+            timers that expire, so this is cheaper than a Component counting
+            down that a function checks every tick. An Entity may have any
+            number of timers. Timers of a deleted Entity are dropped, even if
+            its id is reused.
+
+            Timers are not part of snapshots, and loading a snapshot or
+            calling reset() drops them.
         */
-        void clearForMatchingFunctions()
+        void scheduleExpiration(const IndexType& entityID,
+            std::uint64_t ticks)
         {
-            forMatchingFunctions.clear();
-            functionIndex = 0;
+            scheduleTimer(entityID, ticks, expireCall);
         }
 
         /*!
-            \brief Removes a function that has the given id.
+            \brief Schedules the deletion of an Entity after the given number
+                of ticks.
 
-            \return True if a function was erased.
+            See scheduleExpiration().
         */
-        bool removeForMatchingFunction(std::size_t id)
+        void scheduleDeletion(const IndexType& entityID, std::uint64_t ticks)
         {
-            return forMatchingFunctions.erase(id) == 1;
+            scheduleTimer(entityID, ticks, expireDelete);
         }
 
         /*!
-            \brief Removes all functions that do not have the index specified
-                in argument "list".
+            \brief Schedules adding the given Tag to an Entity after the given
+                number of ticks.
 
-            The given List must be iterable.
-            This is the only requirement, so a set could also be given.
+            See scheduleExpiration().
 
-            \return The number of functions deleted.
+            Example:
+            \code{.cpp}
+                // Stunned Entities recover after 30 ticks.
+                manager.scheduleTag<Recovered>(entityID, 30);
+            \endcode
         */
-        template <typename List>
-        std::size_t keepSomeMatchingFunctions(List list)
+        template <typename Tag>
+        void scheduleTag(const IndexType& entityID, std::uint64_t ticks)
         {
-            std::size_t deletedCount = 0;
-            for(auto iter = forMatchingFunctions.begin();
-                iter != forMatchingFunctions.end();)
+            if(EC::Meta::Contains<Tag, Tags>::value)
             {
-                if(std::find(list.begin(), list.end(), iter->first)
-                    == list.end())
-                {
-                    iter = forMatchingFunctions.erase(iter);
-                    ++deletedCount;
-                }
-                else
-                {
-                    ++iter;
-                }
+                scheduleTimer(entityID, ticks,
+                    EC::Meta::IndexOf<Tag, Tags>::value);
             }
+        }
 
-            return deletedCount;
+        /*!
+            \brief Drops all timers of an Entity.
+        */
+        void cancelTimers(const IndexType& entityID)
+        {
+            if(entityID < timerEpochs.size())
+            {
+                ++timerEpochs[entityID];
+            }
         }
 
         /*!
-            \brief Removes all functions that do not have the index specified
-                in argument "list".
+            \brief Advances the timers by the given number of ticks, applying
+                the expired timers in order of expiry.
 
-            This function allows for passing an initializer list.
+            The function must accept the id of an Entity whose timer
+            scheduled by scheduleExpiration() expired. It may schedule
+            timers and delete or modify Entities, but must not be a
+            forMatching function.
 
-            \return The number of functions deleted.
+            \return The number of applied timers, not counting the dropped
+                timers of deleted Entities.
         */
-        std::size_t keepSomeMatchingFunctions(
-            std::initializer_list<std::size_t> list)
+        template <typename Function>
+        std::size_t advanceTimers(std::uint64_t ticks, Function&& function)
         {
-            return keepSomeMatchingFunctions<decltype(list)>(list);
+            std::size_t applied = 0;
+            timers.advance(ticks,
+                [this, &function, &applied] (const TimerEntry& timer) {
+                    if(!this->isAlive(timer.entityID)
+                        || this->timerEpochs[timer.entityID] != timer.epoch)
+                    {
+                        return;
+                    }
+                    ++applied;
+                    if(timer.action == expireCall)
+                    {
+                        function(std::size_t(timer.entityID));
+                    }
+                    else if(timer.action == expireDelete)
+                    {
+                        this->deleteEntity(timer.entityID);
+                    }
+                    else
+                    {
+                        this->addTagIndex(timer.entityID, timer.action);
+                    }
+                });
+            return applied;
         }
 
         /*!
-            \brief Removes all functions that do have the index specified
-                in argument "list".
-
-            The given List must be iterable.
-            This is the only requirement, so a set could also be given.
+            \brief Advances the timers by the given number of ticks, for
+                Managers that only schedule deletions and Tags.
+        */
+        std::size_t advanceTimers(std::uint64_t ticks)
+        {
+            return advanceTimers(ticks, [] (std::size_t /* id */) {});
+        }
 
-            \return The number of functions deleted.
+        /*!
+            \brief Returns the number of ticks the timers were advanced.
         */
-        template <typename List>
-        std::size_t removeSomeMatchingFunctions(List list)
+        std::uint64_t getTimerTick() const
         {
-            std::size_t deletedCount = 0;
-            for(auto listIter = list.begin();
-                listIter != list.end();
-                ++listIter)
+            return timers.getTick();
+        }
+
+    private:
+        // The action of a timer is the index in Tags of the Tag to add, or
+        // one of these.
+        static constexpr std::size_t expireCall = Tags::size;
+        static constexpr std::size_t expireDelete = Tags::size + 1;
+
+        struct TimerEntry
+        {
+            IndexType entityID;
+            // The timer is dropped if the Entity's epoch changed since.
+            std::uint32_t epoch;
+            std::size_t action;
+        };
+
+        EC::TimingWheel<TimerEntry> timers;
+        // Per Entity id, incremented to drop the timers of the id.
+        std::vector<std::uint32_t> timerEpochs;
+
+        void scheduleTimer(const IndexType& entityID, std::uint64_t ticks,
+            std::size_t action)
+        {
+            if(!isAlive(entityID))
             {
-                deletedCount += forMatchingFunctions.erase(*listIter);
+                return;
             }
-
-            return deletedCount;
+            if(entityID >= timerEpochs.size())
+            {
+                timerEpochs.resize(currentCapacity, 0);
+            }
+            timers.schedule(ticks,
+                TimerEntry{entityID, timerEpochs[entityID], action});
         }
 
-        /*!
-            \brief Removes all functions that do have the index specified
-                in argument "list".
-
-            This function allows for passing an initializer list.
+        // addTag() with the index of the Tag in Tags.
+        void addTagIndex(const IndexType& entityID, std::size_t tag)
+        {
+            markEntitiesModified();
+            if(journal)
+            {
+                journal->record(EC::JournalOp::AddTag, entityID, tag);
+            }
+            setEntityBit(entityID, Components::size + tag, true);
+        }
 
-            \return The number of functions deleted.
+        /*
+            A stored function and the keys that determine when it is called
+            relative to the other stored functions.
         */
-        std::size_t removeSomeMatchingFunctions(
-            std::initializer_list<std::size_t> list)
+        struct StoredFunction
         {
-            return removeSomeMatchingFunctions<decltype(list)>(list);
-        }
+            std::size_t id;
+            int phase;
+            int priority;
+            std::size_t sequence;
+            BitsetType signature;
+            void* context;
+            // Called with the thread count and the grain size.
+            std::function<void(
+                std::size_t,
+                std::size_t,
+                const std::vector<IndexType>&,
+                void*)> function;
+            // Used with EC::AutoThreadCount.
+            EC::CostEstimate cost;
+            // 0 for the Manager's grain size.
+            std::size_t grainSize;
+        };
 
-        /*!
-            \brief Deletes the specified function.
+        // Kept sorted by (phase, priority, sequence) so that
+        // callForMatchingFunctions walks a contiguous array in a deterministic
+        // order, and the functions of a phase are contiguous.
+        std::vector<StoredFunction> forMatchingFunctions;
+        // Maps a stored function's id to its slot in forMatchingFunctions.
+        std::unordered_map<std::size_t, std::size_t> forMatchingFunctionSlots;
+        std::size_t functionIndex = 0;
+        std::size_t functionSequence = 0;
 
-            The index of a function is returned from addForMatchingFunction()
-                so there is no other way to get the index of a function.
+        static bool storedFunctionLess(
+            const StoredFunction& a, const StoredFunction& b)
+        {
+            if(a.phase != b.phase)
+            {
+                return a.phase < b.phase;
+            }
+            return a.priority < b.priority
+                || (a.priority == b.priority && a.sequence < b.sequence);
+        }
 
-            \return True if function existed and has been deleted.
-        */
-        bool deleteForMatchingFunction(std::size_t index)
+        void updateForMatchingFunctionSlots(std::size_t fromSlot = 0)
         {
-            return forMatchingFunctions.erase(index) == 1;
+            for(std::size_t i = fromSlot; i < forMatchingFunctions.size(); ++i)
+            {
+                forMatchingFunctionSlots[forMatchingFunctions[i].id] = i;
+            }
         }
 
-        /*!
-            \brief Sets the context pointer of a stored function
+        void insertForMatchingFunction(StoredFunction&& storedFunction)
+        {
+            auto iter = std::upper_bound(
+                forMatchingFunctions.begin(),
+                forMatchingFunctions.end(),
+                storedFunction,
+                storedFunctionLess);
+            std::size_t slot = iter - forMatchingFunctions.begin();
+            forMatchingFunctions.insert(iter, std::move(storedFunction));
+            updateForMatchingFunctionSlots(slot);
+        }
 
-            \return True if id is valid and context was updated
-        */
-        bool changeForMatchingFunctionContext(std::size_t id, void* context)
+        bool eraseForMatchingFunction(std::size_t id)
         {
-            auto f = forMatchingFunctions.find(id);
-            if(f != forMatchingFunctions.end())
+            auto slotIter = forMatchingFunctionSlots.find(id);
+            if(slotIter == forMatchingFunctionSlots.end())
             {
-                std::get<1>(f->second) = context;
-                return true;
+                return false;
             }
-            return false;
+            std::size_t slot = slotIter->second;
+            forMatchingFunctionSlots.erase(slotIter);
+            forMatchingFunctions.erase(forMatchingFunctions.begin() + slot);
+            updateForMatchingFunctionSlots(slot);
+            return true;
         }
 
+    public:
         /*!
-            \brief Call multiple functions with mulitple signatures on all
-                living entities.
+            \brief Stores a function in the manager to be called later.
 
-            (Living entities as in entities that have not been marked for
-            deletion.)
+            As an alternative to calling functions directly with
+            forMatchingSignature(), functions can be stored in the manager to
+            be called later with callForMatchingFunctions() and
+            callForMatchingFunction, and removed with
+            clearForMatchingFunctions() and removeForMatchingFunction().
 
-            This function requires the first template parameter to be a
-            EC::Meta::TypeList of signatures. Note that a signature is a
-            EC::Meta::TypeList of components and tags, meaning that SigList
-            is a TypeList of TypeLists.
+            The syntax for the Function is the same as with
+            forMatchingSignature().
 
-            The second template parameter can be inferred from the function
-            parameter which should be a tuple of functions. The function
-            at any index in the tuple should match with a signature of the
-            same index in the SigList. Behavior is undefined if there are
-            less functions than signatures.
+            Functions are called by callForMatchingFunctions() in order of
+            ascending phase (default 0), then ascending priority (default 0).
+            Functions with the same phase and priority are called in the order
+            they were inserted. This order does not depend on the returned ids
+            and is not affected by adding or removing other functions. See
+            callForMatchingFunctionPhases() for running the functions of a
+            phase concurrently.
 
-            See the Unit Test of this function in src/test/ECTest.cpp for
-            usage examples.
+            Note that the context pointer provided here (default nullptr) will
+            be provided to the stored function when called.
 
-            The second parameter (default nullptr) will be provided to every
-            function call as a void* (context).
+            Example:
+            \code{.cpp}
+                manager.addForMatchingFunction<TypeList<C0, C1, T0>>([]
+                    (std::size_t ID,
+                    void* context,
+                    C0* component0, C1* component1)
+                {
+                    // Lambda function contents here
+                });
 
-            This function was created for the use case where there are many
-            entities in the system which can cause multiple calls to
-            forMatchingSignature to be slow due to the overhead of iterating
-            through the entire list of entities on each invocation.
-            This function instead iterates through all entities once,
-            storing matching entities in a vector of vectors (for each
-            signature and function pair) and then calling functions with
-            the matching list of entities.
+                // called before the above function regardless of insertion
+                manager.addForMatchingFunction<TypeList<C0>>([]
+                    (std::size_t ID, void* context, C0* component0)
+                {
+                    // Lambda function contents here
+                }, nullptr, -1);
 
-            Note that multi-threaded or not, functions will be called in order
-            of signatures. The first function signature pair will be called
-            first, then the second, third, and so on.
-            If this function is called with more than 1 thread specified, then
-            the order of entities called is not guaranteed. Otherwise entities
-            will be called in consecutive order by their ID.
+                // call all stored functions
+                manager.callForMatchingFunctions();
+
+                // remove all stored functions
+                manager.clearForMatchingFunctions();
+            \endcode
+
+            \return The index of the function, used for deletion with
+                deleteForMatchingFunction() or filtering with
+                keepSomeMatchingFunctions() or removeSomeMatchingFunctions(),
+                or calling with callForMatchingFunction().
         */
-        template <typename SigList, typename FTuple>
-        void forMatchingSignatures(
-            FTuple fTuple,
+        template <typename Signature, typename Function>
+        std::size_t addForMatchingFunction(
+            Function&& function,
             void* context = nullptr,
-            const std::size_t threadCount = 1)
+            int priority = 0,
+            int phase = 0)
         {
-            std::vector<std::vector<std::size_t> > multiMatchingEntities(
-                SigList::size);
-            BitsetType signatureBitsets[SigList::size];
+            while(forMatchingFunctionSlots.find(functionIndex)
+                != forMatchingFunctionSlots.end())
+            {
+                ++functionIndex;
+            }
 
-            // generate bitsets for each signature
-            EC::Meta::forEachWithIndex<SigList>(
-            [&signatureBitsets] (auto signature, const auto index) {
-                signatureBitsets[index] =
-                    BitsetType::template generateBitset
-                        <decltype(signature)>();
-            });
+            using SignatureComponents =
+                typename EC::Meta::Matching<Signature, ComponentsList>::type;
+            using Helper =
+                EC::Meta::Morph<
+                    SignatureComponents,
+                    ForMatchingSignatureHelper<> >;
 
-            // find and store entities matching signatures
-            if(threadCount <= 1)
-            {
-                for(std::size_t eid = 0; eid < currentSize; ++eid)
+            Helper helper;
+            BitsetType signatureBitset =
+                BitsetType::template generateBitset<Signature>();
+
+            insertForMatchingFunction(StoredFunction{
+                functionIndex,
+                phase,
+                priority,
+                functionSequence++,
+                signatureBitset,
+                context,
+                [function, helper, this]
+                    (std::size_t threadCount, std::size_t grainSize,
+                    const std::vector<IndexType>& matching,
+                    void* context)
                 {
-                    if(!isAlive(eid))
-                    {
-                        continue;
-                    }
-                    for(std::size_t i = 0; i < SigList::size; ++i)
-                    {
-                        if((signatureBitsets[i]
-                            & std::get<BitsetType>(entities[eid]))
-                                == signatureBitsets[i])
+                    markColumnsModified<SignatureComponents>();
+                    forEachRange(matching.size(), threadCount,
+                        [this, &function, &helper, &context, &matching]
+                        (std::size_t /* range */,
+                            std::size_t begin, std::size_t end)
                         {
-                            multiMatchingEntities[i].push_back(eid);
-                        }
-                    }
-                }
-            }
-            else
-            {
-                std::vector<std::thread> threads(threadCount);
-                std::mutex mutexes[SigList::size];
-                std::size_t s = currentSize / threadCount;
-                for(std::size_t i = 0; i < threadCount; ++i)
-                {
-                    std::size_t begin = s * i;
-                    std::size_t end;
-                    if(i == threadCount - 1)
-                    {
-                        end = currentSize;
-                    }
-                    else
-                    {
-                        end = s * (i + 1);
-                    }
-                    threads[i] = std::thread(
-                    [this, &mutexes, &multiMatchingEntities, &signatureBitsets]
-                    (std::size_t begin, std::size_t end)
-                    {
-                        for(std::size_t j = begin; j < end; ++j)
-                        {
-                            if(!isAlive(j))
-                            {
-                                continue;
-                            }
-                            for(std::size_t k = 0; k < SigList::size; ++k)
+                            for(std::size_t i = begin; i < end; ++i)
                             {
-                                if((signatureBitsets[k]
-                                    & std::get<BitsetType>(entities[j]))
-                                        == signatureBitsets[k])
+                                if(isAlive(matching[i]))
                                 {
-                                    std::lock_guard<std::mutex> guard(
-                                        mutexes[k]);
-                                    multiMatchingEntities[k].push_back(j);
+                                    helper.callInstancePtr(
+                                        matching[i], *this, &function,
+                                        context);
                                 }
                             }
+                        }, grainSize);
+                },
+                EC::CostEstimate{},
+                0});
+
+            return functionIndex++;
+        }
+
+    private:
+        struct BitsetHash
+        {
+            std::size_t operator()(const BitsetType& bitset) const
+            {
+                return std::hash<std::bitset<Combined::size + 1> >()(bitset);
+            }
+        };
+
+        using CostMap =
+            std::unordered_map<BitsetType, EC::CostEstimate, BitsetHash>;
+
+        // Estimates used with EC::AutoThreadCount, by Signature.
+        mutable CostMap queryCosts;
+        mutable CostMap expressionCosts;
+        mutable CostMap relationCosts;
+        // Estimate of finding the Entities matching stored functions or
+        // several Signatures, per Entity of the Manager.
+        mutable EC::CostEstimate matchingCost;
+        // Guards the estimates, which read-only queries update too.
+        mutable CopyableMutex costsMutex;
+        std::size_t autoThreadLimit = std::max(
+            std::thread::hardware_concurrency(), 1u);
+        std::size_t grainSize = EC_DEFAULT_GRAIN_SIZE;
+
+        // The estimate of a Signature, which stays at the same address.
+        EC::CostEstimate& getCost(CostMap& costs,
+            const BitsetType& signature) const
+        {
+            std::lock_guard<std::mutex> guard(costsMutex.mutex);
+            return costs[signature];
+        }
+
+        std::size_t chooseThreadCount(const EC::CostEstimate& estimate,
+            std::size_t count) const
+        {
+            std::lock_guard<std::mutex> guard(costsMutex.mutex);
+            return estimate.chooseThreadCount(count, autoThreadLimit);
+        }
+
+        void recordCost(EC::CostEstimate& estimate, std::size_t count,
+            std::size_t threadCount,
+            std::chrono::steady_clock::time_point start) const
+        {
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            std::lock_guard<std::mutex> guard(costsMutex.mutex);
+            estimate.record(count, threadCount, seconds);
+        }
+
+        /*
+            Calls function(threadCount) with the number of threads that
+            estimate chooses for count Entities, and adds the time the call
+            took to estimate.
+        */
+        template <typename Function>
+        void callWithAutoThreadCount(EC::CostEstimate& estimate,
+            std::size_t count, Function&& function) const
+        {
+            std::size_t threadCount = chooseThreadCount(estimate, count);
+            auto start = std::chrono::steady_clock::now();
+            function(threadCount);
+            recordCost(estimate, count, threadCount, start);
+        }
+
+        /*
+            Calls a stored function on the given matching Entities, choosing
+            the number of threads if threadCount is EC::AutoThreadCount.
+        */
+        void callStoredFunction(StoredFunction& storedFunction,
+            const std::vector<IndexType>& matching, std::size_t threadCount)
+        {
+            auto call = [this, &storedFunction, &matching]
+                (std::size_t threadCount)
+            {
+                journalQuery(
+                    storedFunction.signature, threadCount, matching.size());
+                storedFunction.function(threadCount, storedFunction.grainSize,
+                    matching, storedFunction.context);
+            };
+            if(threadCount == EC::AutoThreadCount)
+            {
+                callWithAutoThreadCount(
+                    storedFunction.cost, matching.size(), call);
+            }
+            else
+            {
+                call(threadCount);
+            }
+        }
+
+        /*
+            Calls the stored functions in slots [begin, end) on the Entities
+            matching each, found in one pass. If concurrent, the functions
+            are called as tasks of the executor.
+        */
+        void callStoredFunctions(std::size_t begin, std::size_t end,
+            std::size_t threadCount, bool concurrent)
+        {
+            std::vector<BitsetType*> bitsets;
+            bitsets.reserve(end - begin);
+            for(std::size_t i = begin; i < end; ++i)
+            {
+                bitsets.push_back(&forMatchingFunctions[i].signature);
+            }
+
+            std::vector<std::size_t> listOf;
+            std::vector<std::vector<IndexType> > matching;
+            auto match = [this, &bitsets, &listOf, &matching]
+                (std::size_t threadCount)
+            {
+                matching = getMatchingEntities(bitsets, listOf, threadCount);
+            };
+            if(threadCount == EC::AutoThreadCount)
+            {
+                callWithAutoThreadCount(matchingCost, currentSize, match);
+            }
+            else
+            {
+                match(threadCount);
+            }
+
+            auto call = [this, begin, threadCount, &listOf, &matching]
+                (std::size_t i)
+            {
+                callStoredFunction(forMatchingFunctions[begin + i],
+                    matching[listOf[i]], threadCount);
+            };
+            if(concurrent && end - begin > 1)
+            {
+                getExecutor().parallelFor(end - begin, call);
+            }
+            else
+            {
+                for(std::size_t i = 0; i < end - begin; ++i)
+                {
+                    call(i);
+                }
+            }
+        }
+
+        // Returns the slot after the last stored function of phase or of an
+        // earlier phase.
+        std::size_t findPhaseEnd(int phase) const
+        {
+            return std::upper_bound(forMatchingFunctions.begin(),
+                forMatchingFunctions.end(), phase,
+                [] (int phase, const StoredFunction& storedFunction) {
+                    return phase < storedFunction.phase;
+                }) - forMatchingFunctions.begin();
+        }
+
+        /*
+            Appends the id of each alive Entity in [begin, end) to
+            matching[k] for every signature k it matches, in one pass.
+
+            A dispatch table maps each distinct Entity bitset (in practice,
+            each combination of Components and Tags in use) to the list of
+            signatures it satisfies. It is filled the first time a bitset is
+            seen, so each Entity costs one table lookup, or none if it has the
+            same bitset as the previous Entity, and only touches the lists it
+            belongs to, regardless of the number of signatures.
+        */
+        void dispatchMatchingEntities(const BitsetType* signatures,
+            std::size_t signatureCount, std::size_t begin, std::size_t end,
+            std::vector<std::vector<IndexType> >& matching) const
+        {
+            std::unordered_map<BitsetType, std::vector<std::size_t>,
+                BitsetHash> table;
+            const BitsetType* lastBitset = nullptr;
+            const std::vector<std::size_t>* lastMatches = nullptr;
+            for(std::size_t i = begin; i < end; ++i)
+            {
+                if(!std::get<bool>(entities[i]))
+                {
+                    continue;
+                }
+                const BitsetType& bitset = std::get<BitsetType>(entities[i]);
+                if(!lastBitset || bitset != *lastBitset)
+                {
+                    auto iter = table.find(bitset);
+                    if(iter == table.end())
+                    {
+                        std::vector<std::size_t> matches;
+                        for(std::size_t k = 0; k < signatureCount; ++k)
+                        {
+                            if((signatures[k] & bitset) == signatures[k])
+                            {
+                                matches.push_back(k);
+                            }
+                        }
+                        iter = table.emplace(bitset, std::move(matches)).first;
+                    }
+                    lastBitset = &bitset;
+                    lastMatches = &iter->second;
+                }
+                for(std::size_t k : *lastMatches)
+                {
+                    matching[k].push_back(i);
+                }
+            }
+        }
+
+        /*
+            Finds the Entities matching each of the given signatures with
+            dispatchMatchingEntities(), using up to threadCount threads that
+            each handle a range of ids. matching must hold signatureCount
+            lists, which are filled in ascending order of id.
+        */
+        void dispatchMatchingEntities(const BitsetType* signatures,
+            std::size_t signatureCount, std::size_t threadCount,
+            std::vector<std::vector<IndexType> >& matching) const
+        {
+            if(threadCount <= 1)
+            {
+                dispatchMatchingEntities(
+                    signatures, signatureCount, 0, currentSize, matching);
+                return;
+            }
+
+            std::vector<std::vector<std::vector<IndexType> > > rangeMatching(
+                threadCount,
+                std::vector<std::vector<IndexType> >(signatureCount));
+            forEachRange(currentSize, threadCount,
+                [this, signatures, signatureCount, &rangeMatching]
+                (std::size_t range, std::size_t begin, std::size_t end)
+                {
+                    dispatchMatchingEntities(signatures, signatureCount,
+                        begin, end, rangeMatching[range]);
+                });
+            for(std::size_t i = 0; i < threadCount; ++i)
+            {
+                for(std::size_t k = 0; k < signatureCount; ++k)
+                {
+                    matching[k].insert(matching[k].end(),
+                        rangeMatching[i][k].begin(),
+                        rangeMatching[i][k].end());
+                }
+            }
+        }
+
+        /*
+            Appends the ids of the Entities matching signature to matching in
+            ascending order, using up to threadCount threads.
+        */
+        void collectMatchingEntities(const BitsetType& signature,
+            const QueryPlan& plan, std::size_t threadCount,
+            std::vector<IndexType>& matching) const
+        {
+            if(threadCount <= 1)
+            {
+                forEachMatchingEntity(plan, signature, 0, currentSize,
+                    [&matching] (std::size_t id) {
+                        matching.push_back(id);
+                    });
+                return;
+            }
+
+            std::vector<std::vector<IndexType> > rangeMatching(threadCount);
+            forEachRange(currentSize, threadCount,
+                [this, &signature, &plan, &rangeMatching]
+                (std::size_t range, std::size_t begin, std::size_t end)
+                {
+                    forEachMatchingEntity(plan, signature, begin, end,
+                        [&rangeMatching, range] (std::size_t id) {
+                            rangeMatching[range].push_back(id);
+                        });
+                });
+            for(std::size_t i = 0; i < threadCount; ++i)
+            {
+                matching.insert(matching.end(),
+                    rangeMatching[i].begin(), rangeMatching[i].end());
+            }
+        }
+
+        /*
+            Finds the Entities matching each of the given signatures.
+
+            Identical signatures are matched once: the returned lists hold one
+            list per distinct signature and listOf[i] is the index of the list
+            of bitsets[i]. Signatures are matched in order of their number of
+            bits, forming a subset lattice: the list of a signature that is a
+            superset of an already matched signature is found by filtering
+            the smallest list of its subsets, unless the query planner
+            expects reading the bit planes to be cheaper. The signatures at
+            the bottom of the lattice that need a scan of all Entities are
+            matched together by a single dispatchMatchingEntities() pass.
+        */
+        std::vector<std::vector<IndexType> > getMatchingEntities(
+            const std::vector<BitsetType*>& bitsets,
+            std::vector<std::size_t>& listOf,
+            std::size_t threadCount = 1) const
+        {
+            std::vector<BitsetType> signatures;
+            listOf.resize(bitsets.size());
+            for(std::size_t i = 0; i < bitsets.size(); ++i)
+            {
+                auto iter = std::find(
+                    signatures.begin(), signatures.end(), *bitsets[i]);
+                listOf[i] = iter - signatures.begin();
+                if(iter == signatures.end())
+                {
+                    signatures.push_back(*bitsets[i]);
+                }
+            }
+
+            std::vector<std::size_t> order(signatures.size());
+            for(std::size_t i = 0; i < order.size(); ++i)
+            {
+                order[i] = i;
+            }
+            std::stable_sort(order.begin(), order.end(),
+                [&signatures] (std::size_t a, std::size_t b) {
+                    return signatures[a].count() < signatures[b].count();
+                });
+
+            // Signatures without a subset that the planner would scan for
+            // are matched together in one pass.
+            std::vector<std::vector<IndexType> > matching(signatures.size());
+            std::vector<QueryPlan> plans(signatures.size());
+            std::vector<BitsetType> scanned;
+            std::vector<std::size_t> scannedIndices;
+            for(std::size_t i = 0; i < order.size(); ++i)
+            {
+                const BitsetType& signature = signatures[order[i]];
+                plans[order[i]] = planQuery(signature);
+                bool hasSubset = false;
+                for(std::size_t j = 0; j < i && !hasSubset; ++j)
+                {
+                    const BitsetType& subset = signatures[order[j]];
+                    hasSubset = (subset & signature) == subset;
+                }
+                if(!hasSubset && plans[order[i]].method == QueryPlan::Scan)
+                {
+                    scanned.push_back(signature);
+                    scannedIndices.push_back(order[i]);
+                }
+            }
+            if(scanned.size() > 1)
+            {
+                std::vector<std::vector<IndexType> > scannedMatching(
+                    scanned.size());
+                dispatchMatchingEntities(scanned.data(), scanned.size(),
+                    threadCount, scannedMatching);
+                for(std::size_t i = 0; i < scanned.size(); ++i)
+                {
+                    matching[scannedIndices[i]] =
+                        std::move(scannedMatching[i]);
+                }
+            }
+            else
+            {
+                scannedIndices.clear();
+            }
+
+            for(std::size_t i = 0; i < order.size(); ++i)
+            {
+                if(std::find(scannedIndices.begin(), scannedIndices.end(),
+                    order[i]) != scannedIndices.end())
+                {
+                    continue;
+                }
+                const BitsetType& signature = signatures[order[i]];
+                std::vector<IndexType>* subsetMatching = nullptr;
+                for(std::size_t j = 0; j < i; ++j)
+                {
+                    const BitsetType& subset = signatures[order[j]];
+                    if((subset & signature) == subset
+                        && (!subsetMatching || matching[order[j]].size()
+                            < subsetMatching->size()))
+                    {
+                        subsetMatching = &matching[order[j]];
+                    }
+                }
+
+                const QueryPlan& plan = plans[order[i]];
+                std::vector<IndexType>& result = matching[order[i]];
+                if(subsetMatching && subsetMatching->size() < plan.cost)
+                {
+                    for(IndexType id : *subsetMatching)
+                    {
+                        if((signature & std::get<BitsetType>(entities[id]))
+                            == signature)
+                        {
+                            result.push_back(id);
                         }
-                    }, begin, end);
+                    }
+                }
+                else
+                {
+                    collectMatchingEntities(
+                        signature, plan, threadCount, result);
                 }
-                for(std::size_t i = 0; i < threadCount; ++i)
+            }
+
+            return matching;
+        }
+
+    public:
+
+        /*!
+            \brief Sets the executor that runs the parallel work of this
+                Manager, or EC::ThreadPool::getDefault() if nullptr (default).
+
+            A call with a threadCount greater than 1 is split into threadCount
+            tasks that are handed to the executor, so that the Manager can
+            share the threads of a job system (see EC::SubmitExecutor). The
+            executor must outlive its use by the Manager.
+        */
+        void setExecutor(EC::Executor* executor)
+        {
+            this->executor = executor;
+        }
+
+        /*!
+            \brief Returns the executor that runs the parallel work of this
+                Manager.
+        */
+        EC::Executor& getExecutor() const
+        {
+            return executor ? *executor : EC::ThreadPool::getDefault();
+        }
+
+        /*!
+            \brief Sets the maximum number of threads used when a forMatching
+                function or callForMatchingFunctions() is called with
+                EC::AutoThreadCount.
+
+            The default is std::thread::hardware_concurrency().
+        */
+        void setAutoThreadLimit(std::size_t limit)
+        {
+            autoThreadLimit = std::max(limit, std::size_t(1));
+        }
+
+        /*!
+            \brief Returns the maximum number of threads used with
+                EC::AutoThreadCount.
+        */
+        std::size_t getAutoThreadLimit() const
+        {
+            return autoThreadLimit;
+        }
+
+        /*!
+            \brief Sets the minimum number of Entities each thread of a
+                parallel call handles, unless the call or stored function
+                sets its own.
+
+            A call with threadCount threads over n Entities uses at most
+            n / grainSize threads, and runs on the calling thread if that is
+            less than 2. Entities are split evenly between the threads. The
+            default is EC_DEFAULT_GRAIN_SIZE.
+        */
+        void setGrainSize(std::size_t grainSize)
+        {
+            this->grainSize = std::max(grainSize, std::size_t(1));
+        }
+
+        /*!
+            \brief Returns the minimum number of Entities each thread of a
+                parallel call handles.
+        */
+        std::size_t getGrainSize() const
+        {
+            return grainSize;
+        }
+
+        /*!
+            \brief Call all stored functions.
+
+            The first (and only) parameter can be optionally used to specify the
+            number of threads to use when calling the functions. Otherwise, this
+            function is by default not multi-threaded.
+            Note that multi-threading is based on splitting the task of calling
+            the functions across sections of entities. Thus if there are only
+            a small amount of entities in the manager, then using multiple
+            threads may not have as great of a speed-up.
+
+            Stored functions are called one after another in order of
+            ascending phase and priority, and in insertion order for equal
+            phases and priorities.
+
+            If threadCount is EC::AutoThreadCount, the number of threads is
+            chosen separately for each stored function, from its number of
+            matching Entities and the time it took per Entity in previous
+            calls.
+
+            Example:
+            \code{.cpp}
+                manager.addForMatchingFunction<TypeList<C0, C1, T0>>([]
+                    (std::size_t ID,
+                    void* context,
+                    C0* component0, C1* component1) {
+                    // Lambda function contents here
+                });
+
+                // call all stored functions
+                manager.callForMatchingFunctions();
+
+                // call all stored functions with 4 threads
+                manager.callForMatchingFunctions(4);
+
+                // remove all stored functions
+                manager.clearForMatchingFunctions();
+            \endcode
+        */
+        void callForMatchingFunctions(std::size_t threadCount = 1)
+        {
+            callStoredFunctions(0, forMatchingFunctions.size(), threadCount,
+                false);
+        }
+
+        /*!
+            \brief Calls all stored functions phase by phase, with a barrier
+                between phases.
+
+            Phases run in ascending order. The functions of a phase run
+            concurrently with each other, each with threadCount threads, so
+            they must not write to Components that other functions of the
+            same phase read or write. With a threadCount of 1, they run one
+            after another in order of priority instead.
+
+            A phase starts once all functions of the previous phase have
+            returned, and sees their effects: between phases, the Entities
+            passed to markForDeletion() are deleted, then barrier(phase) is
+            called with the phase that finished. The barrier may deliver
+            inboxes, add Entities and so on, and the Entities matching the
+            next phase's functions are only found after it returns.
+
+            Example:
+            \code{.cpp}
+                manager.addForMatchingFunction<TypeList<C0>>(move, nullptr,
+                    0, 0);
+                manager.addForMatchingFunction<TypeList<C1>>(think, nullptr,
+                    0, 0);
+                manager.addForMatchingFunction<TypeList<C0, C1>>(render,
+                    nullptr, 0, 1);
+
+                // move and think run together, then render
+                manager.callForMatchingFunctionPhases(4,
+                    [&] (int phase) { manager.deliverMessages(inbox, apply); });
+            \endcode
+        */
+        template <typename Function>
+        void callForMatchingFunctionPhases(std::size_t threadCount,
+            Function&& barrier)
+        {
+            std::size_t begin = 0;
+            while(begin < forMatchingFunctions.size())
+            {
+                int phase = forMatchingFunctions[begin].phase;
+                std::size_t end = findPhaseEnd(phase);
+                callStoredFunctions(begin, end, threadCount,
+                    threadCount != 1);
+                flushDeletions();
+                barrier(phase);
+                // The barrier may have added or removed stored functions.
+                begin = findPhaseEnd(phase);
+            }
+        }
+
+        /*!
+            \brief Calls all stored functions phase by phase, deleting the
+                Entities passed to markForDeletion() between phases.
+
+            See callForMatchingFunctionPhases(threadCount, barrier).
+        */
+        void callForMatchingFunctionPhases(std::size_t threadCount = 1)
+        {
+            callForMatchingFunctionPhases(threadCount, [] (int /* phase */) {});
+        }
+
+        /*!
+            \brief Call a specific stored function.
+
+            A second parameter can be optionally used to specify the number
+            of threads to use when calling the function. Otherwise, this
+            function is by default not multi-threaded.
+            Note that multi-threading is based on splitting the task of calling
+            the function across sections of entities. Thus if there are only
+            a small amount of entities in the manager, then using multiple
+            threads may not have as great of a speed-up.
+
+            Example:
+            \code{.cpp}
+                std::size_t id =
+                    manager.addForMatchingFunction<TypeList<C0, C1, T0>>(
+                        [] (std::size_t ID, void* context, C0* c0, C1* c1) {
+                    // Lambda function contents here
+                });
+
+                // call the previously added function
+                manager.callForMatchingFunction(id);
+
+                // call the previously added function with 4 threads
+                manager.callForMatchingFunction(id, 4);
+            \endcode
+
+            \return False if a function with the given id does not exist.
+        */
+        bool callForMatchingFunction(std::size_t id,
+            std::size_t threadCount = 1)
+        {
+            auto iter = forMatchingFunctionSlots.find(id);
+            if(iter == forMatchingFunctionSlots.end())
+            {
+                return false;
+            }
+            StoredFunction& storedFunction = forMatchingFunctions[iter->second];
+            std::vector<IndexType> matching;
+            QueryPlan plan = planQuery(storedFunction.signature);
+            auto match = [this, &storedFunction, &plan, &matching]
+                (std::size_t threadCount)
+            {
+                collectMatchingEntities(
+                    storedFunction.signature, plan, threadCount, matching);
+            };
+            if(threadCount == EC::AutoThreadCount)
+            {
+                callWithAutoThreadCount(matchingCost, plan.cost, match);
+            }
+            else
+            {
+                match(threadCount);
+            }
+            callStoredFunction(storedFunction, matching, threadCount);
+            return true;
+        }
+
+        /*!
+            \brief Remove all stored functions.
+
+            Also resets the index counter of stored functions to 0.
+
+            Example:
+            \code{.cpp}
+                manager.addForMatchingFunction<TypeList<C0, C1, T0>>([]
+                    (std::size_t ID,
+                    void* context,
+                    C0* component0, C1* component1)
+                {
+                    // Lambda function contents here
+                });
+
+                // call all stored functions
+                manager.callForMatchingFunctions();
+
+                // remove all stored functions
+                manager.clearForMatchingFunctions();
+            \endcode
+        */
+        void clearForMatchingFunctions()
+        {
+            forMatchingFunctions.clear();
+            forMatchingFunctionSlots.clear();
+            functionIndex = 0;
+            functionSequence = 0;
+        }
+
+        /*!
+            \brief Removes a function that has the given id.
+
+            \return True if a function was erased.
+        */
+        bool removeForMatchingFunction(std::size_t id)
+        {
+            return eraseForMatchingFunction(id);
+        }
+
+        /*!
+            \brief Removes all functions that do not have the index specified
+                in argument "list".
+
+            The given List must be iterable.
+            This is the only requirement, so a set could also be given.
+
+            \return The number of functions deleted.
+        */
+        template <typename List>
+        std::size_t keepSomeMatchingFunctions(List list)
+        {
+            auto newEnd = std::remove_if(
+                forMatchingFunctions.begin(),
+                forMatchingFunctions.end(),
+                [&list] (const StoredFunction& storedFunction) {
+                    return std::find(list.begin(), list.end(),
+                        storedFunction.id) == list.end();
+                });
+            std::size_t deletedCount = forMatchingFunctions.end() - newEnd;
+            forMatchingFunctions.erase(newEnd, forMatchingFunctions.end());
+
+            forMatchingFunctionSlots.clear();
+            updateForMatchingFunctionSlots();
+
+            return deletedCount;
+        }
+
+        /*!
+            \brief Removes all functions that do not have the index specified
+                in argument "list".
+
+            This function allows for passing an initializer list.
+
+            \return The number of functions deleted.
+        */
+        std::size_t keepSomeMatchingFunctions(
+            std::initializer_list<std::size_t> list)
+        {
+            return keepSomeMatchingFunctions<decltype(list)>(list);
+        }
+
+        /*!
+            \brief Removes all functions that do have the index specified
+                in argument "list".
+
+            The given List must be iterable.
+            This is the only requirement, so a set could also be given.
+
+            \return The number of functions deleted.
+        */
+        template <typename List>
+        std::size_t removeSomeMatchingFunctions(List list)
+        {
+            std::size_t deletedCount = 0;
+            for(auto listIter = list.begin();
+                listIter != list.end();
+                ++listIter)
+            {
+                if(eraseForMatchingFunction(*listIter))
+                {
+                    ++deletedCount;
+                }
+            }
+
+            return deletedCount;
+        }
+
+        /*!
+            \brief Removes all functions that do have the index specified
+                in argument "list".
+
+            This function allows for passing an initializer list.
+
+            \return The number of functions deleted.
+        */
+        std::size_t removeSomeMatchingFunctions(
+            std::initializer_list<std::size_t> list)
+        {
+            return removeSomeMatchingFunctions<decltype(list)>(list);
+        }
+
+        /*!
+            \brief Deletes the specified function.
+
+            The index of a function is returned from addForMatchingFunction()
+                so there is no other way to get the index of a function.
+
+            \return True if function existed and has been deleted.
+        */
+        bool deleteForMatchingFunction(std::size_t index)
+        {
+            return eraseForMatchingFunction(index);
+        }
+
+        /*!
+            \brief Sets the context pointer of a stored function
+
+            \return True if id is valid and context was updated
+        */
+        bool changeForMatchingFunctionContext(std::size_t id, void* context)
+        {
+            auto f = forMatchingFunctionSlots.find(id);
+            if(f != forMatchingFunctionSlots.end())
+            {
+                forMatchingFunctions[f->second].context = context;
+                return true;
+            }
+            return false;
+        }
+
+        /*!
+            \brief Sets the priority of a stored function.
+
+            Stored functions are called by callForMatchingFunctions() in order
+            of ascending priority. Functions with equal priority keep the
+            order in which they were inserted.
+
+            \return True if id is valid and priority was updated
+        */
+        bool changeForMatchingFunctionPriority(std::size_t id, int priority)
+        {
+            auto f = forMatchingFunctionSlots.find(id);
+            if(f == forMatchingFunctionSlots.end())
+            {
+                return false;
+            }
+            StoredFunction storedFunction =
+                std::move(forMatchingFunctions[f->second]);
+            forMatchingFunctions.erase(
+                forMatchingFunctions.begin() + f->second);
+            storedFunction.priority = priority;
+            insertForMatchingFunction(std::move(storedFunction));
+            updateForMatchingFunctionSlots();
+            return true;
+        }
+
+        /*!
+            \brief Sets the minimum number of Entities each thread handles
+                when a stored function is called with multiple threads.
+
+            0 (the default) uses the Manager's grain size (see
+            setGrainSize()). Use a small grain size for functions that are
+            expensive per Entity, and a large one for cheap functions.
+
+            \return True if id is valid and the grain size was updated
+        */
+        bool changeForMatchingFunctionGrainSize(std::size_t id,
+            std::size_t grainSize)
+        {
+            auto f = forMatchingFunctionSlots.find(id);
+            if(f == forMatchingFunctionSlots.end())
+            {
+                return false;
+            }
+            forMatchingFunctions[f->second].grainSize = grainSize;
+            return true;
+        }
+
+        /*!
+            \brief Sets the phase of a stored function.
+
+            See callForMatchingFunctionPhases().
+
+            \return True if id is valid and phase was updated
+        */
+        bool changeForMatchingFunctionPhase(std::size_t id, int phase)
+        {
+            auto f = forMatchingFunctionSlots.find(id);
+            if(f == forMatchingFunctionSlots.end())
+            {
+                return false;
+            }
+            StoredFunction storedFunction =
+                std::move(forMatchingFunctions[f->second]);
+            forMatchingFunctions.erase(
+                forMatchingFunctions.begin() + f->second);
+            storedFunction.phase = phase;
+            insertForMatchingFunction(std::move(storedFunction));
+            updateForMatchingFunctionSlots();
+            return true;
+        }
+
+    private:
+        // Call the functions of forMatchingSignatures() and
+        // forMatchingSignaturesPtr() with the Helper of their Signature.
+        struct SignaturesCall
+        {
+            template <typename Helper, typename CType, typename Function>
+            void operator()(Helper, const IndexType& entityID, CType& ctype,
+                Function& function, void* context) const
+            {
+                Helper::call(entityID, ctype, function, context);
+            }
+        };
+
+        struct SignaturesCallPtr
+        {
+            template <typename Helper, typename CType, typename Function>
+            void operator()(Helper, const IndexType& entityID, CType& ctype,
+                Function* function, void* context) const
+            {
+                Helper::callPtr(entityID, ctype, function, context);
+            }
+        };
+
+        /*
+            Implement forMatchingSignatures() and forMatchingSignaturesPtr(),
+            with Self the Manager or the const Manager as with
+            forMatchingSignatureImpl(), and Invoker SignaturesCall or
+            SignaturesCallPtr.
+        */
+        template <typename SigList, typename Self, typename Invoker,
+            typename FTuple>
+        void forMatchingSignaturesImpl(FTuple fTuple, void* context,
+            std::size_t threadCount) const
+        {
+            Self& self = const_cast<Self&>(*this);
+            std::vector<std::vector<IndexType> > multiMatchingEntities(
+                SigList::size);
+            BitsetType signatureBitsets[SigList::size];
+
+            // generate bitsets for each signature
+            EC::Meta::forEachWithIndex<SigList>(
+            [&signatureBitsets] (auto signature, const auto index) {
+                signatureBitsets[index] =
+                    BitsetType::template generateBitset
+                        <decltype(signature)>();
+            });
+
+            // find and store entities matching signatures
+            auto match = [this, &signatureBitsets, &multiMatchingEntities]
+                (std::size_t threadCount)
+            {
+                dispatchMatchingEntities(signatureBitsets, SigList::size,
+                    threadCount, multiMatchingEntities);
+            };
+            if(threadCount == EC::AutoThreadCount)
+            {
+                callWithAutoThreadCount(matchingCost, currentSize, match);
+            }
+            else
+            {
+                match(threadCount);
+            }
+
+            // choose the number of threads of each signature
+            std::size_t threadCounts[SigList::size];
+            for(std::size_t i = 0; i < SigList::size; ++i)
+            {
+                threadCounts[i] = threadCount == EC::AutoThreadCount
+                    ? chooseThreadCount(
+                        getCost(queryCosts, signatureBitsets[i]),
+                        multiMatchingEntities[i].size())
+                    : threadCount;
+                journalQuery(signatureBitsets[i], threadCounts[i],
+                    multiMatchingEntities[i].size());
+            }
+
+            // call functions on matching entities
+            EC::Meta::forEachDoubleTuple(
+                EC::Meta::Morph<SigList, std::tuple<> >{},
+                fTuple,
+                [this, &self, &multiMatchingEntities, &signatureBitsets,
+                    &threadCount, &threadCounts, &context]
+                (auto sig, auto func, auto index)
+                {
+                    auto start = std::chrono::steady_clock::now();
+                    using SignatureComponents =
+                        typename EC::Meta::Matching<
+                            decltype(sig), ComponentsList>::type;
+                    using Helper =
+                        EC::Meta::Morph<
+                            SignatureComponents,
+                            ForMatchingSignatureHelper<> >;
+                    self.template markColumnsModified<SignatureComponents>();
+                    forEachRange(multiMatchingEntities[index].size(),
+                        threadCounts[index],
+                        [this, &self, &multiMatchingEntities, &index, &func,
+                            &context]
+                        (std::size_t /* range */,
+                            std::size_t begin, std::size_t end)
+                        {
+                            for(std::size_t j = begin; j < end; ++j)
+                            {
+                                if(isAlive(multiMatchingEntities[index][j]))
+                                {
+                                    Invoker{}(Helper{},
+                                        multiMatchingEntities[index][j],
+                                        self,
+                                        func,
+                                        context);
+                                }
+                            }
+                        });
+                    if(threadCount == EC::AutoThreadCount)
+                    {
+                        recordCost(getCost(queryCosts, signatureBitsets[index]),
+                            multiMatchingEntities[index].size(),
+                            threadCounts[index], start);
+                    }
+                }
+            );
+        }
+    public:
+        /*!
+            \brief Call multiple functions with mulitple signatures on all
+                living entities.
+
+            (Living entities as in entities that have not been marked for
+            deletion.)
+
+            This function requires the first template parameter to be a
+            EC::Meta::TypeList of signatures. Note that a signature is a
+            EC::Meta::TypeList of components and tags, meaning that SigList
+            is a TypeList of TypeLists.
+
+            The second template parameter can be inferred from the function
+            parameter which should be a tuple of functions. The function
+            at any index in the tuple should match with a signature of the
+            same index in the SigList. Behavior is undefined if there are
+            less functions than signatures.
+
+            See the Unit Test of this function in src/test/ECTest.cpp for
+            usage examples.
+
+            The second parameter (default nullptr) will be provided to every
+            function call as a void* (context).
+
+            This function was created for the use case where there are many
+            entities in the system which can cause multiple calls to
+            forMatchingSignature to be slow due to the overhead of iterating
+            through the entire list of entities on each invocation.
+            This function instead iterates through all entities once,
+            storing matching entities in a vector of vectors (for each
+            signature and function pair) and then calling functions with
+            the matching list of entities.
+
+            Note that multi-threaded or not, functions will be called in order
+            of signatures. The first function signature pair will be called
+            first, then the second, third, and so on.
+            If this function is called with more than 1 thread specified, then
+            the order of entities called is not guaranteed. Otherwise entities
+            will be called in consecutive order by their ID.
+        */
+        template <typename SigList, typename FTuple>
+        void forMatchingSignatures(
+            FTuple fTuple,
+            void* context = nullptr,
+            const std::size_t threadCount = 1)
+        {
+            forMatchingSignaturesImpl<SigList, Manager, SignaturesCall>(
+                fTuple, context, threadCount);
+        }
+
+        /*!
+            \brief Read-only version of forMatchingSignatures(), which gives
+                the functions pointers to const Components.
+
+            Read-only forMatching functions may be called concurrently with
+            each other from multiple threads, but not concurrently with
+            functions that modify the Manager.
+        */
+        template <typename SigList, typename FTuple>
+        void forMatchingSignatures(
+            FTuple fTuple,
+            void* context = nullptr,
+            const std::size_t threadCount = 1) const
+        {
+            forMatchingSignaturesImpl<SigList, const Manager, SignaturesCall>(
+                fTuple, context, threadCount);
+        }
+
+
+        /*!
+            \brief Call multiple functions with mulitple signatures on all
+                living entities.
+
+            (Living entities as in entities that have not been marked for
+            deletion.)
+
+            Note that this function requires the tuple of functions to hold
+            pointers to functions, not just functions.
+
+            This function requires the first template parameter to be a
+            EC::Meta::TypeList of signatures. Note that a signature is a
+            EC::Meta::TypeList of components and tags, meaning that SigList
+            is a TypeList of TypeLists.
+
+            The second template parameter can be inferred from the function
+            parameter which should be a tuple of functions. The function
+            at any index in the tuple should match with a signature of the
+            same index in the SigList. Behavior is undefined if there are
+            less functions than signatures.
+
+            See the Unit Test of this function in src/test/ECTest.cpp for
+            usage examples.
+
+            The second parameter (default nullptr) will be provided to every
+            function call as a void* (context).
+
+            This function was created for the use case where there are many
+            entities in the system which can cause multiple calls to
+            forMatchingSignature to be slow due to the overhead of iterating
+            through the entire list of entities on each invocation.
+            This function instead iterates through all entities once,
+            storing matching entities in a vector of vectors (for each
+            signature and function pair) and then calling functions with
+            the matching list of entities.
+
+            Note that multi-threaded or not, functions will be called in order
+            of signatures. The first function signature pair will be called
+            first, then the second, third, and so on.
+            If this function is called with more than 1 thread specified, then
+            the order of entities called is not guaranteed. Otherwise entities
+            will be called in consecutive order by their ID.
+        */
+        template <typename SigList, typename FTuple>
+        void forMatchingSignaturesPtr(FTuple fTuple,
+            void* context = nullptr,
+            std::size_t threadCount = 1)
+        {
+            forMatchingSignaturesImpl<SigList, Manager, SignaturesCallPtr>(
+                fTuple, context, threadCount);
+        }
+
+        /*!
+            \brief Read-only version of forMatchingSignaturesPtr(), which gives
+                the functions pointers to const Components.
+
+            Read-only forMatching functions may be called concurrently with
+            each other from multiple threads, but not concurrently with
+            functions that modify the Manager.
+        */
+        template <typename SigList, typename FTuple>
+        void forMatchingSignaturesPtr(FTuple fTuple,
+            void* context = nullptr,
+            std::size_t threadCount = 1) const
+        {
+            forMatchingSignaturesImpl<SigList, const Manager,
+                SignaturesCallPtr>(
+                fTuple, context, threadCount);
+        }
+
+
+    private:
+        // Words holding the bits of a BitsetType, used by snapshots.
+        using MaskWords = std::array<std::uint64_t, (Combined::size + 64) / 64>;
+
+        static MaskWords bitsetToWords(const BitsetType& bitset)
+        {
+            MaskWords words{};
+            for(std::size_t i = 0; i < Combined::size; ++i)
+            {
+                if(bitset[i])
+                {
+                    words[i / 64] |= std::uint64_t(1) << (i % 64);
+                }
+            }
+            return words;
+        }
+
+        static BitsetType wordsToBitset(const MaskWords& words)
+        {
+            BitsetType bitset;
+            for(std::size_t i = 0; i < Combined::size; ++i)
+            {
+                bitset[i] = (words[i / 64] >> (i % 64)) & 1;
+            }
+            return bitset;
+        }
+
+        void clearEntities()
+        {
+            for(std::size_t i = 0; i < currentSize; ++i)
+            {
+                entities[i] = std::make_tuple(false, BitsetType{});
+            }
+            currentSize = 0;
+            bitPlanes.clear();
+            std::fill(deletedBits.begin(), deletedBits.end(), 0);
+            deletedCount = 0;
+            deletedLowestWord = 0;
+            pendingDeletions.clear();
+            timers.clear();
+            timerEpochs.clear();
+        }
+
+        static constexpr unsigned char snapshotMagic[4] = {'E', 'C', 'S', '1'};
+
+        // Returns the first size Components of a column as an array, which
+        // is gathered into scratch if the Component is in a fusion group, so
+        // that snapshots hold one column per Component either way.
+        template <typename Component>
+        static const Component* getContiguousColumn(
+            const ComponentsStorage& storage, std::size_t size,
+            std::vector<Component>& scratch)
+        {
+            const auto& column =
+                std::get<StorageIndex<Component>::value>(storage);
+            if(std::is_same<StorageUnit<Component>, Component>::value)
+            {
+                return (const Component*) column.data();
+            }
+            scratch.resize(size);
+            for(std::size_t i = 0; i < size; ++i)
+            {
+                scratch[i] = *EC::getUnitComponent<Component>(column[i]);
+            }
+            return scratch.data();
+        }
+
+        static std::vector<unsigned char> encodeSnapshot(
+            std::size_t size,
+            const EntitiesType& entities,
+            const ComponentsStorage& storage,
+            std::size_t threadCount,
+            EC::Executor* executor)
+        {
+            EC::Codec::Buffer out(snapshotMagic, snapshotMagic + 4);
+            EC::Codec::writeVarint(out, Combined::size);
+            EC::Codec::writeVarint(out, Components::size);
+            EC::Meta::forEach<ComponentsList>([&out] (auto t) {
+                EC::Codec::writeVarint(out, sizeof(decltype(t)));
+            });
+            EC::Codec::writeVarint(out, size);
+
+            std::vector<std::uint64_t> alive(size);
+            std::vector<MaskWords> masks(size);
+            for(std::size_t i = 0; i < size; ++i)
+            {
+                alive[i] = std::get<bool>(entities[i]) ? 1 : 0;
+                masks[i] = bitsetToWords(std::get<BitsetType>(entities[i]));
+            }
+            EC::Codec::encodeColumn(alive.data(), size,
+                EC::Codec::ColumnEncoding::RunLength, out,
+                EC_SNAPSHOT_CHUNK_SIZE, threadCount, executor);
+            EC::Codec::encodeColumn(masks.data(), size,
+                EC::Codec::ColumnEncoding::RunLength, out,
+                EC_SNAPSHOT_CHUNK_SIZE, threadCount, executor);
+
+            EC::Meta::forEach<ComponentsList>(
+            [&storage, &out, size, threadCount, executor] (auto t) {
+                using Component = decltype(t);
+                std::vector<Component> gathered;
+                EC::Codec::encodeColumn(
+                    getContiguousColumn<Component>(storage, size, gathered),
+                    size,
+                    EC::Codec::ColumnEncodingOf<Component>::value, out,
+                    EC_SNAPSHOT_CHUNK_SIZE, threadCount, executor);
+            });
+
+            return out;
+        }
+
+        /*
+            A copy of the Manager's columns taken by saveSnapshotAsync().
+            A column is only copied again if it was modified since the
+            buffer last captured it.
+        */
+        struct SnapshotCapture
+        {
+            std::size_t size = 0;
+            EntitiesType entities;
+            ComponentsStorage storage;
+            std::size_t capturedEpochs[Components::size + 1] = {};
+            // Ready once the background encoding using this buffer is done.
+            std::shared_future<void> released;
+        };
+
+        struct AsyncSnapshotState
+        {
+            SnapshotCapture buffers[2];
+            std::size_t next = 0;
+
+            ~AsyncSnapshotState()
+            {
+                for(auto& buffer : buffers)
+                {
+                    if(buffer.released.valid())
+                    {
+                        buffer.released.wait();
+                    }
+                }
+            }
+        };
+
+        /*
+            Holds the capture buffers of this Manager. A copy of the Manager
+            starts without buffers, as buffers shared with the original would
+            hold the original's columns with epochs that look current.
+        */
+        struct AsyncSnapshotHandle
+        {
+            std::shared_ptr<AsyncSnapshotState> state;
+
+            AsyncSnapshotHandle() = default;
+
+            AsyncSnapshotHandle(const AsyncSnapshotHandle& /* other */)
+            {}
+
+            AsyncSnapshotHandle& operator=(const AsyncSnapshotHandle& other)
+            {
+                if(this != &other)
+                {
+                    state.reset();
+                }
+                return *this;
+            }
+        };
+
+        AsyncSnapshotHandle asyncSnapshot;
+
+        template <typename T>
+        static void captureColumn(std::vector<T>& to,
+            const std::vector<T>& from, std::size_t size)
+        {
+            if(to.size() < size)
+            {
+                to.resize(size);
+            }
+            std::copy(from.begin(), from.begin() + size, to.begin());
+        }
+
+    public:
+        /*!
+            \brief Returns a compressed snapshot of all Entities and their
+                Components.
+
+            Each column (alive flags, bitsets and one column per Component)
+            is encoded with EC::Codec. Alive flags and bitsets use run length
+            encoding and Components use the encoding selected by
+            EC::Codec::ColumnEncodingOf, which defaults to delta, zigzag and
+            bit packing for integers and xor compression for floating point
+            values. Columns are split into chunks of EC_SNAPSHOT_CHUNK_SIZE
+            Entities that are encoded by up to threadCount threads.
+
+            All Components must be trivially copyable. Snapshots can only be
+            loaded by a Manager with the same Components and Tags, built for
+            the same platform.
+        */
+        std::vector<unsigned char> saveSnapshot(
+            std::size_t threadCount = 1) const
+        {
+            return encodeSnapshot(currentSize, entities, componentsStorage,
+                threadCount, &getExecutor());
+        }
+
+        /*!
+            \brief Captures the current state of the Manager and encodes it
+                into a snapshot in the background.
+
+            The snapshot is encoded with the executor's runInBackground().
+            The returned future holds the same data saveSnapshot() would have
+            returned at the time of this call, and the Manager may be used
+            and modified as soon as this function returns.
+
+            The state is captured into one of two buffers that are reused
+            across calls. Only columns modified since the buffer's previous
+            capture are copied, so the time spent in this function is
+            proportional to the size of the modified columns rather than the
+            size of the world. A column counts as modified when a mutable
+            pointer to it was handed out (getEntityData(), getColumn(),
+            forMatching functions with the Component in their Signature) or
+            a Component was added. If both buffers are still being encoded,
+            this function waits for the older one to finish.
+
+            This function must not be called while other threads use the
+            Manager. All Components must be trivially copyable.
+
+            Example:
+            \code{.cpp}
+                auto future = manager.saveSnapshotAsync();
+                // keep running systems
+                std::vector<unsigned char> snapshot = future.get();
+            \endcode
+        */
+        std::future<std::vector<unsigned char> > saveSnapshotAsync(
+            std::size_t threadCount = 1)
+        {
+            if(!asyncSnapshot.state)
+            {
+                asyncSnapshot.state = std::make_shared<AsyncSnapshotState>();
+            }
+            SnapshotCapture& buffer =
+                asyncSnapshot.state->buffers[asyncSnapshot.state->next];
+            asyncSnapshot.state->next = 1 - asyncSnapshot.state->next;
+            if(buffer.released.valid())
+            {
+                buffer.released.wait();
+            }
+
+            std::size_t epoch = snapshotEpoch++;
+            if(buffer.capturedEpochs[Components::size]
+                    < columnEpochs[Components::size].get()
+                || buffer.size < currentSize)
+            {
+                captureColumn(buffer.entities, entities, currentSize);
+            }
+            buffer.capturedEpochs[Components::size] = epoch;
+            // The Components of a fusion group share a column, which is
+            // captured if any of them was modified.
+            EC::Meta::forEach<DeclaredComponents>(
+            [this, &buffer, epoch] (auto t) {
+                using Unit = decltype(t);
+                using UnitComponents =
+                    typename EC::Internal::UnitComponents<Unit>::type;
+                constexpr std::size_t unitIndex =
+                    EC::Meta::IndexOf<Unit, DeclaredComponents>::value;
+                bool modified = buffer.size < this->currentSize;
+                EC::Meta::forEach<UnitComponents>(
+                [this, &buffer, &modified] (auto c) {
+                    constexpr std::size_t index =
+                        EC::Meta::IndexOf<decltype(c), Components>::value;
+                    modified = modified || buffer.capturedEpochs[index]
+                        < this->columnEpochs[index].get();
+                });
+                if(modified)
+                {
+                    captureColumn(std::get<unitIndex>(buffer.storage),
+                        std::get<unitIndex>(this->componentsStorage),
+                        this->currentSize);
+                }
+                EC::Meta::forEach<UnitComponents>(
+                [&buffer, epoch] (auto c) {
+                    buffer.capturedEpochs[EC::Meta::IndexOf<
+                        decltype(c), Components>::value] = epoch;
+                });
+            });
+            buffer.size = currentSize;
+
+            auto released = std::make_shared<std::promise<void> >();
+            buffer.released = released->get_future().share();
+            std::shared_ptr<AsyncSnapshotState> state = asyncSnapshot.state;
+            EC::Executor* executor = &getExecutor();
+            auto task = std::make_shared<std::packaged_task<
+                std::vector<unsigned char>()> >(
+                [state, &buffer, released, threadCount, executor] ()
+            {
+                std::vector<unsigned char> out = encodeSnapshot(buffer.size,
+                    buffer.entities, buffer.storage, threadCount, executor);
+                released->set_value();
+                return out;
+            });
+            std::future<std::vector<unsigned char> > snapshot =
+                task->get_future();
+            executor->runInBackground([task] () { (*task)(); });
+            return snapshot;
+        }
+
+        /*!
+            \brief Replaces all Entities with the Entities in a snapshot
+                returned by saveSnapshot().
+
+            Stored functions are kept. Columns are decoded by up to
+            threadCount threads.
+
+            \return False if the snapshot is malformed or was saved by a
+                Manager with different Components or Tags, in which case the
+                Manager is left without Entities.
+        */
+        bool loadSnapshot(const std::vector<unsigned char>& snapshot,
+            std::size_t threadCount = 1)
+        {
+            const unsigned char* data = snapshot.data();
+            std::size_t size = snapshot.size();
+            std::size_t pos = 4;
+            clearEntities();
+            markAllModified();
+            if(journal)
+            {
+                journal->record(EC::JournalOp::Reset, 0);
+            }
+            if(size < 4 || !std::equal(snapshotMagic, snapshotMagic + 4, data))
+            {
+                return false;
+            }
+
+            std::uint64_t value;
+            bool valid = EC::Codec::readVarint(data, size, pos, value)
+                && value == Combined::size
+                && EC::Codec::readVarint(data, size, pos, value)
+                && value == Components::size;
+            EC::Meta::forEach<ComponentsList>(
+            [data, size, &pos, &value, &valid] (auto t) {
+                valid = valid && EC::Codec::readVarint(data, size, pos, value)
+                    && value == sizeof(decltype(t));
+            });
+            // Each of the 2 + Components::size columns holds at least one
+            // byte per chunk of EC_SNAPSHOT_CHUNK_SIZE Entities, which
+            // bounds the Entity count before anything is allocated from it.
+            std::uint64_t entityCount;
+            if(!valid || !EC::Codec::readVarint(data, size, pos, entityCount)
+                || entityCount > std::numeric_limits<IndexType>::max()
+                || entityCount / EC_SNAPSHOT_CHUNK_SIZE
+                    > (size - pos) / (2 + Components::size))
+            {
+                return false;
+            }
+
+            std::vector<std::uint64_t> alive(entityCount);
+            std::vector<MaskWords> masks(entityCount);
+            EC::Executor* executor = &getExecutor();
+            if(!EC::Codec::decodeColumn(data, size, pos, alive.data(),
+                    entityCount, threadCount, executor)
+                || !EC::Codec::decodeColumn(data, size, pos, masks.data(),
+                    entityCount, threadCount, executor))
+            {
+                return false;
+            }
+
+            if(currentCapacity < entityCount)
+            {
+                resize(entityCount);
+            }
+            EC::Meta::forEach<ComponentsList>(
+            [this, data, size, &pos, &valid, entityCount, threadCount,
+                executor]
+            (auto t) {
+                using Component = decltype(t);
+                auto column = this->template getColumn<Component>();
+                if(column.isContiguous())
+                {
+                    valid = valid && EC::Codec::decodeColumn(data, size, pos,
+                        column.data, entityCount, threadCount, executor);
+                    return;
+                }
+                // A Component of a fusion group.
+                std::vector<Component> decoded(entityCount);
+                valid = valid && EC::Codec::decodeColumn(data, size, pos,
+                    decoded.data(), entityCount, threadCount, executor);
+                for(std::size_t i = 0; valid && i < entityCount; ++i)
+                {
+                    column[i] = decoded[i];
+                }
+            });
+            if(!valid || pos != size)
+            {
+                return false;
+            }
+
+            for(std::size_t i = 0; i < entityCount; ++i)
+            {
+                std::get<bool>(entities[i]) = alive[i] != 0;
+                if(alive[i] != 0)
+                {
+                    setEntityBitset(i, wordsToBitset(masks[i]));
+                }
+            }
+            currentSize = entityCount;
+            for(std::size_t i = entityCount; i-- > 0;)
+            {
+                if(!std::get<bool>(entities[i]))
+                {
+                    std::get<BitsetType>(entities[i]).reset();
+                    if(i + 1 == currentSize)
+                    {
+                        --currentSize;
+                    }
+                    else
+                    {
+                        deletedBits[i / 64] |= std::uint64_t(1) << (i % 64);
+                        ++deletedCount;
+                    }
+                }
+            }
+            if(journal)
+            {
+                journalAll();
+            }
+            return true;
+        }
+
+        /*!
+            \brief Entities built outside of a Manager, to be merged into one
+                with commitStaging().
+
+            A StagingBuffer does not refer to any Manager, so it may be filled
+            on a background thread while the Manager is used elsewhere (one
+            thread per StagingBuffer). Entities in a StagingBuffer are
+            identified by their index in the buffer, starting at 0.
+
+            Example:
+            \code{.cpp}
+                ManagerType::StagingBuffer staging;
+                auto index = staging.addEntity();
+                staging.addComponent<C0>(index, 10, 'd');
+                staging.addTag<T0>(index);
+            \endcode
+        */
+        struct StagingBuffer
+        {
+        public:
+            /*!
+                \brief Adds an Entity to the buffer, returning its index in
+                    the buffer.
+            */
+            std::size_t addEntity()
+            {
+                EC::Meta::forEach<DeclaredComponents>([this] (auto t) {
+                    std::get<std::vector<decltype(t)> >(
+                        this->storage).emplace_back();
+                });
+                bitsets.emplace_back();
+                return bitsets.size() - 1;
+            }
+
+            /*!
+                \brief Reserves space for the given number of Entities.
+            */
+            void reserve(std::size_t count)
+            {
+                EC::Meta::forEach<DeclaredComponents>([this, count] (auto t) {
+                    std::get<std::vector<decltype(t)> >(
+                        this->storage).reserve(count);
+                });
+                bitsets.reserve(count);
+            }
+
+            /*!
+                \brief Adds a Component to the Entity at the given index of
+                    the buffer, constructed with the given arguments.
+            */
+            template <typename Component, typename... Args>
+            void addComponent(std::size_t index, Args&&... args)
+            {
+                static_assert(EC::Meta::Contains<Component, Components>::value,
+                    "Component is not known to the Manager");
+                *getStoredComponent<Component>(storage, index) =
+                    Component(std::forward<Args>(args)...);
+                bitsets[index].template getComponentBit<Component>() = true;
+            }
+
+            /*!
+                \brief Adds a Tag to the Entity at the given index of the
+                    buffer.
+            */
+            template <typename Tag>
+            void addTag(std::size_t index)
+            {
+                static_assert(EC::Meta::Contains<Tag, Tags>::value,
+                    "Tag is not known to the Manager");
+                bitsets[index].template getTagBit<Tag>() = true;
+            }
+
+            /*!
+                \brief Returns a pointer to a Component of the Entity at the
+                    given index of the buffer.
+            */
+            template <typename Component>
+            Component* getEntityData(std::size_t index)
+            {
+                return getStoredComponent<Component>(storage, index);
+            }
+
+            /*!
+                \brief Returns the number of Entities in the buffer.
+            */
+            std::size_t getSize() const
+            {
+                return bitsets.size();
+            }
+
+            /*!
+                \brief Returns the number of Entities of the buffer that were
+                    merged into a Manager so far.
+            */
+            std::size_t getCommittedSize() const
+            {
+                return ids.size();
+            }
+
+            /*!
+                \brief Returns the Manager ids given to merged Entities, in
+                    order of their index in the buffer.
+            */
+            const std::vector<IndexType>& getCommittedIds() const
+            {
+                return ids;
+            }
+
+            /*!
+                \brief Removes all Entities from the buffer.
+            */
+            void clear()
+            {
+                EC::Meta::forEach<DeclaredComponents>([this] (auto t) {
+                    std::get<std::vector<decltype(t)> >(this->storage).clear();
+                });
+                bitsets.clear();
+                ids.clear();
+            }
+
+        private:
+            friend struct Manager;
+
+            ComponentsStorage storage;
+            std::vector<BitsetType> bitsets;
+            std::vector<IndexType> ids;
+        };
+
+        /*!
+            \brief Moves up to maxEntities not yet merged Entities of a
+                StagingBuffer into the Manager, returning how many were
+                merged.
+
+            Ids of previously deleted Entities are reused first, then the
+            remaining Entities are appended with one bulk copy per column,
+            growing the storage at most once. The time spent is bounded by
+            maxEntities, so a large buffer can be merged over several calls
+            (the buffer keeps track of how far it was merged). The ids given
+            to merged Entities are available from
+            StagingBuffer::getCommittedIds().
+
+            Components are moved out of the buffer. Throws std::length_error,
+            merging nothing, if IndexType has too few unused ids left.
+        */
+        std::size_t commitStaging(StagingBuffer& staging,
+            std::size_t maxEntities = std::numeric_limits<std::size_t>::max())
+        {
+            std::size_t begin = staging.ids.size();
+            std::size_t end = begin
+                + std::min(staging.bitsets.size() - begin, maxEntities);
+            if(begin == end)
+            {
+                return 0;
+            }
+            if(end - begin > deletedCount)
+            {
+                checkNewEntities(end - begin - deletedCount);
+            }
+            markColumnsModified<ComponentsList>();
+            markEntitiesModified();
+
+            std::size_t i = begin;
+            for(; i < end && deletedCount > 0; ++i)
+            {
+                IndexType id = addEntity();
+                setEntityBitset(id, staging.bitsets[i]);
+                EC::Meta::forEach<DeclaredComponents>(
+                [this, &staging, i, id] (auto t) {
+                    using Unit = decltype(t);
+                    auto& column =
+                        std::get<std::vector<Unit> >(staging.storage);
+                    std::get<std::vector<Unit> >(
+                        this->componentsStorage)[id] = std::move(column[i]);
+                });
+                staging.ids.push_back(id);
+                if(journal)
                 {
-                    threads[i].join();
+                    journalEntityContents(id);
                 }
             }
-            
-            // call functions on matching entities
-            EC::Meta::forEachDoubleTuple(
-                EC::Meta::Morph<SigList, std::tuple<> >{},
-                fTuple,
-                [this, &multiMatchingEntities, &threadCount, &context]
-                (auto sig, auto func, auto index)
+
+            std::size_t count = end - i;
+            if(count == 0)
+            {
+                return end - begin;
+            }
+            if(currentSize + count > currentCapacity)
+            {
+                resize((currentSize + count + EC_GROW_SIZE_AMOUNT - 1)
+                    / EC_GROW_SIZE_AMOUNT * EC_GROW_SIZE_AMOUNT);
+            }
+            EC::Meta::forEach<DeclaredComponents>(
+            [this, &staging, i, end] (auto t) {
+                using Unit = decltype(t);
+                auto& column = std::get<std::vector<Unit> >(staging.storage);
+                std::move(column.begin() + i, column.begin() + end,
+                    std::get<std::vector<Unit> >(
+                        this->componentsStorage).begin() + this->currentSize);
+            });
+            for(; i < end; ++i)
+            {
+                std::get<bool>(entities[currentSize]) = true;
+                cancelTimers(currentSize);
+                setEntityBitset(currentSize, staging.bitsets[i]);
+                if(journal)
                 {
-                    using SignatureComponents =
-                        typename EC::Meta::Matching<
-                            decltype(sig), ComponentsList>::type;
-                    using Helper =
-                        EC::Meta::Morph<
-                            SignatureComponents,
-                            ForMatchingSignatureHelper<> >;
-                    if(threadCount <= 1)
-                    {
-                        for(const auto& id : multiMatchingEntities[index])
-                        {
-                            if(isAlive(id))
-                            {
-                                Helper::call(id, *this, func, context);
-                            }
-                        }
-                    }
-                    else
-                    {
-                        std::vector<std::thread> threads(threadCount);
-                        std::size_t s = multiMatchingEntities[index].size()
-                            / threadCount;
-                        for(std::size_t i = 0; i < threadCount; ++i)
-                        {
-                            std::size_t begin = s * i;
-                            std::size_t end;
-                            if(i == threadCount - 1)
-                            {
-                                end = multiMatchingEntities[index].size();
-                            }
-                            else
-                            {
-                                end = s * (i + 1);
-                            }
-                            threads[i] = std::thread(
-                            [this, &multiMatchingEntities, &index, &func,
-                                &context]
-                            (std::size_t begin, std::size_t end)
-                            {
-                                for(std::size_t j = begin; j < end;
-                                    ++j)
-                                {
-                                    if(isAlive(multiMatchingEntities[index][j]))
-                                    {
-                                        Helper::call(
-                                            multiMatchingEntities[index][j],
-                                            *this,
-                                            func,
-                                            context);
-                                    }
-                                }
-                            }, begin, end);
-                        }
-                        for(std::size_t i = 0; i < threadCount; ++i)
-                        {
-                            threads[i].join();
-                        }
-                    }
+                    journal->record(EC::JournalOp::AddEntity, currentSize);
+                    journalEntityContents(currentSize);
                 }
-            );
+                staging.ids.push_back(currentSize++);
+            }
+            return end - begin;
         }
 
         /*!
-            \brief Call multiple functions with mulitple signatures on all
-                living entities.
-
-            (Living entities as in entities that have not been marked for
-            deletion.)
+            \brief Attaches a Journal that records all structural operations
+                (addEntity, deleteEntity, addComponent, removeComponent,
+                addTag, removeTag, reset and the Entities added by
+                commitStaging() and loadSnapshot()).
+
+            Changes made through pointers to Components are not recorded;
+            combine the Journal with snapshots to also recover those. Pass
+            nullptr to detach the Journal. The Journal must outlive its use
+            by the Manager.
+
+            If the Manager has Entities, the Journal starts with a reset
+            followed by the current Entities, so that the log can always be
+            replayed into an empty Manager.
+        */
+        void setJournal(EC::Journal* journal)
+        {
+            this->journal = journal;
+            if(journal && currentSize > 0)
+            {
+                journal->record(EC::JournalOp::Reset, 0);
+                journalAll();
+            }
+        }
 
-            Note that this function requires the tuple of functions to hold
-            pointers to functions, not just functions.
+        /*!
+            \brief Returns the attached Journal, or nullptr if there is none.
+        */
+        EC::Journal* getJournal() const
+        {
+            return journal;
+        }
 
-            This function requires the first template parameter to be a
-            EC::Meta::TypeList of signatures. Note that a signature is a
-            EC::Meta::TypeList of components and tags, meaning that SigList
-            is a TypeList of TypeLists.
+    private:
+        struct JournalRecord
+        {
+            std::uint64_t sequence;
+            EC::JournalOp op;
+            std::uint64_t entityID;
+            std::uint64_t typeIndex;
+            const unsigned char* payload;
+            std::uint64_t payloadSize;
+        };
 
-            The second template parameter can be inferred from the function
-            parameter which should be a tuple of functions. The function
-            at any index in the tuple should match with a signature of the
-            same index in the SigList. Behavior is undefined if there are
-            less functions than signatures.
+        static bool readJournalRecord(const unsigned char* data,
+            std::size_t size, std::size_t& pos, JournalRecord& record)
+        {
+            if(!EC::Codec::readVarint(data, size, pos, record.sequence)
+                || pos >= size
+                || data[pos] > (unsigned char) EC::JournalOp::Query)
+            {
+                return false;
+            }
+            record.op = (EC::JournalOp) data[pos++];
+            record.typeIndex = 0;
+            record.payload = nullptr;
+            record.payloadSize = 0;
+            if(!EC::Codec::readVarint(data, size, pos, record.entityID))
+            {
+                return false;
+            }
+            if(EC::Journal::hasTypeIndex(record.op)
+                && !EC::Codec::readVarint(data, size, pos, record.typeIndex))
+            {
+                return false;
+            }
+            if(EC::Journal::hasPayload(record.op))
+            {
+                if(!EC::Codec::readVarint(data, size, pos, record.payloadSize)
+                    || record.payloadSize > size - pos)
+                {
+                    return false;
+                }
+                record.payload = data + pos;
+                pos += record.payloadSize;
+            }
+            return true;
+        }
 
-            See the Unit Test of this function in src/test/ECTest.cpp for
-            usage examples.
+        template <typename Component>
+        bool replayComponent(const JournalRecord& record)
+        {
+            return replayComponent<Component>(
+                record, std::is_trivially_copyable<Component>{});
+        }
 
-            The second parameter (default nullptr) will be provided to every
-            function call as a void* (context).
+        template <typename Component>
+        bool replayComponent(const JournalRecord& record,
+            std::true_type /* trivial */)
+        {
+            if(record.payloadSize != sizeof(Component))
+            {
+                return false;
+            }
+            Component component;
+            std::memcpy((void*) &component, record.payload, sizeof(Component));
+            addComponent<Component>(record.entityID, std::move(component));
+            return true;
+        }
 
-            This function was created for the use case where there are many
-            entities in the system which can cause multiple calls to
-            forMatchingSignature to be slow due to the overhead of iterating
-            through the entire list of entities on each invocation.
-            This function instead iterates through all entities once,
-            storing matching entities in a vector of vectors (for each
-            signature and function pair) and then calling functions with
-            the matching list of entities.
+        template <typename Component>
+        bool replayComponent(const JournalRecord& record,
+            std::false_type /* trivial */)
+        {
+            if(record.payloadSize != 0)
+            {
+                return false;
+            }
+            addComponent<Component>(record.entityID);
+            return true;
+        }
 
-            Note that multi-threaded or not, functions will be called in order
-            of signatures. The first function signature pair will be called
-            first, then the second, third, and so on.
-            If this function is called with more than 1 thread specified, then
-            the order of entities called is not guaranteed. Otherwise entities
-            will be called in consecutive order by their ID.
+        /*
+            Records a query in the attached Journal if it records queries.
+            If entityCount is not given, the matching Entities are counted.
         */
-        template <typename SigList, typename FTuple>
-        void forMatchingSignaturesPtr(FTuple fTuple,
-            void* context = nullptr,
-            std::size_t threadCount = 1)
+        void journalQuery(const BitsetType& signature,
+            std::size_t threadCount,
+            std::size_t entityCount = std::numeric_limits<std::size_t>::max())
+            const
         {
-            std::vector<std::vector<std::size_t> > multiMatchingEntities(
-                SigList::size);
-            BitsetType signatureBitsets[SigList::size];
+            if(!journal || !journal->isRecordingQueries())
+            {
+                return;
+            }
+            if(entityCount == std::numeric_limits<std::size_t>::max())
+            {
+                entityCount = 0;
+                forEachMatchingEntity(signature, 0, currentSize,
+                    [&entityCount] (std::size_t /* id */) {
+                        ++entityCount;
+                    });
+            }
+            MaskWords words = bitsetToWords(signature);
+            journal->record(EC::JournalOp::Query, entityCount, threadCount,
+                words.data(), sizeof(MaskWords));
+        }
 
-            // generate bitsets for each signature
-            EC::Meta::forEachWithIndex<SigList>(
-            [&signatureBitsets] (auto signature, const auto index) {
-                signatureBitsets[index] =
-                    BitsetType::template generateBitset
-                        <decltype(signature)>();
-            });
+        void journalAll()
+        {
+            for(std::size_t i = 0; i < currentSize; ++i)
+            {
+                journal->record(EC::JournalOp::AddEntity, i);
+            }
+            for(std::size_t i = 0; i < currentSize; ++i)
+            {
+                if(isDeleted(i))
+                {
+                    journal->record(EC::JournalOp::DeleteEntity, i);
+                }
+                else
+                {
+                    journalEntityContents(i);
+                }
+            }
+        }
 
-            // find and store entities matching signatures
-            if(threadCount <= 1)
+    public:
+        /*!
+            \brief Called by replayJournal() for each recorded query with the
+                Signature, thread count and number of matching Entities at the
+                time it was recorded.
+        */
+        using QueryFunction = std::function<void(const BitsetType& signature,
+            std::size_t threadCount, std::size_t entityCount)>;
+
+        /*!
+            \brief Applies the operations recorded in a Journal log to the
+                Manager.
+
+            Records are applied in the order they were made, even if batches
+            of different threads were flushed out of order. Replaying a log
+            into an empty Manager rebuilds the Entities (and their ids) of the
+            Manager that recorded it. The attached Journal, if any, does not
+            record the replayed operations.
+
+            Recorded queries are passed to onQuery (in order with the other
+            operations) if it is given, and skipped otherwise.
+
+            \return False if the log is malformed or does not match the
+                Manager (for example a recorded Entity id differs from the id
+                given by the replay), in which case the records before the
+                error are applied.
+        */
+        bool replayJournal(const std::vector<unsigned char>& log,
+            const QueryFunction& onQuery = QueryFunction())
+        {
+            const unsigned char* data = log.data();
+            std::size_t size = log.size();
+            std::size_t pos = 0;
+            std::vector<JournalRecord> records;
+            while(pos < size)
             {
-                for(std::size_t eid = 0; eid < currentSize; ++eid)
+                std::uint64_t batchSize;
+                if(!EC::Codec::readVarint(data, size, pos, batchSize)
+                    || batchSize > size - pos)
                 {
-                    if(!isAlive(eid))
-                    {
-                        continue;
-                    }
-                    for(std::size_t i = 0; i < SigList::size; ++i)
+                    return false;
+                }
+                std::size_t end = pos + batchSize;
+                while(pos < end)
+                {
+                    JournalRecord record;
+                    if(!readJournalRecord(data, end, pos, record))
                     {
-                        if((signatureBitsets[i]
-                            & std::get<BitsetType>(entities[eid]))
-                                == signatureBitsets[i])
-                        {
-                            multiMatchingEntities[i].push_back(eid);
-                        }
+                        return false;
                     }
+                    records.push_back(record);
                 }
             }
-            else
+
+            auto sequenceLess = [] (const JournalRecord& a,
+                const JournalRecord& b) {
+                return a.sequence < b.sequence;
+            };
+            if(!std::is_sorted(records.begin(), records.end(), sequenceLess))
+            {
+                std::stable_sort(
+                    records.begin(), records.end(), sequenceLess);
+            }
+
+            using ReplayComponentFunction =
+                bool (Manager::*)(const JournalRecord&);
+            ReplayComponentFunction replayComponents[Components::size + 1] =
+                {};
+            EC::Meta::forEach<ComponentsList>([&replayComponents] (auto t) {
+                using Component = decltype(t);
+                replayComponents[
+                    EC::Meta::IndexOf<Component, Components>::value] =
+                    &Manager::template replayComponent<Component>;
+            });
+
+            EC::Journal* attached = journal;
+            journal = nullptr;
+            bool valid = true;
+            for(const JournalRecord& record : records)
             {
-                std::vector<std::thread> threads(threadCount);
-                std::mutex mutexes[SigList::size];
-                std::size_t s = currentSize / threadCount;
-                for(std::size_t i = 0; i < threadCount; ++i)
+                if(record.op == EC::JournalOp::AddEntity)
                 {
-                    std::size_t begin = s * i;
-                    std::size_t end;
-                    if(i == threadCount - 1)
-                    {
-                        end = currentSize;
-                    }
-                    else
+                    valid = addEntity() == record.entityID;
+                }
+                else if(record.op == EC::JournalOp::Reset)
+                {
+                    clearEntities();
+                    markAllModified();
+                }
+                else if(record.op == EC::JournalOp::Query)
+                {
+                    valid = record.payloadSize == sizeof(MaskWords);
+                    if(valid && onQuery)
                     {
-                        end = s * (i + 1);
+                        MaskWords words;
+                        std::memcpy(words.data(), record.payload,
+                            sizeof(MaskWords));
+                        onQuery(wordsToBitset(words), record.typeIndex,
+                            record.entityID);
                     }
-                    threads[i] = std::thread(
-                    [this, &mutexes, &multiMatchingEntities, &signatureBitsets]
-                    (std::size_t begin, std::size_t end)
-                    {
-                        for(std::size_t j = begin; j < end; ++j)
-                        {
-                            if(!isAlive(j))
-                            {
-                                continue;
-                            }
-                            for(std::size_t k = 0; k < SigList::size; ++k)
-                            {
-                                if((signatureBitsets[k]
-                                    & std::get<BitsetType>(entities[j]))
-                                        == signatureBitsets[k])
-                                {
-                                    std::lock_guard<std::mutex> guard(
-                                        mutexes[k]);
-                                    multiMatchingEntities[k].push_back(j);
-                                }
-                            }
-                        }
-                    }, begin, end);
                 }
-                for(std::size_t i = 0; i < threadCount; ++i)
+                else if(!isAlive(record.entityID))
                 {
-                    threads[i].join();
+                    valid = false;
                 }
-            }
-            
-            // call functions on matching entities
-            EC::Meta::forEachDoubleTuple(
-                EC::Meta::Morph<SigList, std::tuple<> >{},
-                fTuple,
-                [this, &multiMatchingEntities, &threadCount, &context]
-                (auto sig, auto func, auto index)
+                else if(record.op == EC::JournalOp::DeleteEntity)
                 {
-                    using SignatureComponents =
-                        typename EC::Meta::Matching<
-                            decltype(sig), ComponentsList>::type;
-                    using Helper =
-                        EC::Meta::Morph<
-                            SignatureComponents,
-                            ForMatchingSignatureHelper<> >;
-                    if(threadCount <= 1)
+                    deleteEntity(record.entityID);
+                }
+                else if(record.op == EC::JournalOp::AddComponent
+                    || record.op == EC::JournalOp::RemoveComponent)
+                {
+                    valid = record.typeIndex < Components::size;
+                    if(valid && record.op == EC::JournalOp::AddComponent)
                     {
-                        for(const auto& id : multiMatchingEntities[index])
-                        {
-                            if(isAlive(id))
-                            {
-                                Helper::callPtr(id, *this, func, context);
-                            }
-                        }
+                        valid = (this->*replayComponents[record.typeIndex])(
+                            record);
                     }
-                    else
+                    else if(valid)
                     {
-                        std::vector<std::thread> threads(threadCount);
-                        std::size_t s = multiMatchingEntities[index].size()
-                            / threadCount;
-                        for(std::size_t i = 0; i < threadCount; ++i)
-                        {
-                            std::size_t begin = s * i;
-                            std::size_t end;
-                            if(i == threadCount - 1)
-                            {
-                                end = multiMatchingEntities[index].size();
-                            }
-                            else
-                            {
-                                end = s * (i + 1);
-                            }
-                            threads[i] = std::thread(
-                            [this, &multiMatchingEntities, &index, &func,
-                                &context]
-                            (std::size_t begin, std::size_t end)
-                            {
-                                for(std::size_t j = begin; j < end;
-                                    ++j)
-                                {
-                                    if(isAlive(multiMatchingEntities[index][j]))
-                                    {
-                                        Helper::callPtr(
-                                            multiMatchingEntities[index][j],
-                                            *this,
-                                            func,
-                                            context);
-                                    }
-                                }
-                            }, begin, end);
-                        }
-                        for(std::size_t i = 0; i < threadCount; ++i)
-                        {
-                            threads[i].join();
-                        }
+                        markEntitiesModified();
+                        setEntityBit(record.entityID, record.typeIndex, false);
                     }
                 }
-            );
+                else
+                {
+                    valid = record.typeIndex < Tags::size;
+                    if(valid)
+                    {
+                        markEntitiesModified();
+                        setEntityBit(record.entityID,
+                            Components::size + record.typeIndex,
+                            record.op == EC::JournalOp::AddTag);
+                    }
+                }
+
+                if(!valid)
+                {
+                    break;
+                }
+            }
+            journal = attached;
+            return valid;
         }
 
         /*!
@@ -1646,10 +4590,26 @@ namespace EC
 
             currentSize = 0;
             currentCapacity = 0;
-            deletedSet.clear();
+            bitPlanes = EC::BitPlanes(Combined::size);
+            deletedBits.clear();
+            deletedCount = 0;
+            deletedLowestWord = 0;
+            pendingDeletions.clear();
+            timers.clear();
+            timerEpochs.clear();
             resize(EC_INIT_ENTITIES_SIZE);
+            markAllModified();
+            if(journal)
+            {
+                journal->record(EC::JournalOp::Reset, 0);
+            }
         }
     };
+
+    template <typename DeclaredComponents, typename TagsList,
+        typename IndexType>
+    constexpr unsigned char
+        Manager<DeclaredComponents, TagsList, IndexType>::snapshotMagic[4];
 }
 
 #endif
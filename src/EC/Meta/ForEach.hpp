@@ -19,6 +19,8 @@ namespace EC
         constexpr void forEachHelper(
             Function&& function, TTuple tuple, std::index_sequence<Indices...>)
         {
+            // tuple is unused when the TypeList is empty
+            (void)tuple;
             return (void)std::initializer_list<int>{(function(std::move(
                 std::get<Indices>(tuple))), 0)...};
         }
@@ -0,0 +1,205 @@
+
+#ifndef EC_REGION_LOADER_HPP
+#define EC_REGION_LOADER_HPP
+
+#include <cstddef>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "Executor.hpp"
+
+namespace EC
+{
+    /*!
+        \brief Builds Entities of streamed world regions on background threads
+            and merges them into a Manager at a sync point.
+
+        Each call to load() runs the given decode function in the background
+        through an EC::Executor, which fills a StagingBuffer of the Manager
+        (for example by parsing a region file). The Manager is not touched until commit() is
+        called, usually once per tick, which merges decoded regions into the
+        Manager in the order they were requested, up to a budget of Entities
+        per call so that a large region does not cause a hitch.
+
+        ManagerType must be an EC::Manager type.
+
+        Example:
+        \code{.cpp}
+            EC::RegionLoader<ManagerType> loader;
+            loader.load(
+                [path] (ManagerType::StagingBuffer& staging) {
+                    return parseRegionFile(path, staging);
+                },
+                [] (std::size_t regionID, bool loaded,
+                    const std::vector<ManagerType::Index>& ids) {
+                    // fix up references between Entities of the region
+                });
+
+            // once per tick
+            loader.commit(manager, 2000);
+        \endcode
+    */
+    template <typename ManagerType>
+    class RegionLoader
+    {
+    public:
+        using StagingBuffer = typename ManagerType::StagingBuffer;
+        using Index = typename ManagerType::Index;
+        /*!
+            \brief Fills a StagingBuffer in the background, returning
+                false if the region could not be decoded.
+        */
+        using DecodeFunction = std::function<bool(StagingBuffer&)>;
+        /*!
+            \brief Called by commit() once all Entities of a region were
+                merged (or, with loaded set to false, once a region that could
+                not be decoded is discarded). ids holds the Manager id of each
+                Entity of the region in order of its index in the
+                StagingBuffer.
+        */
+        using CommittedFunction = std::function<void(
+            std::size_t regionID, bool loaded, const std::vector<Index>& ids)>;
+
+        /*!
+            \brief Creates a loader that decodes regions with
+                executor->runInBackground(), or with
+                EC::ThreadPool::getDefault() if executor is nullptr.
+        */
+        explicit RegionLoader(EC::Executor* executor = nullptr) :
+        executor(executor)
+        {}
+
+        RegionLoader(const RegionLoader&) = delete;
+        RegionLoader& operator=(const RegionLoader&) = delete;
+
+        /*!
+            \brief Waits for regions that are still being decoded.
+        */
+        ~RegionLoader()
+        {
+            wait();
+        }
+
+        /*!
+            \brief Starts decoding a region in the background, returning an id
+                for the region that is passed to the committed function.
+        */
+        std::size_t load(DecodeFunction decode,
+            CommittedFunction committed = CommittedFunction())
+        {
+            std::unique_ptr<Region> region = std::make_unique<Region>();
+            region->id = nextRegionID++;
+            region->committed = std::move(committed);
+            StagingBuffer* staging = &region->staging;
+            auto task = std::make_shared<std::packaged_task<bool()> >(
+                [decode = std::move(decode), staging] () {
+                    return decode(*staging);
+                });
+            region->decoded = task->get_future();
+            regions.push_back(std::move(region));
+            (executor ? *executor : EC::ThreadPool::getDefault())
+                .runInBackground([task] () { (*task)(); });
+            return regions.back()->id;
+        }
+
+        /*!
+            \brief Merges decoded regions into the Manager, returning the
+                number of Entities merged.
+
+            Regions are merged in the order they were requested. A region
+            that is still being decoded stops the merge, so that regions are
+            always merged in order. At most maxEntities Entities are merged
+            per call; a partially merged region is continued by the next
+            call, and its Entities already merged are alive in the Manager.
+
+            This function must be called on the thread using the Manager.
+        */
+        std::size_t commit(ManagerType& manager,
+            std::size_t maxEntities = std::numeric_limits<std::size_t>::max())
+        {
+            std::size_t merged = 0;
+            std::size_t done = 0;
+            for(; done < regions.size(); ++done)
+            {
+                Region& region = *regions[done];
+                if(!region.loaded)
+                {
+                    if(region.decoded.wait_for(std::chrono::seconds(0))
+                        != std::future_status::ready)
+                    {
+                        break;
+                    }
+                    if(!region.decoded.get())
+                    {
+                        if(region.committed)
+                        {
+                            region.committed(
+                                region.id, false, std::vector<Index>());
+                        }
+                        continue;
+                    }
+                    region.loaded = true;
+                }
+
+                merged += manager.commitStaging(
+                    region.staging, maxEntities - merged);
+                if(region.staging.getCommittedSize()
+                    != region.staging.getSize())
+                {
+                    break;
+                }
+                if(region.committed)
+                {
+                    region.committed(region.id, true,
+                        region.staging.getCommittedIds());
+                }
+            }
+            regions.erase(regions.begin(), regions.begin() + done);
+            return merged;
+        }
+
+        /*!
+            \brief Returns the number of regions not yet fully merged.
+        */
+        std::size_t getPendingCount() const
+        {
+            return regions.size();
+        }
+
+        /*!
+            \brief Waits until all requested regions are decoded.
+        */
+        void wait()
+        {
+            for(auto& region : regions)
+            {
+                if(region->decoded.valid())
+                {
+                    region->decoded.wait();
+                }
+            }
+        }
+
+    private:
+        struct Region
+        {
+            std::size_t id = 0;
+            StagingBuffer staging;
+            std::future<bool> decoded;
+            bool loaded = false;
+            CommittedFunction committed;
+        };
+
+        // Held by pointer so that the StagingBuffer of a region does not move
+        // while it is being decoded.
+        std::vector<std::unique_ptr<Region> > regions;
+        std::size_t nextRegionID = 0;
+        EC::Executor* executor = nullptr;
+    };
+}
+
+#endif
@@ -0,0 +1,487 @@
+
+#ifndef EC_SHARED_WORLD_HPP
+#define EC_SHARED_WORLD_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <new>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Meta/ForEachWithIndex.hpp"
+#include "Meta/IndexOf.hpp"
+#include "ColumnView.hpp"
+
+#define EC_SHARED_WORLD_MAGIC 0x45435348574c4431ULL
+#define EC_SHARED_WORLD_ALIGNMENT 64
+
+namespace EC
+{
+    /*
+        Start of a shared world segment. It is followed by the element size
+        and the offset of each column, then by the columns themselves.
+        Column 0 holds the alive flags, column 1 holds the bitsets and the
+        remaining columns hold the Components in order of the Manager's
+        Components list.
+    */
+    struct SharedWorldHeader
+    {
+        std::uint64_t magic;
+        std::uint64_t columnCount;
+        std::uint64_t capacity;
+        std::uint64_t totalBytes;
+        // Odd while the writer is publishing, incremented by two per publish.
+        std::atomic<std::uint64_t> sequence;
+        std::uint64_t size;
+    };
+
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+        "SharedWorld requires lock free 64 bit atomics");
+
+    template <typename ManagerType>
+    struct SharedWorldLayout
+    {
+        using Components = typename ManagerType::Components;
+        using BitsetType = typename ManagerType::BitsetType;
+
+        static constexpr std::size_t columnCount = Components::size + 2;
+
+        static_assert(std::is_trivially_copyable<BitsetType>::value,
+            "SharedWorld requires a trivially copyable bitset");
+
+        static std::size_t align(std::size_t offset)
+        {
+            return (offset + EC_SHARED_WORLD_ALIGNMENT - 1)
+                / EC_SHARED_WORLD_ALIGNMENT * EC_SHARED_WORLD_ALIGNMENT;
+        }
+
+        static void getElementSizes(std::uint64_t* sizes)
+        {
+            sizes[0] = sizeof(unsigned char);
+            sizes[1] = sizeof(BitsetType);
+            EC::Meta::forEachWithIndex<Components>(
+            [sizes] (auto component, auto index) {
+                static_assert(
+                    std::is_trivially_copyable<decltype(component)>::value,
+                    "SharedWorld requires trivially copyable Components");
+                sizes[index + 2] = sizeof(decltype(component));
+            });
+        }
+
+        static std::uint64_t* getElementSizes(SharedWorldHeader* header)
+        {
+            return (std::uint64_t*)(header + 1);
+        }
+
+        static std::uint64_t* getOffsets(SharedWorldHeader* header)
+        {
+            return getElementSizes(header) + header->columnCount;
+        }
+    };
+
+    /*!
+        \brief A read only view of a world in a shared memory segment.
+
+        Views are given to the function passed to SharedWorldReader::read()
+        and must not be used after that function returns.
+    */
+    template <typename ManagerType>
+    class SharedWorldView
+    {
+    public:
+        using Components = typename ManagerType::Components;
+        using BitsetType = typename ManagerType::BitsetType;
+
+        SharedWorldView(const unsigned char* base,
+            const std::uint64_t* offsets,
+            std::size_t size) :
+        base(base),
+        offsets(offsets),
+        size(size)
+        {}
+
+        /*!
+            \brief Returns the number of ids in the published world.
+        */
+        std::size_t getSize() const
+        {
+            return size;
+        }
+
+        bool isAlive(std::size_t index) const
+        {
+            return index < size && base[offsets[0] + index] != 0;
+        }
+
+        const BitsetType& getBitset(std::size_t index) const
+        {
+            return ((const BitsetType*)(base + offsets[1]))[index];
+        }
+
+        template <typename Component>
+        EC::ColumnView<const Component> getColumn() const
+        {
+            constexpr auto componentIndex =
+                EC::Meta::IndexOf<Component, Components>::value;
+            static_assert(componentIndex < Components::size,
+                "Component is unknown to the Manager");
+            return EC::ColumnView<const Component>{
+                (const Component*)(base + offsets[componentIndex + 2]),
+                size,
+                0};
+        }
+
+        template <typename Component>
+        const Component* getEntityData(std::size_t index) const
+        {
+            return &getColumn<Component>()[index];
+        }
+
+    private:
+        const unsigned char* base;
+        const std::uint64_t* offsets;
+        std::size_t size;
+    };
+
+    /*!
+        \brief Publishes the state of an EC::Manager to a POSIX shared memory
+            segment.
+
+        The segment holds the alive flags, bitsets and Component columns of
+        up to capacity Entities, guarded by a sequence lock so that processes
+        using SharedWorldReader can read consistent snapshots without copying
+        and without blocking the writer.
+
+        All Components must be trivially copyable.
+
+        Example:
+        \code{.cpp}
+            EC::SharedWorldWriter<ManagerType> writer("/world", 100000);
+            if(writer.isOpen())
+            {
+                // once per tick
+                writer.publish(manager);
+            }
+        \endcode
+    */
+    template <typename ManagerType>
+    class SharedWorldWriter
+    {
+    public:
+        using Layout = SharedWorldLayout<ManagerType>;
+        using Components = typename ManagerType::Components;
+        using BitsetType = typename ManagerType::BitsetType;
+
+        /*!
+            \brief Creates (or replaces) the shared memory segment with the
+                given name, sized to hold capacity Entities.
+
+            Use isOpen() to check if the segment was created.
+        */
+        SharedWorldWriter(const std::string& name, std::size_t capacity) :
+        name(name)
+        {
+            std::uint64_t elementSizes[Layout::columnCount];
+            Layout::getElementSizes(elementSizes);
+
+            std::uint64_t offsets[Layout::columnCount];
+            std::size_t offset = Layout::align(sizeof(SharedWorldHeader)
+                + 2 * Layout::columnCount * sizeof(std::uint64_t));
+            for(std::size_t i = 0; i < Layout::columnCount; ++i)
+            {
+                offsets[i] = offset;
+                offset = Layout::align(offset + elementSizes[i] * capacity);
+            }
+            totalBytes = offset;
+
+            int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+            if(fd == -1)
+            {
+                return;
+            }
+            if(ftruncate(fd, totalBytes) != 0)
+            {
+                close(fd);
+                shm_unlink(name.c_str());
+                return;
+            }
+            void* mapped = mmap(nullptr, totalBytes, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+            close(fd);
+            if(mapped == MAP_FAILED)
+            {
+                shm_unlink(name.c_str());
+                return;
+            }
+
+            base = (unsigned char*) mapped;
+            header = new (base) SharedWorldHeader{};
+            header->columnCount = Layout::columnCount;
+            header->capacity = capacity;
+            header->totalBytes = totalBytes;
+            header->size = 0;
+            header->sequence.store(0, std::memory_order_relaxed);
+            std::memcpy(Layout::getElementSizes(header), elementSizes,
+                sizeof(elementSizes));
+            std::memcpy(Layout::getOffsets(header), offsets, sizeof(offsets));
+            // magic is written last so readers never see a partial header
+            std::atomic_thread_fence(std::memory_order_release);
+            header->magic = EC_SHARED_WORLD_MAGIC;
+        }
+
+        SharedWorldWriter(const SharedWorldWriter&) = delete;
+        SharedWorldWriter& operator=(const SharedWorldWriter&) = delete;
+
+        /*!
+            \brief Unmaps and removes the shared memory segment.
+
+            Readers that already mapped the segment keep their mapping.
+        */
+        ~SharedWorldWriter()
+        {
+            if(base)
+            {
+                munmap(base, totalBytes);
+                shm_unlink(name.c_str());
+            }
+        }
+
+        bool isOpen() const
+        {
+            return base != nullptr;
+        }
+
+        std::size_t getCapacity() const
+        {
+            return base ? header->capacity : 0;
+        }
+
+        /*!
+            \brief Copies the current state of the given Manager into the
+                shared memory segment.
+
+            Readers that started reading before or during the publish will
+            retry and see the new state.
+
+            \return False if the segment is not open or the Manager holds
+                more Entities than the segment's capacity.
+        */
+        bool publish(const ManagerType& manager)
+        {
+            auto entities = manager.getEntitiesColumn();
+            if(!base || entities.size > header->capacity)
+            {
+                return false;
+            }
+
+            const std::uint64_t* offsets = Layout::getOffsets(header);
+            std::uint64_t sequence =
+                header->sequence.load(std::memory_order_relaxed);
+            header->sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            unsigned char* alive = base + offsets[0];
+            BitsetType* bitsets = (BitsetType*)(base + offsets[1]);
+            for(std::size_t i = 0; i < entities.size; ++i)
+            {
+                alive[i] = std::get<bool>(entities[i]) ? 1 : 0;
+                bitsets[i] = std::get<BitsetType>(entities[i]);
+            }
+
+            unsigned char* columnsBase = base;
+            EC::Meta::forEachWithIndex<Components>(
+            [&manager, columnsBase, offsets] (auto component, auto index) {
+                using Component = decltype(component);
+                auto column = manager.template getColumn<Component>();
+                unsigned char* out = columnsBase + offsets[index + 2];
+                if(column.isContiguous())
+                {
+                    std::memcpy(out, column.data,
+                        column.size * sizeof(Component));
+                }
+                else
+                {
+                    // A Component of a fusion group.
+                    for(std::size_t i = 0; i < column.size; ++i)
+                    {
+                        std::memcpy(out + i * sizeof(Component), &column[i],
+                            sizeof(Component));
+                    }
+                }
+            });
+
+            header->size = entities.size;
+            header->sequence.store(sequence + 2, std::memory_order_release);
+            return true;
+        }
+
+    private:
+        std::string name;
+        std::size_t totalBytes = 0;
+        unsigned char* base = nullptr;
+        SharedWorldHeader* header = nullptr;
+    };
+
+    /*!
+        \brief Maps a shared memory segment created by SharedWorldWriter for
+            reading from another process.
+
+        ManagerType must be the same EC::Manager type used by the writer.
+
+        Example:
+        \code{.cpp}
+            EC::SharedWorldReader<ManagerType> reader("/world");
+            reader.read([] (const EC::SharedWorldView<ManagerType>& view) {
+                auto positions = view.getColumn<Position>();
+                // ...
+            });
+        \endcode
+    */
+    template <typename ManagerType>
+    class SharedWorldReader
+    {
+    public:
+        using Layout = SharedWorldLayout<ManagerType>;
+        using View = SharedWorldView<ManagerType>;
+
+        /*!
+            \brief Maps the shared memory segment with the given name.
+
+            Use isOpen() to check if the segment was mapped and matches the
+            layout of ManagerType.
+        */
+        explicit SharedWorldReader(const std::string& name)
+        {
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            if(fd == -1)
+            {
+                return;
+            }
+            struct stat info;
+            if(fstat(fd, &info) != 0
+                || (std::size_t)info.st_size < sizeof(SharedWorldHeader))
+            {
+                close(fd);
+                return;
+            }
+            void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED,
+                fd, 0);
+            close(fd);
+            if(mapped == MAP_FAILED)
+            {
+                return;
+            }
+
+            totalBytes = info.st_size;
+            SharedWorldHeader* mappedHeader = (SharedWorldHeader*) mapped;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(!isCompatible(mappedHeader))
+            {
+                munmap(mapped, totalBytes);
+                return;
+            }
+
+            base = (const unsigned char*) mapped;
+            header = mappedHeader;
+        }
+
+        SharedWorldReader(const SharedWorldReader&) = delete;
+        SharedWorldReader& operator=(const SharedWorldReader&) = delete;
+
+        ~SharedWorldReader()
+        {
+            if(base)
+            {
+                munmap((void*) base, totalBytes);
+            }
+        }
+
+        bool isOpen() const
+        {
+            return base != nullptr;
+        }
+
+        /*!
+            \brief Returns the number of times the writer has published.
+        */
+        std::uint64_t getEpoch() const
+        {
+            return base ? header->sequence.load(std::memory_order_acquire) / 2
+                : 0;
+        }
+
+        /*!
+            \brief Calls the given function with a view of the latest
+                published world.
+
+            The function reads directly from shared memory. If the writer
+            publishes while the function runs, the function's results must be
+            discarded and the function is called again, up to maxAttempts
+            times. Thus the function should only copy or accumulate data and
+            must tolerate reading inconsistent data on attempts that are
+            retried.
+
+            \return True if the function completed on a consistent snapshot.
+        */
+        template <typename Function>
+        bool read(Function&& function, std::size_t maxAttempts = 64) const
+        {
+            if(!base)
+            {
+                return false;
+            }
+
+            const std::uint64_t* offsets =
+                Layout::getOffsets(const_cast<SharedWorldHeader*>(header));
+            for(std::size_t attempt = 0; attempt < maxAttempts; ++attempt)
+            {
+                std::uint64_t begin =
+                    header->sequence.load(std::memory_order_acquire);
+                if(begin % 2 == 1)
+                {
+                    continue;
+                }
+
+                View view(base, offsets, header->size);
+                function(view);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(header->sequence.load(std::memory_order_relaxed) == begin)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        bool isCompatible(SharedWorldHeader* mappedHeader) const
+        {
+            if(mappedHeader->magic != EC_SHARED_WORLD_MAGIC
+                || mappedHeader->columnCount != Layout::columnCount
+                || mappedHeader->totalBytes != totalBytes)
+            {
+                return false;
+            }
+            std::uint64_t elementSizes[Layout::columnCount];
+            Layout::getElementSizes(elementSizes);
+            return std::memcmp(elementSizes,
+                Layout::getElementSizes(mappedHeader),
+                sizeof(elementSizes)) == 0;
+        }
+
+        std::size_t totalBytes = 0;
+        const unsigned char* base = nullptr;
+        const SharedWorldHeader* header = nullptr;
+    };
+}
+
+#endif
+
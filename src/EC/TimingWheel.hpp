@@ -0,0 +1,177 @@
+
+#ifndef EC_TIMING_WHEEL_HPP
+#define EC_TIMING_WHEEL_HPP
+
+// Number of bits of the due tick handled by each level of an
+// EC::TimingWheel, which has 2^EC_TIMING_WHEEL_BITS slots per level.
+#define EC_TIMING_WHEEL_BITS 6
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace EC
+{
+    /*!
+        \brief A hierarchical timing wheel, holding values that expire after
+            a number of ticks.
+
+        Level 0 has one slot per tick of the next 2^EC_TIMING_WHEEL_BITS
+        ticks, and each higher level has slots 2^EC_TIMING_WHEEL_BITS times
+        as wide. A value is stored at the level of the highest group of bits
+        in which its due tick differs from the current tick, and moves down
+        a level when the current tick reaches the start of its slot. Thus
+        advancing costs the number of ticks plus the number of values that
+        expire or move down, however many values are scheduled, and each
+        value moves at most once per level.
+
+        EC::Manager uses a TimingWheel for scheduleExpiration() and the like,
+        but it may be used on its own.
+
+        Example:
+        \code{.cpp}
+            EC::TimingWheel<int> wheel;
+            wheel.schedule(10, 1);
+            wheel.schedule(1000, 2);
+            // Calls the function with 1.
+            wheel.advance(100, [] (int& value) { ... });
+        \endcode
+    */
+    template <typename T>
+    class TimingWheel
+    {
+    public:
+        /*!
+            \brief Schedules a value to expire after the given number of
+                ticks, at least 1.
+
+            May be called from the function passed to advance().
+        */
+        void schedule(std::uint64_t ticks, T value)
+        {
+            insert(Entry{tick + (ticks == 0 ? 1 : ticks), std::move(value)});
+            ++count;
+        }
+
+        /*!
+            \brief Advances the current tick by the given number of ticks,
+                calling function(T& value) for each value that expires, in
+                order of expiry.
+
+            \return The number of expired values.
+        */
+        template <typename Function>
+        std::size_t advance(std::uint64_t ticks, Function&& function)
+        {
+            std::size_t expired = 0;
+            for(; ticks > 0; --ticks)
+            {
+                if(count == 0)
+                {
+                    tick += ticks;
+                    break;
+                }
+                ++tick;
+
+                // Move down the values of the slots starting at this tick,
+                // highest level first, so that a value may move down more
+                // than one level.
+                std::size_t level = 0;
+                while(level + 1 < levelCount
+                    && (tick >> (bits * (level + 1))
+                        << (bits * (level + 1))) == tick)
+                {
+                    ++level;
+                }
+                for(; level > 0; --level)
+                {
+                    std::vector<Entry> moving;
+                    moving.swap(getSlot(level, tick));
+                    for(auto& entry : moving)
+                    {
+                        insert(std::move(entry));
+                    }
+                }
+
+                std::vector<Entry> expiring;
+                expiring.swap(getSlot(0, tick));
+                count -= expiring.size();
+                expired += expiring.size();
+                for(auto& entry : expiring)
+                {
+                    function(entry.value);
+                }
+            }
+            return expired;
+        }
+
+        /*!
+            \brief Returns the current tick, the number of ticks advanced
+                since construction or clear().
+        */
+        std::uint64_t getTick() const
+        {
+            return tick;
+        }
+
+        /*!
+            \brief Returns the number of scheduled values.
+        */
+        std::size_t size() const
+        {
+            return count;
+        }
+
+        /*!
+            \brief Removes all values and sets the current tick to 0.
+        */
+        void clear()
+        {
+            for(auto& slot : slots)
+            {
+                slot.clear();
+            }
+            count = 0;
+            tick = 0;
+        }
+
+    private:
+        static constexpr std::size_t bits = EC_TIMING_WHEEL_BITS;
+        static constexpr std::size_t slotCount = std::size_t(1) << bits;
+        // Enough levels for any 64-bit tick.
+        static constexpr std::size_t levelCount = (64 + bits - 1) / bits;
+
+        struct Entry
+        {
+            std::uint64_t due;
+            T value;
+        };
+
+        std::vector<Entry>& getSlot(std::size_t level, std::uint64_t due)
+        {
+            return slots[level * slotCount
+                + ((due >> (bits * level)) & (slotCount - 1))];
+        }
+
+        // Values due at the current tick go to level 0, and expire once
+        // advance() reaches that slot.
+        void insert(Entry entry)
+        {
+            std::uint64_t differing = entry.due ^ tick;
+            std::size_t level = 0;
+            while(level + 1 < levelCount
+                && differing >> (bits * (level + 1)) != 0)
+            {
+                ++level;
+            }
+            getSlot(level, entry.due).push_back(std::move(entry));
+        }
+
+        std::vector<Entry> slots[levelCount * slotCount];
+        std::uint64_t tick = 0;
+        std::size_t count = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,158 @@
+
+#ifndef EC_TRACE_REPLAY_HPP
+#define EC_TRACE_REPLAY_HPP
+
+#include <cstddef>
+#include <chrono>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Meta/ForEach.hpp"
+#include "Meta/IndexOf.hpp"
+
+namespace EC
+{
+    /*!
+        \brief Timings of the replayed queries with one Signature.
+    */
+    struct TraceQueryStats
+    {
+        // Indices of the Components and Tags of the Signature, for example
+        // "C0 C2 T1".
+        std::string signature;
+        std::size_t calls = 0;
+        // Matching Entities when recorded and when replayed, summed over all
+        // calls. These differ if the replay diverged from the recording.
+        std::size_t recordedEntities = 0;
+        std::size_t replayedEntities = 0;
+        double seconds = 0.0;
+    };
+
+    /*!
+        \brief The result of replayTrace().
+    */
+    struct TraceReplayResult
+    {
+        // False if the trace is malformed or does not match the Manager.
+        bool valid = false;
+        double totalSeconds = 0.0;
+        // Time spent in structural operations (everything but queries).
+        double structuralSeconds = 0.0;
+        std::size_t queryCount = 0;
+        // Ordered by Signature.
+        std::vector<TraceQueryStats> queries;
+    };
+
+    /*!
+        \brief Replays a workload trace against a Manager, timing its
+            structural operations and its queries.
+
+        A trace is the log of an EC::Journal that records queries (see
+        Journal::setRecordQueries()), for example written to a file by the
+        Journal's sink during a production run. Structural operations are
+        applied to the Manager as with Manager::replayJournal(). Queries are
+        re-executed through Manager::forMatchingBitset() with the recorded
+        Signature and thread count, so that they go through the same query
+        planner and thread split as the recorded query. The first byte of
+        each of the matched Components is read and written, which
+        reproduces the memory access pattern of the query without the
+        original functions.
+
+        ManagerType must have the same Components and Tags as the Manager
+        that recorded the trace, and manager should be empty.
+
+        Example:
+        \code{.cpp}
+            std::vector<unsigned char> trace = readFile("world.trace");
+            ManagerType manager;
+            EC::TraceReplayResult result = EC::replayTrace(manager, trace);
+        \endcode
+    */
+    template <typename ManagerType>
+    TraceReplayResult replayTrace(ManagerType& manager,
+        const std::vector<unsigned char>& trace)
+    {
+        using Clock = std::chrono::steady_clock;
+        using BitsetType = typename ManagerType::BitsetType;
+        using Components = typename ManagerType::Components;
+        using Combined = typename ManagerType::Combined;
+
+        TraceReplayResult result;
+        std::map<std::string, TraceQueryStats> stats;
+        double querySeconds = 0.0;
+
+        auto onQuery = [&manager, &stats, &querySeconds]
+            (const BitsetType& signature, std::size_t threadCount,
+            std::size_t entityCount)
+        {
+            auto start = Clock::now();
+
+            // First byte and size of each Component column in the Signature.
+            std::vector<std::tuple<unsigned char*, std::size_t> > columns;
+            EC::Meta::forEach<Components>(
+            [&manager, &signature, &columns] (auto t) {
+                using Component = decltype(t);
+                if(signature[EC::Meta::IndexOf<Component, Components>::value])
+                {
+                    auto column = manager.template getColumn<Component>();
+                    columns.emplace_back(
+                        (unsigned char*) column.data, column.stride);
+                }
+            });
+
+            // Run through the Manager's query path, as the recorded query
+            // was, touching each matched Component.
+            std::size_t visited = manager.forMatchingBitset(signature,
+                [&columns] (std::size_t id)
+                {
+                    for(auto& column : columns)
+                    {
+                        unsigned char* data =
+                            std::get<0>(column) + id * std::get<1>(column);
+                        *data = *data + 1;
+                    }
+                }, threadCount);
+
+            double seconds = std::chrono::duration<double>(
+                Clock::now() - start).count();
+            querySeconds += seconds;
+
+            std::string name;
+            for(std::size_t i = 0; i < Combined::size; ++i)
+            {
+                if(signature[i])
+                {
+                    if(!name.empty())
+                    {
+                        name += ' ';
+                    }
+                    name += i < Components::size
+                        ? "C" + std::to_string(i)
+                        : "T" + std::to_string(i - Components::size);
+                }
+            }
+            TraceQueryStats& entry = stats[name];
+            entry.signature = name;
+            ++entry.calls;
+            entry.recordedEntities += entityCount;
+            entry.replayedEntities += visited;
+            entry.seconds += seconds;
+        };
+
+        auto start = Clock::now();
+        result.valid = manager.replayJournal(trace, onQuery);
+        result.totalSeconds =
+            std::chrono::duration<double>(Clock::now() - start).count();
+        result.structuralSeconds = result.totalSeconds - querySeconds;
+        for(auto& entry : stats)
+        {
+            result.queryCount += entry.second.calls;
+            result.queries.push_back(entry.second);
+        }
+        return result;
+    }
+}
+
+#endif
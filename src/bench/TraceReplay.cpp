@@ -0,0 +1,166 @@
+
+/*
+    Replays a workload trace recorded with EC::Journal and prints how long
+    its structural operations and queries took.
+
+    Usage:
+        TraceReplay <trace file> [repetitions]
+        TraceReplay --record <trace file>
+        TraceReplay
+
+    The Manager type used for the replay must match the recording Manager.
+    Configure with -DEC_TRACE_MANAGER_HEADER=<header> to use a header that
+    defines TraceManagerType; otherwise a sample Manager is used.
+    --record writes a trace of a sample workload, and without arguments the
+    sample workload is recorded in memory and replayed.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <EC/EC.hpp>
+#include <EC/TraceReplay.hpp>
+
+#ifdef EC_TRACE_MANAGER_HEADER
+  #include EC_TRACE_MANAGER_HEADER
+  #define EC_TRACE_SAMPLE 0
+#else
+  #define EC_TRACE_SAMPLE 1
+
+struct Position
+{
+    float x, y;
+};
+struct Velocity
+{
+    float x, y;
+};
+struct Health
+{
+    int value;
+};
+struct Player {};
+struct Enemy {};
+
+using TraceManagerType = EC::Manager<
+    EC::Meta::TypeList<Position, Velocity, Health>,
+    EC::Meta::TypeList<Player, Enemy> >;
+
+void recordSample(EC::Journal& journal)
+{
+    TraceManagerType manager;
+    manager.setJournal(&journal);
+    for(int i = 0; i < 20000; ++i)
+    {
+        auto id = manager.addEntity();
+        manager.addComponent<Position>(id, Position{(float)i, 0.0f});
+        manager.addComponent<Velocity>(id, Velocity{1.0f, 0.5f});
+        if(i % 10 == 0)
+        {
+            manager.addComponent<Health>(id, Health{100});
+            manager.addTag<Enemy>(id);
+        }
+    }
+    for(int tick = 0; tick < 60; ++tick)
+    {
+        manager.forMatchingSignature<EC::Meta::TypeList<Position, Velocity> >(
+            [] (std::size_t, void*, Position* p, Velocity* v) {
+                p->x += v->x;
+                p->y += v->y;
+            }, nullptr, 2);
+        manager.forMatchingSignature<EC::Meta::TypeList<Health, Enemy> >(
+            [] (std::size_t, void*, Health* h) {
+                --h->value;
+            });
+        for(int i = 0; i < 100; ++i)
+        {
+            manager.deleteEntity((tick * 100 + i) * 3 % 20000);
+            manager.addComponent<Position>(manager.addEntity());
+        }
+    }
+    manager.setJournal(nullptr);
+    journal.flush();
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    std::vector<unsigned char> trace;
+    int repetitions = 1;
+    if(argc >= 3 && std::string(argv[1]) == "--record")
+    {
+#if EC_TRACE_SAMPLE
+        std::ofstream file(argv[2], std::ios::binary);
+        EC::Journal journal([&file] (const unsigned char* data,
+            std::size_t size) {
+            file.write((const char*) data, size);
+        });
+        journal.setRecordQueries(true);
+        recordSample(journal);
+        return file ? 0 : 1;
+#else
+        std::fprintf(stderr, "--record needs the sample Manager\n");
+        return 1;
+#endif
+    }
+    else if(argc >= 2)
+    {
+        std::ifstream file(argv[1], std::ios::binary);
+        if(!file)
+        {
+            std::fprintf(stderr, "Cannot open %s\n", argv[1]);
+            return 1;
+        }
+        trace.assign(std::istreambuf_iterator<char>(file),
+            std::istreambuf_iterator<char>());
+        if(argc >= 3)
+        {
+            repetitions = std::atoi(argv[2]);
+        }
+    }
+    else
+    {
+#if EC_TRACE_SAMPLE
+        EC::Journal journal;
+        journal.setRecordQueries(true);
+        recordSample(journal);
+        trace = journal.getLog();
+#else
+        std::fprintf(stderr, "Usage: %s <trace file> [repetitions]\n",
+            argv[0]);
+        return 1;
+#endif
+    }
+
+    for(int i = 0; i < repetitions; ++i)
+    {
+        TraceManagerType manager;
+        EC::TraceReplayResult result = EC::replayTrace(manager, trace);
+        if(!result.valid)
+        {
+            std::fprintf(stderr, "Trace is malformed or does not match "
+                "the Manager\n");
+            return 1;
+        }
+
+        std::printf("run %d: total %.6f s, structural %.6f s, %zu queries\n",
+            i, result.totalSeconds, result.structuralSeconds,
+            result.queryCount);
+        for(const auto& query : result.queries)
+        {
+            std::printf("  [%s] %zu calls, %.6f s, %zu entities",
+                query.signature.c_str(), query.calls, query.seconds,
+                query.replayedEntities);
+            if(query.replayedEntities != query.recordedEntities)
+            {
+                std::printf(" (recorded %zu)", query.recordedEntities);
+            }
+            std::printf("\n");
+        }
+    }
+    return 0;
+}
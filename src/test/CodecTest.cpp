@@ -0,0 +1,136 @@
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include <EC/Codec.hpp>
+
+struct Pair
+{
+    std::int32_t a;
+    std::int32_t b;
+
+    bool operator==(const Pair& other) const
+    {
+        return a == other.a && b == other.b;
+    }
+};
+
+template <typename T>
+std::vector<T> roundTrip(const std::vector<T>& values,
+    EC::Codec::ColumnEncoding encoding,
+    std::size_t chunkSize,
+    std::size_t threadCount,
+    std::size_t* encodedSize = nullptr)
+{
+    EC::Codec::Buffer buffer;
+    EC::Codec::encodeColumn(values.data(), values.size(), encoding, buffer,
+        chunkSize, threadCount);
+    if(encodedSize)
+    {
+        *encodedSize = buffer.size();
+    }
+
+    std::vector<T> decoded(values.size());
+    std::size_t pos = 0;
+    EXPECT_TRUE(EC::Codec::decodeColumn(buffer.data(), buffer.size(), pos,
+        decoded.data(), decoded.size(), threadCount));
+    EXPECT_EQ(buffer.size(), pos);
+    return decoded;
+}
+
+TEST(Codec, Delta)
+{
+    std::vector<std::int64_t> values;
+    for(std::int64_t i = 0; i < 1000; ++i)
+    {
+        values.push_back(1000000 + i * 3 - (i % 7));
+    }
+    values.push_back(INT64_MIN);
+    values.push_back(INT64_MAX);
+    values.push_back(-5);
+
+    std::size_t encodedSize;
+    EXPECT_EQ(values, roundTrip(values, EC::Codec::ColumnEncoding::Delta,
+        100, 4, &encodedSize));
+    EXPECT_LT(encodedSize, values.size() * sizeof(std::int64_t) / 4);
+
+    std::vector<Pair> pairs;
+    for(std::int32_t i = 0; i < 300; ++i)
+    {
+        pairs.push_back(Pair{-i, i * 2});
+    }
+    EXPECT_EQ(pairs, roundTrip(pairs, EC::Codec::ColumnEncoding::Delta,
+        64, 3));
+
+    std::vector<std::uint8_t> bytes{0, 255, 1, 254, 7, 7, 7};
+    EXPECT_EQ(bytes, roundTrip(bytes, EC::Codec::ColumnEncoding::Delta,
+        4, 1));
+}
+
+TEST(Codec, Xor)
+{
+    std::vector<double> values;
+    for(int i = 0; i < 500; ++i)
+    {
+        values.push_back(i < 250 ? 12.5 : 12.5 + i * 0.25);
+    }
+    values.push_back(-0.0);
+    values.push_back(1e300);
+
+    std::size_t encodedSize;
+    EXPECT_EQ(values, roundTrip(values, EC::Codec::ColumnEncoding::Xor,
+        128, 2, &encodedSize));
+    EXPECT_LT(encodedSize, values.size() * sizeof(double) / 2);
+
+    std::vector<float> floats{1.0f, 1.5f, 1.5f, -3.25f};
+    EXPECT_EQ(floats, roundTrip(floats, EC::Codec::ColumnEncoding::Xor,
+        2, 2));
+}
+
+TEST(Codec, RunLengthAndRaw)
+{
+    std::vector<std::uint64_t> flags(10000, 1);
+    flags[5] = 0;
+    flags[9999] = 0;
+
+    std::size_t encodedSize;
+    EXPECT_EQ(flags, roundTrip(flags, EC::Codec::ColumnEncoding::RunLength,
+        4096, 3, &encodedSize));
+    EXPECT_LT(encodedSize, 64);
+
+    std::vector<Pair> pairs{{1, 2}, {3, 4}, {5, 6}};
+    EXPECT_EQ(pairs, roundTrip(pairs, EC::Codec::ColumnEncoding::Raw, 2, 1));
+
+    std::vector<Pair> empty;
+    EXPECT_EQ(empty, roundTrip(empty, EC::Codec::ColumnEncoding::Delta,
+        16, 4));
+}
+
+TEST(Codec, Malformed)
+{
+    std::vector<std::int32_t> values{1, 2, 3, 4, 5};
+    EC::Codec::Buffer buffer;
+    EC::Codec::encodeColumn(values.data(), values.size(),
+        EC::Codec::ColumnEncoding::Delta, buffer, 2);
+
+    std::vector<std::int32_t> decoded(values.size());
+    std::size_t pos = 0;
+    EXPECT_FALSE(EC::Codec::decodeColumn(buffer.data(), buffer.size() - 1,
+        pos, decoded.data(), decoded.size()));
+
+    pos = 0;
+    EXPECT_FALSE(EC::Codec::decodeColumn(buffer.data(), buffer.size(),
+        pos, decoded.data(), decoded.size() - 1));
+
+    // A header claiming more chunks than there are bytes left.
+    EC::Codec::Buffer header{static_cast<unsigned char>(
+        EC::Codec::ColumnEncoding::Raw)};
+    EC::Codec::writeVarint(header, decoded.size());
+    EC::Codec::writeVarint(header, 1);
+    header.push_back(0);
+    pos = 0;
+    EXPECT_FALSE(EC::Codec::decodeColumn(header.data(), header.size(),
+        pos, decoded.data(), decoded.size()));
+}
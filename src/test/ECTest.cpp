@@ -6,9 +6,21 @@
 #include <memory>
 #include <unordered_map>
 #include <mutex>
+#include <atomic>
+#include <limits>
+#include <set>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <condition_variable>
+#include <functional>
+#include <future>
 
 #include <EC/Meta/Meta.hpp>
 #include <EC/EC.hpp>
+#include <EC/SharedWorld.hpp>
+#include <EC/TraceReplay.hpp>
+#include <unistd.h>
 
 struct C0 {
     C0(int x = 0, int y = 0) :
@@ -1027,3 +1039,1831 @@ TEST(EC, context)
     EXPECT_EQ(999, manager.getEntityData<C0>(e1)->x);
     EXPECT_EQ(1999, manager.getEntityData<C0>(e1)->y);
 }
+
+TEST(EC, FunctionStorageOrder)
+{
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+    auto eid = manager.addEntity();
+    manager.addComponent<C0>(eid, 0, 0);
+
+    std::vector<int> order;
+    auto record = [] (int value) {
+        return [value] (std::size_t /* id */, void* context, C0* /* c0 */) {
+            ((std::vector<int>*)context)->push_back(value);
+        };
+    };
+
+    auto f0 = manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        record(0), &order);
+    auto f1 = manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        record(1), &order, 5);
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        record(2), &order, -5);
+    for(int i = 3; i < 40; ++i)
+    {
+        manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+            record(i), &order);
+    }
+
+    manager.callForMatchingFunctions();
+    {
+        std::vector<int> expected{2, 0};
+        for(int i = 3; i < 40; ++i)
+        {
+            expected.push_back(i);
+        }
+        expected.push_back(1);
+        EXPECT_EQ(expected, order);
+    }
+
+    EXPECT_TRUE(manager.removeForMatchingFunction(f0));
+    EXPECT_TRUE(manager.changeForMatchingFunctionPriority(f1, -10));
+    EXPECT_FALSE(manager.changeForMatchingFunctionPriority(f0, 0));
+
+    order.clear();
+    manager.callForMatchingFunctions();
+    {
+        std::vector<int> expected{1, 2};
+        for(int i = 3; i < 40; ++i)
+        {
+            expected.push_back(i);
+        }
+        EXPECT_EQ(expected, order);
+    }
+}
+
+TEST(EC, DeletedEntityRecycling)
+{
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+
+    for(unsigned int i = 0; i < 200; ++i)
+    {
+        manager.addEntity();
+    }
+
+    manager.deleteEntity(150);
+    manager.deleteEntity(3);
+    manager.deleteEntity(70);
+    manager.deleteEntity(3);
+    EXPECT_EQ(197, manager.getCurrentSize());
+
+    EXPECT_EQ(3, manager.addEntity());
+    EXPECT_EQ(70, manager.addEntity());
+    EXPECT_EQ(150, manager.addEntity());
+    EXPECT_EQ(200, manager.addEntity());
+
+    // deleting the tail shrinks the iterated range
+    for(unsigned int i = 100; i < 201; ++i)
+    {
+        manager.deleteEntity(i);
+    }
+    manager.deleteEntity(50);
+    EXPECT_EQ(99, manager.getCurrentSize());
+    EXPECT_TRUE(manager.hasEntity(99));
+    EXPECT_FALSE(manager.hasEntity(100));
+
+    manager.deleteEntity(99);
+    EXPECT_FALSE(manager.hasEntity(99));
+    EXPECT_EQ(98, manager.getCurrentSize());
+
+    EXPECT_EQ(50, manager.addEntity());
+    EXPECT_EQ(99, manager.addEntity());
+    EXPECT_EQ(100, manager.addEntity());
+    EXPECT_EQ(101, manager.getCurrentSize());
+    EXPECT_FALSE(manager.hasEntity(101));
+}
+
+TEST(EC, ColumnView)
+{
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+
+    for(int i = 0; i < 10; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i, i * 2);
+    }
+    manager.deleteEntity(4);
+
+    auto column = manager.getColumn<C0>();
+    EXPECT_EQ(10, column.size);
+    EXPECT_EQ(manager.getStorageVersion(), column.version);
+    for(std::size_t i = 0; i < column.size; ++i)
+    {
+        EXPECT_EQ(manager.getEntityData<C0>(i), &column[i]);
+    }
+    column[3].x = 100;
+    EXPECT_EQ(100, manager.getEntityData<C0>(3)->x);
+
+    auto entitiesColumn = manager.getEntitiesColumn();
+    EXPECT_EQ(10, entitiesColumn.size);
+    EXPECT_FALSE(std::get<bool>(entitiesColumn[4]));
+    EXPECT_TRUE(std::get<bool>(entitiesColumn[5]));
+
+    const auto& constManager = manager;
+    auto constColumn = constManager.getColumn<C0>();
+    EXPECT_EQ(column.data, constColumn.data);
+
+    auto unknownColumn = manager.getColumn<T0>();
+    EXPECT_EQ(nullptr, unknownColumn.data);
+    EXPECT_TRUE(unknownColumn.empty());
+
+    while(manager.getStorageVersion() == column.version)
+    {
+        manager.addEntity();
+    }
+    EXPECT_NE(column.version, manager.getColumn<C0>().version);
+}
+
+TEST(EC, SharedWorld)
+{
+    using ManagerType = EC::Manager<ListComponentsAll, ListTagsAll>;
+    ManagerType manager;
+
+    for(int i = 0; i < 5; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i, i + 1);
+    }
+    manager.addTag<T0>(2);
+    manager.deleteEntity(1);
+
+    std::string name = "/ec_test_world_" + std::to_string(getpid());
+    EC::SharedWorldWriter<ManagerType> writer(name, 16);
+    ASSERT_TRUE(writer.isOpen());
+    EXPECT_EQ(16, writer.getCapacity());
+
+    EC::SharedWorldReader<ManagerType> reader(name);
+    ASSERT_TRUE(reader.isOpen());
+    EXPECT_EQ(0, reader.getEpoch());
+
+    EXPECT_TRUE(writer.publish(manager));
+    EXPECT_EQ(1, reader.getEpoch());
+
+    std::vector<int> xs;
+    bool consistent = reader.read(
+        [&xs] (const EC::SharedWorldView<ManagerType>& view) {
+            xs.clear();
+            EXPECT_EQ(5, view.getSize());
+            EXPECT_FALSE(view.isAlive(1));
+            EXPECT_TRUE(view.getBitset(2).getTagBit<T0>());
+            auto column = view.getColumn<C0>();
+            for(std::size_t i = 0; i < column.size; ++i)
+            {
+                if(view.isAlive(i))
+                {
+                    xs.push_back(column[i].x);
+                }
+            }
+        });
+    EXPECT_TRUE(consistent);
+    EXPECT_EQ((std::vector<int>{0, 2, 3, 4}), xs);
+
+    for(int i = 0; i < 20; ++i)
+    {
+        manager.addEntity();
+    }
+    EXPECT_FALSE(writer.publish(manager));
+    EXPECT_EQ(1, reader.getEpoch());
+
+    EC::SharedWorldReader<EC::Manager<ListComponentsSome, ListTagsAll> >
+        wrongReader(name);
+    EXPECT_FALSE(wrongReader.isOpen());
+}
+
+struct Target : EC::EntityRef
+{
+    using EC::EntityRef::EntityRef;
+};
+
+TEST(EC, ForMatchingRelation)
+{
+    EC::Manager<EC::Meta::TypeList<C0, C1, Target>, ListTagsAll> manager;
+
+    std::vector<std::size_t> targets;
+    for(int i = 0; i < 4; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C1>(eid);
+        manager.getEntityData<C1>(eid)->vx = 0;
+        targets.push_back(eid);
+    }
+    manager.addTag<T0>(targets[0]);
+    manager.addTag<T0>(targets[1]);
+    manager.addTag<T0>(targets[3]);
+
+    std::vector<std::size_t> sources;
+    for(int i = 0; i < 8; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i + 1, 0);
+        manager.addComponent<Target>(eid, targets[3 - i % 4]);
+        sources.push_back(eid);
+    }
+    // invalid and dangling references are skipped
+    manager.addComponent<Target>(sources[7]);
+    manager.deleteEntity(targets[3]);
+
+    std::vector<std::pair<std::size_t, std::size_t> > calls;
+    auto function = [&calls] (std::size_t sourceID, std::size_t targetID,
+        void* /* context */, C0* c0, Target* ref, C1* c1)
+    {
+        EXPECT_EQ(targetID, ref->id);
+        c1->vx += c0->x;
+        calls.emplace_back(sourceID, targetID);
+    };
+
+    manager.forMatchingRelation<
+        EC::Meta::TypeList<C0, Target>, Target, EC::Meta::TypeList<C1, T0> >(
+        function);
+
+    std::vector<std::pair<std::size_t, std::size_t> > expected{
+        {sources[2], targets[1]},
+        {sources[3], targets[0]},
+        {sources[6], targets[1]}};
+    EXPECT_EQ(expected, calls);
+    EXPECT_EQ(4, manager.getEntityData<C1>(targets[0])->vx);
+    EXPECT_EQ(10, manager.getEntityData<C1>(targets[1])->vx);
+    EXPECT_EQ(0, manager.getEntityData<C1>(targets[2])->vx);
+
+    calls.clear();
+    manager.forMatchingRelation<
+        EC::Meta::TypeList<C0, Target>, Target, EC::Meta::TypeList<C1, T0> >(
+        function, nullptr, 1, true);
+    expected = {
+        {sources[3], targets[0]},
+        {sources[2], targets[1]},
+        {sources[6], targets[1]}};
+    EXPECT_EQ(expected, calls);
+
+    std::atomic_int count(0);
+    manager.forMatchingRelation<
+        EC::Meta::TypeList<C0>, Target, EC::Meta::TypeList<> >(
+        [&count] (std::size_t /* sourceID */, std::size_t /* targetID */,
+            void* /* context */, C0* /* c0 */) {
+            ++count;
+        }, nullptr, 3);
+    EXPECT_EQ(5, count);
+}
+
+TEST(EC, IndexType)
+{
+    using Index = std::uint32_t;
+    struct Parent : EC::BasicEntityRef<Index>
+    {
+        using EC::BasicEntityRef<Index>::BasicEntityRef;
+    };
+    EC::Manager<EC::Meta::TypeList<C0, Parent>, ListTagsAll, Index> manager;
+
+    Index root = manager.addEntity();
+    manager.addComponent<C0>(root, 10, 20);
+    for(int i = 0; i < 300; ++i)
+    {
+        Index child = manager.addEntity();
+        manager.addComponent<C0>(child);
+        manager.addComponent<Parent>(child, root);
+    }
+    EXPECT_FALSE(Parent().isValid());
+    EXPECT_EQ(std::numeric_limits<Index>::max(), Parent().id);
+
+    int calls = 0;
+    manager.forMatchingRelation<
+        EC::Meta::TypeList<C0>, Parent, EC::Meta::TypeList<C0> >(
+        [&calls] (Index /* child */, Index /* parent */, void* /* context */,
+            C0* childC0, C0* parentC0) {
+            childC0->x = parentC0->x;
+            ++calls;
+        });
+    EXPECT_EQ(300, calls);
+
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0, Parent> >(
+        [] (Index id, void* /* context */, C0* c0, Parent* /* parent */) {
+            c0->y = (int)id;
+        });
+    manager.callForMatchingFunctions(2);
+    EXPECT_EQ(10, manager.getEntityData<C0>(5)->x);
+    EXPECT_EQ(5, manager.getEntityData<C0>(5)->y);
+    EXPECT_EQ(20, manager.getEntityData<C0>(root)->y);
+
+    // The maximum of IndexType is the invalid id, never given to Entities.
+    using SmallManager = EC::Manager<EC::Meta::TypeList<C0>, ListTagsAll,
+        std::uint8_t>;
+    SmallManager small;
+    for(int i = 0; i < 255; ++i)
+    {
+        EXPECT_EQ(i, small.addEntity());
+    }
+    EXPECT_THROW(small.addEntity(), std::length_error);
+    EXPECT_EQ(255u, small.getCurrentSize());
+    small.deleteEntity(7);
+    EXPECT_EQ(7, small.addEntity());
+
+    small.deleteEntity(3);
+    SmallManager::StagingBuffer staging;
+    staging.addEntity();
+    staging.addEntity();
+    EXPECT_THROW(small.commitStaging(staging), std::length_error);
+    EXPECT_EQ(0u, staging.getCommittedSize());
+    EXPECT_EQ(1u, small.commitStaging(staging, 1));
+    EXPECT_EQ(3, staging.getCommittedIds()[0]);
+}
+
+struct Velocity
+{
+    float x, y;
+};
+
+namespace EC
+{
+    namespace Codec
+    {
+        template <>
+        struct ColumnEncodingOf<Velocity>
+        {
+            static constexpr ColumnEncoding value = ColumnEncoding::Xor;
+        };
+    }
+}
+
+TEST(EC, Snapshot)
+{
+    using ManagerType =
+        EC::Manager<EC::Meta::TypeList<C0, Velocity>, ListTagsAll>;
+    ManagerType manager;
+
+    for(int i = 0; i < 5000; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i, 7);
+        if(i % 3 == 0)
+        {
+            manager.addComponent<Velocity>(eid);
+            manager.getEntityData<Velocity>(eid)->x = 0.5f;
+            manager.getEntityData<Velocity>(eid)->y = i * 0.25f;
+            manager.addTag<T1>(eid);
+        }
+    }
+    manager.deleteEntity(10);
+    manager.deleteEntity(4999);
+    manager.deleteEntity(4998);
+
+    auto snapshot = manager.saveSnapshot(4);
+    EXPECT_LT(snapshot.size(),
+        5000 * (sizeof(C0) + sizeof(Velocity)) / 2);
+
+    ManagerType loaded;
+    auto fid = loaded.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        [] (std::size_t /* id */, void* /* context */, C0* /* c0 */) {});
+    loaded.addEntity();
+    ASSERT_TRUE(loaded.loadSnapshot(snapshot, 3));
+
+    EXPECT_EQ(manager.getCurrentSize(), loaded.getCurrentSize());
+    EXPECT_FALSE(loaded.hasEntity(4998));
+    for(std::size_t i = 0; i < 4998; ++i)
+    {
+        EXPECT_EQ(manager.isAlive(i), loaded.isAlive(i));
+        if(!manager.isAlive(i))
+        {
+            continue;
+        }
+        EXPECT_EQ(manager.getEntityData<C0>(i)->x,
+            loaded.getEntityData<C0>(i)->x);
+        EXPECT_EQ(manager.hasComponent<Velocity>(i),
+            loaded.hasComponent<Velocity>(i));
+        EXPECT_EQ(manager.hasTag<T1>(i), loaded.hasTag<T1>(i));
+        if(manager.hasComponent<Velocity>(i))
+        {
+            EXPECT_EQ(manager.getEntityData<Velocity>(i)->y,
+                loaded.getEntityData<Velocity>(i)->y);
+        }
+    }
+    EXPECT_EQ(10, loaded.addEntity());
+    EXPECT_TRUE(loaded.callForMatchingFunction(fid));
+
+    snapshot.pop_back();
+    EXPECT_FALSE(loaded.loadSnapshot(snapshot));
+    EXPECT_EQ(0, loaded.getCurrentSize());
+
+    // A header claiming far more Entities than the bytes that follow can
+    // hold is rejected before allocating for them.
+    std::size_t headerSize = 4;
+    std::uint64_t value;
+    for(int i = 0; i < 4; ++i)
+    {
+        ASSERT_TRUE(EC::Codec::readVarint(snapshot.data(), snapshot.size(),
+            headerSize, value));
+    }
+    EC::Codec::Buffer hostile(snapshot.begin(),
+        snapshot.begin() + headerSize);
+    EC::Codec::writeVarint(hostile, std::uint64_t(1) << 40);
+    hostile.resize(hostile.size() + 16, 0);
+    EXPECT_FALSE(loaded.loadSnapshot(hostile));
+    EXPECT_EQ(0, loaded.getCurrentSize());
+
+    EC::Manager<EC::Meta::TypeList<C0>, ListTagsAll> other;
+    EXPECT_FALSE(other.loadSnapshot(manager.saveSnapshot()));
+}
+
+TEST(EC, SnapshotAsync)
+{
+    using ManagerType =
+        EC::Manager<EC::Meta::TypeList<C0, Velocity>, ListTagsAll>;
+    ManagerType manager;
+
+    for(int i = 0; i < 1000; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i, i);
+        manager.addComponent<Velocity>(eid);
+    }
+
+    std::vector<std::future<std::vector<unsigned char> > > futures;
+    std::vector<std::vector<unsigned char> > expected;
+    for(int tick = 0; tick < 6; ++tick)
+    {
+        expected.push_back(manager.saveSnapshot());
+        futures.push_back(manager.saveSnapshotAsync(2));
+
+        switch(tick % 3)
+        {
+        case 0:
+            manager.forMatchingSignature<EC::Meta::TypeList<C0> >(
+                [] (std::size_t /* id */, void* /* context */, C0* c0) {
+                    ++c0->x;
+                });
+            break;
+        case 1:
+            manager.getEntityData<Velocity>(tick)->y = tick;
+            break;
+        default:
+            manager.deleteEntity(tick);
+            manager.addEntity();
+            manager.addTag<T0>(tick);
+            break;
+        }
+    }
+
+    for(std::size_t i = 0; i < futures.size(); ++i)
+    {
+        EXPECT_EQ(expected[i], futures[i].get());
+    }
+
+    ManagerType loaded;
+    EXPECT_TRUE(loaded.loadSnapshot(manager.saveSnapshotAsync().get()));
+    EXPECT_EQ(1001, loaded.getEntityData<C0>(999)->x);
+    EXPECT_EQ(4, loaded.getEntityData<Velocity>(4)->y);
+    EXPECT_TRUE(loaded.hasTag<T0>(5));
+
+    // A copy captures its own columns: the original's buffers hold columns
+    // with epochs that also look current to the copy.
+    manager.saveSnapshotAsync().get();
+    manager.saveSnapshotAsync().get();
+    ManagerType copy = manager;
+    manager.getEntityData<C0>(1)->y = -2;
+    EXPECT_EQ(manager.saveSnapshot(), manager.saveSnapshotAsync().get());
+    for(int i = 0; i < 2; ++i)
+    {
+        EXPECT_EQ(copy.saveSnapshot(), copy.saveSnapshotAsync().get());
+    }
+    copy = manager;
+    copy.getEntityData<C0>(2)->y = -3;
+    for(int i = 0; i < 2; ++i)
+    {
+        EXPECT_EQ(copy.saveSnapshot(), copy.saveSnapshotAsync().get());
+        EXPECT_EQ(manager.saveSnapshot(), manager.saveSnapshotAsync().get());
+    }
+}
+
+TEST(EC, RegionLoader)
+{
+    using ManagerType = EC::Manager<ListComponentsAll, ListTagsAll>;
+    ManagerType manager;
+
+    for(int i = 0; i < 10; ++i)
+    {
+        manager.addEntity();
+    }
+    manager.deleteEntity(2);
+    manager.deleteEntity(5);
+
+    std::vector<std::size_t> committedRegions;
+    std::vector<std::size_t> regionIds;
+    EC::RegionLoader<ManagerType> loader;
+    for(int region = 0; region < 3; ++region)
+    {
+        loader.load(
+            [region] (ManagerType::StagingBuffer& staging) {
+                if(region == 1)
+                {
+                    return false;
+                }
+                staging.reserve(500);
+                for(int i = 0; i < 500; ++i)
+                {
+                    auto index = staging.addEntity();
+                    staging.addComponent<C0>(index, region, i);
+                    if(i % 2 == 0)
+                    {
+                        staging.addTag<T0>(index);
+                    }
+                }
+                return true;
+            },
+            [&committedRegions, &regionIds] (std::size_t regionID,
+                bool loaded, const std::vector<ManagerType::Index>& ids) {
+                committedRegions.push_back(regionID);
+                if(loaded)
+                {
+                    EXPECT_EQ(500u, ids.size());
+                    regionIds.insert(regionIds.end(), ids.begin(), ids.end());
+                }
+            });
+    }
+    EXPECT_EQ(3u, loader.getPendingCount());
+
+    loader.wait();
+    std::size_t merged = 0;
+    while(loader.getPendingCount() > 0)
+    {
+        std::size_t count = loader.commit(manager, 300);
+        EXPECT_LE(count, 300u);
+        merged += count;
+    }
+    EXPECT_EQ(1000u, merged);
+    EXPECT_EQ(1008u, manager.getCurrentSize());
+    EXPECT_EQ((std::vector<std::size_t>{0, 1, 2}), committedRegions);
+
+    ASSERT_EQ(1000u, regionIds.size());
+    EXPECT_EQ(2u, regionIds[0]);
+    EXPECT_EQ(5u, regionIds[1]);
+    EXPECT_EQ(10u, regionIds[2]);
+    for(std::size_t i = 0; i < regionIds.size(); ++i)
+    {
+        auto id = regionIds[i];
+        EXPECT_TRUE(manager.isAlive(id));
+        EXPECT_TRUE(manager.hasComponent<C0>(id));
+        EXPECT_FALSE(manager.hasComponent<C1>(id));
+        EXPECT_EQ(i % 2 == 0, manager.hasTag<T0>(id));
+        EXPECT_EQ(i < 500 ? 0 : 2, manager.getEntityData<C0>(id)->x);
+        EXPECT_EQ((int)(i % 500), manager.getEntityData<C0>(id)->y);
+    }
+}
+
+TEST(EC, Journal)
+{
+    using ManagerType = EC::Manager<ListComponentsAll, ListTagsAll>;
+    auto expectSameEntities = [] (ManagerType& a, ManagerType& b) {
+        ASSERT_EQ(a.getCurrentSize(), b.getCurrentSize());
+        for(std::size_t i = 0; i < a.getCurrentCapacity(); ++i)
+        {
+            ASSERT_EQ(a.isAlive(i), b.isAlive(i));
+            if(!a.isAlive(i))
+            {
+                continue;
+            }
+            EXPECT_EQ(a.getEntityInfo(i), b.getEntityInfo(i));
+            if(a.hasComponent<C0>(i))
+            {
+                EXPECT_EQ(a.getEntityData<C0>(i)->x,
+                    b.getEntityData<C0>(i)->x);
+                EXPECT_EQ(a.getEntityData<C0>(i)->y,
+                    b.getEntityData<C0>(i)->y);
+            }
+        }
+    };
+
+    ManagerType manager;
+    EC::Journal journal(256);
+    manager.setJournal(&journal);
+    EXPECT_EQ(&journal, manager.getJournal());
+
+    for(int i = 0; i < 100; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i, -i);
+        if(i % 3 == 0)
+        {
+            manager.addComponent<C1>(eid);
+            manager.addTag<T1>(eid);
+        }
+    }
+    for(std::size_t i = 10; i < 20; ++i)
+    {
+        manager.deleteEntity(i);
+    }
+    manager.removeComponent<C0>(21);
+    manager.removeTag<T1>(21);
+    manager.addEntity();
+
+    ManagerType::StagingBuffer staging;
+    for(int i = 0; i < 20; ++i)
+    {
+        staging.addComponent<C0>(staging.addEntity(), 1000 + i);
+    }
+    manager.commitStaging(staging);
+
+    // Records from several threads are ordered by their sequence numbers.
+    std::vector<std::thread> threads;
+    for(std::size_t t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&manager, t] () {
+            for(std::size_t i = 20 + t; i < 100; i += 4)
+            {
+                manager.addTag<T0>(i);
+            }
+        });
+    }
+    for(auto& thread : threads)
+    {
+        thread.join();
+    }
+    // Recorded after the threads' records, so replayed after them too.
+    for(std::size_t i = 20; i < 100; i += 2)
+    {
+        manager.removeTag<T0>(i);
+    }
+    journal.flush();
+
+    ManagerType replayed;
+    EXPECT_TRUE(replayed.replayJournal(journal.getLog()));
+    expectSameEntities(manager, replayed);
+    EXPECT_EQ(1019, replayed.getEntityData<C0>(110)->x);
+    EXPECT_FALSE(replayed.hasTag<T0>(20));
+    EXPECT_TRUE(replayed.hasTag<T0>(21));
+
+    // Snapshots are recorded as a reset followed by their contents.
+    ManagerType snapshotSource;
+    snapshotSource.addEntity();
+    snapshotSource.addComponent<C0>(snapshotSource.addEntity(), 5);
+    snapshotSource.addEntity();
+    snapshotSource.deleteEntity(0);
+    journal.clearLog();
+    EXPECT_TRUE(manager.loadSnapshot(snapshotSource.saveSnapshot()));
+    journal.flush();
+    EXPECT_TRUE(replayed.replayJournal(journal.getLog()));
+    expectSameEntities(manager, replayed);
+
+    std::vector<unsigned char> malformed = journal.getLog();
+    malformed.resize(malformed.size() - 1);
+    ManagerType failed;
+    EXPECT_FALSE(failed.replayJournal(malformed));
+
+    manager.setJournal(nullptr);
+}
+
+TEST(EC, TraceReplay)
+{
+    using ManagerType = EC::Manager<ListComponentsAll, ListTagsAll>;
+    ManagerType manager;
+    for(int i = 0; i < 100; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i);
+        if(i % 2 == 0)
+        {
+            manager.addComponent<C1>(eid);
+        }
+    }
+
+    // Attaching the Journal records the existing Entities.
+    EC::Journal journal;
+    journal.setRecordQueries(true);
+    manager.setJournal(&journal);
+
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        [] (std::size_t /* id */, void* /* context */, C0* c0) {
+            ++c0->x;
+        });
+    for(int tick = 0; tick < 3; ++tick)
+    {
+        manager.forMatchingSignature<EC::Meta::TypeList<C0, C1> >(
+            [] (std::size_t /* id */, void* /* context */,
+                C0* /* c0 */, C1* /* c1 */) {}, nullptr, 2);
+        manager.callForMatchingFunctions();
+        manager.deleteEntity(tick * 2);
+    }
+    manager.setJournal(nullptr);
+    journal.flush();
+
+    ManagerType replayed;
+    EC::TraceReplayResult result = EC::replayTrace(replayed, journal.getLog());
+    EXPECT_TRUE(result.valid);
+    EXPECT_EQ(6u, result.queryCount);
+    ASSERT_EQ(2u, result.queries.size());
+    EXPECT_EQ("C0", result.queries[0].signature);
+    EXPECT_EQ("C0 C1", result.queries[1].signature);
+    EXPECT_EQ(3u, result.queries[1].calls);
+    EXPECT_EQ(50u + 49u + 48u, result.queries[1].recordedEntities);
+    for(const auto& query : result.queries)
+    {
+        EXPECT_EQ(query.recordedEntities, query.replayedEntities);
+    }
+    EXPECT_EQ(97u, replayed.getCurrentSize());
+
+    // With a smaller grain size the recorded queries split across threads.
+    ManagerType split;
+    split.setGrainSize(10);
+    result = EC::replayTrace(split, journal.getLog());
+    EXPECT_TRUE(result.valid);
+    ASSERT_EQ(2u, result.queries.size());
+    for(const auto& query : result.queries)
+    {
+        EXPECT_EQ(query.recordedEntities, query.replayedEntities);
+    }
+
+    // Recovery ignores recorded queries.
+    ManagerType recovered;
+    EXPECT_TRUE(recovered.replayJournal(journal.getLog()));
+    EXPECT_EQ(97u, recovered.getCurrentSize());
+
+    // Replayed queries go through the Manager's query path.
+    auto signature = ManagerType::BitsetType::template generateBitset<
+        EC::Meta::TypeList<C0, C1> >();
+    std::atomic_size_t calls(0);
+    recovered.setGrainSize(10);
+    EXPECT_EQ(47u, recovered.forMatchingBitset(signature,
+        [&recovered, &calls] (std::size_t id) {
+            EXPECT_TRUE(recovered.hasComponent<C1>(id));
+            ++calls;
+        }, 3));
+    EXPECT_EQ(47u, calls);
+}
+
+TEST(EC, QueryPlanner)
+{
+    using ManagerType = EC::Manager<ListComponentsAll, ListTagsAll>;
+    ManagerType manager;
+
+    auto expectMatches = [&manager] () {
+        for(std::size_t threadCount : {1u, 3u})
+        {
+            std::vector<std::atomic<int> > visits(
+                manager.getCurrentCapacity());
+            manager.forMatchingSignature<EC::Meta::TypeList<C0, C1, T1> >(
+                [&visits] (std::size_t id, void* /* context */,
+                    C0* /* c0 */, C1* /* c1 */) {
+                    ++visits[id];
+                }, nullptr, threadCount);
+            for(std::size_t i = 0; i < visits.size(); ++i)
+            {
+                bool expected = manager.isAlive(i)
+                    && manager.hasComponent<C0>(i)
+                    && manager.hasComponent<C1>(i)
+                    && manager.hasTag<T1>(i);
+                EXPECT_EQ(expected ? 1 : 0, visits[i].load()) << i;
+            }
+        }
+    };
+
+    for(std::size_t i = 0; i < 1000; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid);
+        manager.addComponent<C1>(eid);
+        if(i % 97 == 5)
+        {
+            manager.addTag<T1>(eid);
+        }
+    }
+    expectMatches();
+
+    manager.deleteEntity(5);
+    manager.removeComponent<C1>(102);
+    manager.addTag<T1>(999);
+    manager.addTag<T1>(0);
+    manager.removeComponent<C0>(0);
+    expectMatches();
+
+    // No Entity has T0, so nothing is visited.
+    std::size_t count = 0;
+    manager.forMatchingSignature<EC::Meta::TypeList<C0, T0> >(
+        [&count] (std::size_t /* id */, void* /* context */, C0* /* c0 */) {
+            ++count;
+        });
+    EXPECT_EQ(0u, count);
+
+    // Entities matching later in the same word may be changed by the
+    // function and are checked again: the odd ids but 5 are visited, and 6.
+    manager.forMatchingSignature<EC::Meta::TypeList<C0, C1> >(
+        [&manager, &count] (std::size_t id, void* /* context */,
+            C0* /* c0 */, C1* /* c1 */) {
+            ++count;
+            if(id % 2 == 1)
+            {
+                manager.removeComponent<C1>(id + 1);
+            }
+        });
+    EXPECT_EQ(500u, count);
+
+    ManagerType::StagingBuffer staging;
+    for(int i = 0; i < 10; ++i)
+    {
+        auto index = staging.addEntity();
+        staging.addComponent<C0>(index);
+        staging.addComponent<C1>(index);
+        staging.addTag<T1>(index);
+    }
+    manager.commitStaging(staging);
+    expectMatches();
+
+    ManagerType loaded;
+    EXPECT_TRUE(loaded.loadSnapshot(manager.saveSnapshot()));
+    std::swap(manager, loaded);
+    expectMatches();
+
+    manager.reset();
+    expectMatches();
+}
+
+TEST(EC, StoredFunctionSharedMatching)
+{
+    using ManagerType = EC::Manager<ListComponentsAll, ListTagsAll>;
+    ManagerType manager;
+    for(std::size_t i = 0; i < 500; ++i)
+    {
+        auto eid = manager.addEntity();
+        if(i % 2 == 0)
+        {
+            manager.addComponent<C0>(eid);
+        }
+        if(i % 3 == 0)
+        {
+            manager.addComponent<C1>(eid);
+        }
+        if(i % 50 == 0)
+        {
+            manager.addTag<T0>(eid);
+        }
+    }
+    manager.deleteEntity(6);
+
+    // Counts calls per Entity for each stored function.
+    std::vector<std::vector<std::atomic<int> > > calls;
+    for(int i = 0; i < 6; ++i)
+    {
+        calls.emplace_back(manager.getCurrentCapacity());
+    }
+    auto counter = [&calls] (std::size_t index) {
+        return [&calls, index] (std::size_t id, void* /* context */,
+            auto*... /* components */) {
+            ++calls[index][id];
+        };
+    };
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(counter(0));
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(counter(1));
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0, C1> >(counter(2));
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0, C1, T0> >(
+        counter(3));
+    manager.addForMatchingFunction<EC::Meta::TypeList<C1, C0> >(counter(4));
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0, T1> >(counter(5));
+
+    for(std::size_t threadCount : {1u, 3u})
+    {
+        for(auto& functionCalls : calls)
+        {
+            for(auto& count : functionCalls)
+            {
+                count = 0;
+            }
+        }
+        manager.callForMatchingFunctions(threadCount);
+        for(std::size_t i = 0; i < manager.getCurrentCapacity(); ++i)
+        {
+            bool alive = manager.isAlive(i);
+            bool c0 = alive && manager.hasComponent<C0>(i);
+            bool c0c1 = c0 && manager.hasComponent<C1>(i);
+            EXPECT_EQ(c0 ? 1 : 0, calls[0][i].load());
+            EXPECT_EQ(c0 ? 1 : 0, calls[1][i].load());
+            EXPECT_EQ(c0c1 ? 1 : 0, calls[2][i].load());
+            EXPECT_EQ(c0c1 && manager.hasTag<T0>(i) ? 1 : 0,
+                calls[3][i].load());
+            EXPECT_EQ(c0c1 ? 1 : 0, calls[4][i].load());
+            EXPECT_EQ(0, calls[5][i].load());
+        }
+    }
+}
+
+TEST(EC, DispatchMatching)
+{
+    using ManagerType = EC::Manager<ListComponentsAll, ListTagsAll>;
+    ManagerType manager;
+    for(std::size_t i = 0; i < 1000; ++i)
+    {
+        auto eid = manager.addEntity();
+        if(i % 4 != 0)
+        {
+            manager.addComponent<C0>(eid);
+        }
+        if(i % 3 != 0)
+        {
+            manager.addComponent<C1>(eid);
+        }
+        if(i % 5 == 0)
+        {
+            manager.addTag<T0>(eid);
+        }
+    }
+    manager.deleteEntity(1);
+
+    using namespace EC::Meta;
+    for(std::size_t threadCount : {1u, 4u})
+    {
+        std::vector<std::atomic<int> > c0Calls(manager.getCurrentCapacity());
+        std::vector<std::atomic<int> > c1Calls(manager.getCurrentCapacity());
+        std::vector<std::atomic<int> > bothCalls(
+            manager.getCurrentCapacity());
+        std::vector<std::atomic<int> > tagCalls(manager.getCurrentCapacity());
+        manager.forMatchingSignatures<TypeList<TypeList<C0>, TypeList<C1>,
+            TypeList<C1, C0>, TypeList<T0> > >(
+            std::make_tuple(
+                [&c0Calls] (std::size_t id, void* /* context */,
+                    C0* /* c0 */) {
+                    ++c0Calls[id];
+                },
+                [&c1Calls] (std::size_t id, void* /* context */,
+                    C1* /* c1 */) {
+                    ++c1Calls[id];
+                },
+                [&bothCalls] (std::size_t id, void* /* context */,
+                    C1* /* c1 */, C0* /* c0 */) {
+                    ++bothCalls[id];
+                },
+                [&tagCalls] (std::size_t id, void* /* context */) {
+                    ++tagCalls[id];
+                }),
+            nullptr, threadCount);
+
+        // Stored functions with two unrelated dense signatures are matched
+        // in one pass.
+        std::vector<std::atomic<int> > storedCalls(
+            manager.getCurrentCapacity());
+        manager.clearForMatchingFunctions();
+        manager.addForMatchingFunction<TypeList<C0> >(
+            [&storedCalls] (std::size_t id, void* /* context */,
+                C0* /* c0 */) {
+                ++storedCalls[id];
+            });
+        manager.addForMatchingFunction<TypeList<C1> >(
+            [&storedCalls] (std::size_t id, void* /* context */,
+                C1* /* c1 */) {
+                storedCalls[id] += 2;
+            });
+        manager.callForMatchingFunctions(threadCount);
+
+        for(std::size_t i = 0; i < manager.getCurrentCapacity(); ++i)
+        {
+            bool c0 = manager.isAlive(i) && manager.hasComponent<C0>(i);
+            bool c1 = manager.isAlive(i) && manager.hasComponent<C1>(i);
+            bool t0 = manager.isAlive(i) && manager.hasTag<T0>(i);
+            EXPECT_EQ(c0 ? 1 : 0, c0Calls[i].load());
+            EXPECT_EQ(c1 ? 1 : 0, c1Calls[i].load());
+            EXPECT_EQ(c0 && c1 ? 1 : 0, bothCalls[i].load());
+            EXPECT_EQ(t0 ? 1 : 0, tagCalls[i].load());
+            EXPECT_EQ((c0 ? 1 : 0) + (c1 ? 2 : 0), storedCalls[i].load());
+        }
+    }
+}
+
+TEST(EC, ColumnExpression)
+{
+    struct Position
+    {
+        float x, y;
+    };
+    struct Velocity
+    {
+        float x, y;
+    };
+    struct Health
+    {
+        float value;
+    };
+    using ManagerType = EC::Manager<
+        EC::Meta::TypeList<Position, Velocity, Health>,
+        EC::Meta::TypeList<T0> >;
+
+    auto x = EC_FIELD(&Position::x);
+    auto y = EC_FIELD(&Position::y);
+    auto vx = EC_FIELD(&Velocity::x);
+    // Known at run time only.
+    auto vy = EC::field(&Velocity::y);
+    auto health = EC::field(&Health::value);
+
+    for(std::size_t threadCount : {1u, 3u})
+    {
+        ManagerType manager;
+        // A long run of moving Entities, followed by sparse ones.
+        for(std::size_t i = 0; i < 1000; ++i)
+        {
+            auto eid = manager.addEntity();
+            manager.addComponent<Position>(eid, Position{float(i), 1.0f});
+            if(i < 500 || i % 3 == 0)
+            {
+                manager.addComponent<Velocity>(
+                    eid, Velocity{2.0f, float(i % 7)});
+            }
+            manager.addComponent<Health>(eid, Health{float(i) - 100.0f});
+            if(i % 2 == 0)
+            {
+                manager.addTag<T0>(eid);
+            }
+        }
+        manager.deleteEntity(10);
+
+        const float dt = 0.5f;
+        manager.forMatchingExpression(EC::sequence(
+            x += vx * dt,
+            y = y + vy * dt - 1.0f),
+            threadCount);
+        manager.forMatchingExpression<EC::Meta::TypeList<T0> >(
+            health = EC::clamp(-health * 2.0f, 0.0f, 100.0f),
+            threadCount);
+
+        for(std::size_t i = 0; i < 1000; ++i)
+        {
+            if(i == 10)
+            {
+                continue;
+            }
+            bool moving = i < 500 || i % 3 == 0;
+            const Position* position = manager.getEntityData<Position>(i);
+            EXPECT_EQ(moving ? float(i) + 1.0f : float(i), position->x);
+            EXPECT_EQ(moving ? float(i % 7) * 0.5f : 1.0f, position->y);
+
+            float expectedHealth = float(i) - 100.0f;
+            if(i % 2 == 0)
+            {
+                expectedHealth = std::min(std::max(
+                    -expectedHealth * 2.0f, 0.0f), 100.0f);
+            }
+            EXPECT_EQ(expectedHealth, manager.getEntityData<Health>(i)->value);
+        }
+        EXPECT_EQ(float(10), manager.getEntityData<Position>(10)->x);
+    }
+}
+
+TEST(EC, FusedComponents)
+{
+    struct Position
+    {
+        float x, y;
+    };
+    struct Velocity
+    {
+        float x, y;
+    };
+    struct Health
+    {
+        int value;
+    };
+    using Motion = EC::Fused<Position, Velocity>;
+    using FusedManager = EC::Manager<
+        EC::Meta::TypeList<Motion, Health>,
+        EC::Meta::TypeList<T0> >;
+    using PlainManager = EC::Manager<
+        EC::Meta::TypeList<Position, Velocity, Health>,
+        EC::Meta::TypeList<T0> >;
+    static_assert(std::is_same<FusedManager::Components,
+        PlainManager::Components>::value, "");
+
+    FusedManager manager;
+    for(int i = 0; i < 100; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<Position>(eid, Position{float(i), 0.0f});
+        if(i % 2 == 0)
+        {
+            manager.addComponent<Velocity>(eid, Velocity{1.0f, 2.0f});
+        }
+        manager.addComponent<Health>(eid, Health{i});
+    }
+    manager.removeComponent<Position>(4);
+    EXPECT_FALSE(manager.hasComponent<Position>(4));
+    EXPECT_TRUE(manager.hasComponent<Velocity>(4));
+
+    manager.forMatchingSignature<EC::Meta::TypeList<Position, Velocity> >(
+        [] (std::size_t /* id */, void* /* context */,
+            Position* position, Velocity* velocity)
+        {
+            position->x += velocity->x;
+            position->y += velocity->y;
+        });
+    auto vx = EC_FIELD(&Velocity::x);
+    manager.forMatchingExpression(vx *= 3.0f);
+
+    // The interleaved column and the strided view of one of its Components.
+    auto rows = manager.getColumn<Motion>();
+    auto positions = manager.getColumn<Position>();
+    EXPECT_EQ(sizeof(Motion), positions.stride);
+    EXPECT_EQ(&rows[6].get<Position>(), &positions[6]);
+    EXPECT_EQ(manager.getEntityData<Velocity>(6),
+        &rows[6].get<Velocity>());
+    for(int i = 0; i < 100; ++i)
+    {
+        bool moved = i % 2 == 0 && i != 4;
+        EXPECT_EQ(moved ? float(i) + 1.0f : float(i), positions[i].x);
+        EXPECT_EQ(moved ? 2.0f : 0.0f, positions[i].y);
+        if(i % 2 == 0)
+        {
+            EXPECT_EQ(3.0f, manager.getEntityData<Velocity>(i)->x);
+        }
+    }
+
+    FusedManager::StagingBuffer staging;
+    staging.addComponent<Velocity>(staging.addEntity(), Velocity{5.0f, 6.0f});
+    manager.commitStaging(staging);
+    EXPECT_EQ(6.0f, manager.getEntityData<Velocity>(100)->y);
+
+    // Snapshots hold one column per Component, fused or not.
+    PlainManager plain;
+    ASSERT_TRUE(plain.loadSnapshot(manager.saveSnapshot()));
+    FusedManager loaded;
+    ASSERT_TRUE(loaded.loadSnapshot(plain.saveSnapshot(2)));
+    ASSERT_TRUE(loaded.loadSnapshot(manager.saveSnapshotAsync().get()));
+    for(std::size_t i = 0; i < 101; ++i)
+    {
+        EXPECT_EQ(manager.hasComponent<Position>(i),
+            plain.hasComponent<Position>(i));
+        EXPECT_EQ(manager.getEntityData<Position>(i)->x,
+            plain.getEntityData<Position>(i)->x);
+        EXPECT_EQ(manager.getEntityData<Velocity>(i)->y,
+            loaded.getEntityData<Velocity>(i)->y);
+        EXPECT_EQ(manager.getEntityData<Health>(i)->value,
+            loaded.getEntityData<Health>(i)->value);
+    }
+}
+
+TEST(EC, AutoThreadCount)
+{
+    // Before any measurement, only very large workloads are split.
+    EC::CostEstimate estimate;
+    EXPECT_EQ(1u, estimate.chooseThreadCount(1000, 8));
+    EXPECT_EQ(8u, estimate.chooseThreadCount(100000000, 8));
+    // 1 ms for 1000 Entities pays for sqrt(1 ms / 20 us) = 7 threads.
+    estimate.record(1000, 1, 1e-3);
+    EXPECT_EQ(7u, estimate.chooseThreadCount(1000, 8));
+    EXPECT_EQ(4u, estimate.chooseThreadCount(1000, 4));
+    EXPECT_EQ(1u, estimate.chooseThreadCount(10, 8));
+
+    EC::ThreadPool pool(3);
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+    manager.setExecutor(&pool);
+    manager.setAutoThreadLimit(4);
+    for(std::size_t i = 0; i < 2000; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid);
+        if(i < 10)
+        {
+            manager.addTag<T0>(eid);
+        }
+    }
+
+    std::mutex mutex;
+    std::set<std::thread::id> threadIds;
+    std::atomic<std::size_t> calls(0);
+    auto visit = [&mutex, &threadIds, &calls] ()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        threadIds.insert(std::this_thread::get_id());
+        ++calls;
+    };
+
+    // A small query runs on the calling thread.
+    manager.forMatchingSignature<EC::Meta::TypeList<C0, T0> >(
+        [&visit] (std::size_t, void*, C0*) { visit(); },
+        nullptr, EC::AutoThreadCount);
+    EXPECT_EQ(10u, calls.load());
+    EXPECT_EQ(1u, threadIds.size());
+    EXPECT_EQ(1u, threadIds.count(std::this_thread::get_id()));
+
+    // An expensive stored function is measured serially, then split.
+    auto expensive = manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        [&visit] (std::size_t, void*, C0*) {
+            auto end = std::chrono::steady_clock::now()
+                + std::chrono::microseconds(5);
+            while(std::chrono::steady_clock::now() < end)
+            {
+            }
+            visit();
+        });
+    manager.changeForMatchingFunctionGrainSize(expensive, 16);
+    calls = 0;
+    threadIds.clear();
+    manager.callForMatchingFunctions(EC::AutoThreadCount);
+    EXPECT_EQ(2000u, calls.load());
+    EXPECT_EQ(1u, threadIds.size());
+    calls = 0;
+    threadIds.clear();
+    manager.callForMatchingFunctions(EC::AutoThreadCount);
+    EXPECT_EQ(2000u, calls.load());
+    EXPECT_LT(1u, threadIds.size());
+}
+
+TEST(EC, Executor)
+{
+    EC::ThreadPool pool(2);
+    EXPECT_EQ(2u, pool.getWorkerCount());
+    std::atomic<std::size_t> sum(0);
+    pool.parallelFor(3, [&pool, &sum] (std::size_t i) {
+        // Tasks may use the pool too.
+        pool.parallelFor(100, [&sum, i] (std::size_t j) {
+            sum += i * 100 + j;
+        });
+    });
+    EXPECT_EQ(299u * 300u / 2u, sum.load());
+    // Workers are capped, and claim the tasks beyond them when free.
+    EXPECT_EQ(2u, pool.getWorkerCount());
+    std::size_t hardwareThreads = std::thread::hardware_concurrency();
+    EC::ThreadPool& defaultPool = EC::ThreadPool::getDefault();
+    defaultPool.parallelFor(hardwareThreads + 8, [&sum] (std::size_t) {
+        ++sum;
+    });
+    EXPECT_GE(hardwareThreads > 1 ? hardwareThreads - 1 : 0,
+        defaultPool.getWorkerCount());
+
+    std::promise<std::thread::id> ranOn;
+    pool.runInBackground([&ranOn] () {
+        ranOn.set_value(std::this_thread::get_id());
+    });
+    EXPECT_NE(std::this_thread::get_id(), ranOn.get_future().get());
+
+    // A job system with one worker, adapted to the Manager.
+    std::mutex mutex;
+    std::condition_variable available;
+    std::deque<std::function<void()> > jobs;
+    bool stopping = false;
+    std::size_t submitted = 0;
+    std::thread worker([&] () {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            available.wait(lock, [&] () {
+                return stopping || !jobs.empty();
+            });
+            if(jobs.empty())
+            {
+                return;
+            }
+            std::function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    });
+    EC::SubmitExecutor executor([&] (std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            jobs.push_back(std::move(job));
+            ++submitted;
+        }
+        available.notify_one();
+    });
+
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+    manager.setExecutor(&executor);
+    manager.setGrainSize(1);
+    for(int i = 0; i < 1000; ++i)
+    {
+        manager.addComponent<C0>(manager.addEntity(), i, 0);
+    }
+    manager.forMatchingSignature<EC::Meta::TypeList<C0> >(
+        [] (std::size_t, void*, C0* c0) { ++c0->y; }, nullptr, 4);
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        [] (std::size_t, void*, C0* c0) { ++c0->y; });
+    manager.callForMatchingFunctions(3);
+    EXPECT_EQ(3u + 2u + 2u, submitted);
+
+    EC::Manager<ListComponentsAll, ListTagsAll> loaded;
+    loaded.setExecutor(&executor);
+    ASSERT_TRUE(loaded.loadSnapshot(manager.saveSnapshot(2), 2));
+    for(std::size_t i = 0; i < 1000; ++i)
+    {
+        EXPECT_EQ(int(i), loaded.getEntityData<C0>(i)->x);
+        EXPECT_EQ(2, loaded.getEntityData<C0>(i)->y);
+    }
+
+    // Asynchronous snapshots are encoded by the job system too.
+    submitted = 0;
+    auto snapshot = manager.saveSnapshotAsync();
+    EXPECT_EQ(manager.saveSnapshot(), snapshot.get());
+    EXPECT_EQ(1u, submitted);
+
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+    }
+    available.notify_one();
+    worker.join();
+}
+
+TEST(EC, ConstQueries)
+{
+    EC::Manager<EC::Meta::TypeList<C0, C1, Target>, ListTagsAll> manager;
+    for(int i = 0; i < 1000; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i, 1);
+        if(i % 2 == 0)
+        {
+            manager.addComponent<C1>(eid, C1{i, 0});
+            manager.addComponent<Target>(eid, Target(i + 1));
+        }
+    }
+    manager.setAutoThreadLimit(2);
+    const auto& reader = manager;
+
+    // Several read-only systems query the Manager at the same time.
+    std::vector<std::thread> systems;
+    std::vector<long> sums(4, 0);
+    for(std::size_t k = 0; k < sums.size(); ++k)
+    {
+        systems.emplace_back([&reader, &sums, k] () {
+            std::mutex mutex;
+            long sum = 0;
+            reader.forMatchingSignature<EC::Meta::TypeList<C0, C1> >(
+                [&mutex, &sum] (std::size_t, void*,
+                    const C0* c0, const C1* c1)
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    sum += c0->x + c1->vx;
+                }, nullptr, k == 0 ? EC::AutoThreadCount : k);
+            reader.forMatchingSignatures<EC::Meta::TypeList<
+                EC::Meta::TypeList<C0>, EC::Meta::TypeList<C1> > >(
+                std::make_tuple(
+                    [&mutex, &sum] (std::size_t, void*, const C0* c0) {
+                        std::lock_guard<std::mutex> guard(mutex);
+                        sum += c0->y;
+                    },
+                    [] (std::size_t, void*, const C1*) {}),
+                nullptr, k + 1);
+            reader.forMatchingRelation<EC::Meta::TypeList<>, Target,
+                EC::Meta::TypeList<C0> >(
+                [&mutex, &sum] (std::size_t, std::size_t, void*,
+                    const C0* target)
+                {
+                    std::lock_guard<std::mutex> guard(mutex);
+                    sum += target->x;
+                });
+            sums[k] = sum;
+        });
+    }
+    for(auto& system : systems)
+    {
+        system.join();
+    }
+    // Even ids: x + vx = 2 * i, all ids: y = 1, targets of even ids: i + 1.
+    long expected = 0;
+    for(long i = 0; i < 1000; i += 2)
+    {
+        expected += 2 * i + (i + 1);
+    }
+    expected += 1000;
+    for(long sum : sums)
+    {
+        EXPECT_EQ(expected, sum);
+    }
+
+    // Queries on a freshly changed plane all see its new count.
+    for(std::size_t round = 0; round < 20; ++round)
+    {
+        manager.addTag<T0>(round * 7);
+        std::vector<std::size_t> counts(4, 0);
+        systems.clear();
+        for(std::size_t k = 0; k < counts.size(); ++k)
+        {
+            systems.emplace_back([&reader, &counts, k] () {
+                reader.forMatchingSignature<EC::Meta::TypeList<T0> >(
+                    [&counts, k] (std::size_t, void*) {
+                        ++counts[k];
+                    });
+            });
+        }
+        for(auto& system : systems)
+        {
+            system.join();
+        }
+        for(std::size_t count : counts)
+        {
+            EXPECT_EQ(round + 1, count);
+        }
+    }
+}
+
+TEST(EC, Inbox)
+{
+    struct Health
+    {
+        int value;
+    };
+    EC::Manager<EC::Meta::TypeList<C0, Health>, ListTagsAll> manager;
+    for(int i = 0; i < 3000; ++i)
+    {
+        auto eid = manager.addEntity();
+        manager.addComponent<C0>(eid, i, 0);
+        if(i != 7)
+        {
+            manager.addComponent<Health>(eid, Health{0});
+        }
+    }
+    manager.deleteEntity(8);
+
+    // Each Entity damages the next three, from several threads at once.
+    EC::Inbox<Health, int> damage;
+    for(int tick = 0; tick < 2; ++tick)
+    {
+        manager.forMatchingSignature<EC::Meta::TypeList<C0> >(
+            [&damage] (std::size_t id, void*, C0* c0) {
+                for(std::size_t k = 1; k <= 3; ++k)
+                {
+                    damage.post((id + k) % 3000, c0->x);
+                }
+            }, nullptr, 4);
+        EXPECT_EQ(2999u * 3u, damage.size());
+        std::size_t delivered = manager.deliverMessages(damage,
+            [] (std::size_t, Health* health, int& amount) {
+                health->value += amount;
+            }, tick == 0 ? 1 : 3);
+        // Messages to 7 (no Health) and 8 (deleted) are dropped.
+        EXPECT_EQ(2999u * 3u - 6u, delivered);
+        EXPECT_EQ(0u, damage.size());
+    }
+
+    for(std::size_t id = 0; id < 3000; ++id)
+    {
+        if(id == 7 || id == 8)
+        {
+            continue;
+        }
+        int expected = 0;
+        for(std::size_t k = 1; k <= 3; ++k)
+        {
+            std::size_t source = (id + 3000 - k) % 3000;
+            expected += source == 8 ? 0 : int(source);
+        }
+        EXPECT_EQ(2 * expected, manager.getEntityData<Health>(id)->value);
+    }
+}
+
+TEST(EC, DeferredDeletion)
+{
+    EC::Manager<ListComponentsAll, ListTagsAll> deferred;
+    EC::Manager<ListComponentsAll, ListTagsAll> immediate;
+    for(int i = 0; i < 1000; ++i)
+    {
+        for(auto* manager : {&deferred, &immediate})
+        {
+            auto eid = manager->addEntity();
+            manager->addComponent<C0>(eid, i, 0);
+            if(i % 2 == 0)
+            {
+                manager->addTag<T0>(eid);
+            }
+        }
+    }
+    deferred.deleteEntity(5);
+    immediate.deleteEntity(5);
+
+    // Every third Entity and the last hundred, marked while iterating.
+    std::atomic<int> visited(0);
+    deferred.forMatchingSignature<EC::Meta::TypeList<C0> >(
+        [&deferred, &visited] (std::size_t id, void*, C0* c0) {
+            ++visited;
+            if(c0->x % 3 == 0 || c0->x >= 900)
+            {
+                deferred.markForDeletion(id);
+                deferred.markForDeletion(id);
+            }
+        }, nullptr, 4);
+    deferred.markForDeletion(5);
+    EXPECT_EQ(999, visited);
+    EXPECT_TRUE(deferred.isAlive(3));
+    EXPECT_EQ(999u, deferred.getCurrentSize());
+
+    std::size_t expected = 0;
+    for(std::size_t id = 0; id < 1000; ++id)
+    {
+        if(id != 5 && (id % 3 == 0 || id >= 900))
+        {
+            immediate.deleteEntity(id);
+            ++expected;
+        }
+    }
+    EXPECT_EQ(expected, deferred.flushDeletions());
+    EXPECT_EQ(0u, deferred.getPendingDeletionCount());
+    EXPECT_EQ(0u, deferred.flushDeletions());
+
+    EXPECT_EQ(immediate.getCurrentSize(), deferred.getCurrentSize());
+    for(std::size_t id = 0; id < 1000; ++id)
+    {
+        EXPECT_EQ(immediate.isAlive(id), deferred.isAlive(id));
+    }
+    int tagged = 0;
+    deferred.forMatchingSignature<EC::Meta::TypeList<T0> >(
+        [&tagged] (std::size_t id, void*) {
+            EXPECT_NE(0u, id % 3);
+            ++tagged;
+        });
+    int expectedTagged = 0;
+    immediate.forMatchingSignature<EC::Meta::TypeList<T0> >(
+        [&expectedTagged] (std::size_t, void*) {
+            ++expectedTagged;
+        });
+    EXPECT_EQ(expectedTagged, tagged);
+
+    // Freed ids are reused lowest first, as after deleteEntity().
+    for(int i = 0; i < 5; ++i)
+    {
+        EXPECT_EQ(immediate.addEntity(), deferred.addEntity());
+    }
+}
+
+TEST(EC, TimingWheel)
+{
+    // Expiries across several levels come out in order, on their tick.
+    EC::TimingWheel<std::uint64_t> wheel;
+    std::vector<std::uint64_t> delays{1, 2, 63, 64, 65, 4095, 4096, 4097,
+        300000, 1, 0};
+    for(auto delay : delays)
+    {
+        wheel.schedule(delay, delay == 0 ? 1 : delay);
+    }
+    std::vector<std::uint64_t> fired;
+    std::size_t expired = 0;
+    for(int step = 0; step < 3000; ++step)
+    {
+        expired += wheel.advance(step % 3 == 0 ? 7 : 150,
+            [&wheel, &fired] (std::uint64_t& due) {
+                EXPECT_EQ(due, wheel.getTick());
+                fired.push_back(due);
+            });
+    }
+    EXPECT_EQ(delays.size(), expired);
+    EXPECT_EQ(0u, wheel.size());
+    EXPECT_TRUE(std::is_sorted(fired.begin(), fired.end()));
+
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+    for(int i = 0; i < 1000; ++i)
+    {
+        manager.addEntity();
+    }
+    for(std::size_t id = 0; id < 1000; ++id)
+    {
+        if(id % 10 == 0)
+        {
+            manager.scheduleDeletion(id, 100 + id);
+        }
+        else if(id % 10 == 1)
+        {
+            manager.scheduleTag<T1>(id, 50);
+        }
+        else if(id % 10 == 2)
+        {
+            manager.scheduleExpiration(id, 200);
+            manager.scheduleExpiration(id, 300);
+        }
+    }
+    manager.cancelTimers(2);
+    // Deleted Entities, even with their id reused, drop their timers.
+    manager.deleteEntity(12);
+    manager.deleteEntity(22);
+    EXPECT_EQ(12u, manager.addEntity());
+
+    std::vector<std::size_t> called;
+    auto record = [&called] (std::size_t id) { called.push_back(id); };
+    EXPECT_EQ(0u, manager.advanceTimers(49, record));
+    EXPECT_EQ(100u, manager.advanceTimers(1, record));
+    EXPECT_TRUE(manager.hasTag<T1>(1));
+    EXPECT_FALSE(manager.hasTag<T1>(2));
+
+    EXPECT_EQ(6u, manager.advanceTimers(100, record));
+    EXPECT_FALSE(manager.isAlive(0));
+    EXPECT_FALSE(manager.isAlive(50));
+    EXPECT_TRUE(manager.isAlive(60));
+    EXPECT_TRUE(called.empty());
+
+    EXPECT_EQ(107u, manager.advanceTimers(100, record));
+    EXPECT_EQ(97u, called.size());
+    EXPECT_EQ(32u, called.front());
+    EXPECT_EQ(250u, manager.getTimerTick());
+    // Without a function, the expirations at tick 300 are only dropped.
+    EXPECT_EQ(97u + 84u, manager.advanceTimers(900));
+    EXPECT_EQ(97u, called.size());
+    for(std::size_t id = 0; id < 1000; ++id)
+    {
+        EXPECT_EQ(id % 10 != 0 && id != 22, manager.isAlive(id));
+    }
+}
+
+TEST(EC, Phases)
+{
+    for(std::size_t threadCount : {std::size_t(1), std::size_t(4)})
+    {
+        EC::ThreadPool pool(3);
+        EC::Manager<ListComponentsAll, ListTagsAll> manager;
+        manager.setExecutor(&pool);
+        for(int i = 0; i < 1000; ++i)
+        {
+            auto eid = manager.addEntity();
+            manager.addComponent<C0>(eid, i, 0);
+            manager.addComponent<C1>(eid, C1{0, 0});
+        }
+
+        std::atomic<int> running(0);
+        std::atomic<int> overlapped(0);
+        auto enter = [&running, &overlapped] () {
+            if(running++ > 0)
+            {
+                ++overlapped;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            --running;
+        };
+
+        // Phase 1 runs first, although it was added after phase 2.
+        manager.addForMatchingFunction<EC::Meta::TypeList<C0, C1> >(
+            [] (std::size_t, void*, C0* c0, C1* c1) {
+                EXPECT_EQ(c0->x + 1, c0->y);
+                EXPECT_EQ(1, c1->vx);
+            }, nullptr, 0, 2);
+        manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+            [&manager, &enter] (std::size_t id, void*, C0* c0) {
+                if(id == 0)
+                {
+                    enter();
+                }
+                c0->y = c0->x + 1;
+                if(c0->x % 2 == 0)
+                {
+                    manager.markForDeletion(id);
+                }
+            }, nullptr, 0, 1);
+        manager.addForMatchingFunction<EC::Meta::TypeList<C1> >(
+            [&enter] (std::size_t id, void*, C1* c1) {
+                if(id == 0)
+                {
+                    enter();
+                }
+                c1->vx = 1;
+            }, nullptr, 0, 1);
+
+        std::vector<int> barriers;
+        manager.callForMatchingFunctionPhases(threadCount,
+            [&manager, &barriers] (int phase) {
+                barriers.push_back(phase);
+                EXPECT_EQ(0u, manager.getPendingDeletionCount());
+                EXPECT_EQ(500u, manager.getCurrentSize());
+            });
+        EXPECT_EQ(std::vector<int>({1, 2}), barriers);
+        // Functions of a phase only overlap when called with threads.
+        EXPECT_EQ(threadCount == 1 ? 0 : 1, overlapped);
+    }
+
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+    manager.addComponent<C0>(manager.addEntity());
+    std::vector<int> order;
+    auto first = manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        [&order] (std::size_t, void*, C0*) { order.push_back(0); });
+    manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(
+        [&order] (std::size_t, void*, C0*) { order.push_back(1); },
+        nullptr, 5);
+    EXPECT_TRUE(manager.changeForMatchingFunctionPhase(first, 1));
+    EXPECT_FALSE(manager.changeForMatchingFunctionPhase(first + 2, 1));
+    manager.callForMatchingFunctions();
+    EXPECT_EQ(std::vector<int>({1, 0}), order);
+}
+
+TEST(EC, WorkerSettings)
+{
+    EC::ThreadPool::WorkerSettings settings;
+    std::vector<std::size_t> cpus;
+    for(std::size_t cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu)
+    {
+        cpus.push_back(cpu);
+    }
+    settings.affinity.push_back(cpus);
+    settings.name = "ec-worker-";
+    settings.niceness = 1;
+    settings.stableAssignment = true;
+    EC::ThreadPool pool(3, settings);
+
+    // Each task index keeps running on the same thread, also when the
+    // Manager splits its ranges the same way every tick.
+    std::vector<std::thread::id> threads(4);
+    std::mutex mutex;
+    std::vector<std::string> names;
+    for(int tick = 0; tick < 50; ++tick)
+    {
+        pool.parallelFor(4, [&] (std::size_t i) {
+            if(tick == 0)
+            {
+                threads[i] = std::this_thread::get_id();
+#if defined(__linux__)
+                char name[16] = {};
+                pthread_getname_np(pthread_self(), name, sizeof(name));
+                std::lock_guard<std::mutex> guard(mutex);
+                names.push_back(name);
+#endif
+            }
+            else
+            {
+                EXPECT_EQ(threads[i], std::this_thread::get_id());
+            }
+            // Nested calls from workers are balanced, and finish.
+            std::atomic<int> nested(0);
+            pool.parallelFor(3, [&nested] (std::size_t) { ++nested; });
+            EXPECT_EQ(3, nested);
+        });
+    }
+    EXPECT_EQ(threads[0], std::this_thread::get_id());
+    EXPECT_EQ(0u, pool.getSettingFailureCount());
+#if defined(__linux__)
+    std::sort(names.begin(), names.end());
+    EXPECT_EQ(4u, names.size());
+    EXPECT_EQ("ec-worker-0", names[1]);
+    EXPECT_EQ("ec-worker-2", names[3]);
+#endif
+
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+    manager.setExecutor(&pool);
+    for(int i = 0; i < 1000; ++i)
+    {
+        manager.addComponent<C0>(manager.addEntity(), i);
+    }
+    std::vector<std::thread::id> owners(1000);
+    for(int tick = 0; tick < 10; ++tick)
+    {
+        manager.forMatchingSignature<EC::Meta::TypeList<C0> >(
+            [&owners, tick] (std::size_t id, void*, C0*) {
+                if(tick == 0)
+                {
+                    owners[id] = std::this_thread::get_id();
+                }
+                EXPECT_EQ(owners[id], std::this_thread::get_id());
+            }, nullptr, 4);
+    }
+}
+
+TEST(EC, GrainSize)
+{
+    // Runs tasks in order on the calling thread, counting the Entities
+    // visited by each.
+    struct CountingExecutor : public EC::Executor
+    {
+        std::vector<std::size_t> taskCounts;
+        std::vector<std::size_t> visits;
+        std::size_t current = 0;
+
+        void parallelFor(std::size_t taskCount,
+            const std::function<void(std::size_t)>& task) override
+        {
+            taskCounts.push_back(taskCount);
+            visits.assign(taskCount, 0);
+            for(current = 0; current < taskCount; ++current)
+            {
+                task(current);
+            }
+        }
+    } executor;
+
+    EC::Manager<ListComponentsAll, ListTagsAll> manager;
+    manager.setExecutor(&executor);
+    for(int i = 0; i < 100; ++i)
+    {
+        manager.addComponent<C0>(manager.addEntity(), i);
+    }
+    std::size_t calls = 0;
+    auto visit = [&executor, &calls] (std::size_t, void*, C0*) {
+        ++calls;
+        if(!executor.visits.empty())
+        {
+            ++executor.visits[executor.current];
+        }
+    };
+
+    // Too few Entities for the default grain size run inline.
+    EXPECT_EQ(std::size_t(EC_DEFAULT_GRAIN_SIZE), manager.getGrainSize());
+    manager.forMatchingSignature<EC::Meta::TypeList<C0> >(visit, nullptr, 8);
+    EXPECT_TRUE(executor.taskCounts.empty());
+    EXPECT_EQ(100u, calls);
+
+    // Larger splits are even rather than leaving the remainder to the last.
+    manager.setGrainSize(10);
+    manager.forMatchingSignature<EC::Meta::TypeList<C0> >(visit, nullptr, 8);
+    EXPECT_EQ(std::vector<std::size_t>({8}), executor.taskCounts);
+    EXPECT_EQ(std::vector<std::size_t>({13, 13, 13, 13, 12, 12, 12, 12}),
+        executor.visits);
+
+    // Per-call and per-stored-function grain sizes override the Manager's.
+    executor.taskCounts.clear();
+    manager.forMatchingSignature<EC::Meta::TypeList<C0> >(
+        visit, nullptr, 8, 40);
+    auto id = manager.addForMatchingFunction<EC::Meta::TypeList<C0> >(visit);
+    EXPECT_TRUE(manager.changeForMatchingFunctionGrainSize(id, 30));
+    EXPECT_FALSE(manager.changeForMatchingFunctionGrainSize(id + 1, 30));
+    manager.callForMatchingFunction(id, 8);
+    // Finding the function's Entities uses the Manager's grain size.
+    EXPECT_EQ(std::vector<std::size_t>({2, 8, 3}), executor.taskCounts);
+    EXPECT_EQ(std::vector<std::size_t>({34, 33, 33}), executor.visits);
+    EXPECT_EQ(400u, calls);
+}